@@ -339,6 +339,18 @@ function mockGetBalance({ accountNumber }) {
     return { success: true, balance: acc.balance, message: "Баланс получен (MOCK)." };
 }
 
+function mockDashboard({ userId }) {
+    const user = findMockUserById(userId);
+    if (!user) return { success: false, message: "Пользователь не найден (MOCK)." };
+    return {
+        success: true,
+        user: { id: user.id, fullName: user.fullName, email: user.email },
+        accounts: user.accounts.map(a => ({ number: a.number, balance: a.balance })),
+        accountCount: user.accounts.length,
+        accountLimit: 3
+    };
+}
+
 function mockPost(action, data) {
     switch (action) {
         case "register": return mockRegister(data);
@@ -350,6 +362,7 @@ function mockPost(action, data) {
         case "withdraw": return mockWithdraw(data);
         case "transfer": return mockTransfer(data);
         case "getBalance": return mockGetBalance(data);
+        case "dashboard": return mockDashboard(data);
         default:
             return { success: false, message: "Неизвестное действие (MOCK): " + action };
     }
@@ -376,11 +389,12 @@ async function sendPostToServer(action, data) {
     }
 }
 
-async function fetchAccountsFromServer(userId) {
+// Профиль, счета и балансы одним запросом (action=dashboard)
+async function fetchDashboardFromServer(userId) {
     if (USE_MOCK) {
-        return sendPostToServer("getAccounts", { userId });
+        return sendPostToServer("dashboard", { userId });
     }
-    const resp = await fetch(`${API_URL}?action=getAccounts&userId=${encodeURIComponent(userId)}`);
+    const resp = await fetch(`${API_URL}?action=dashboard&userId=${encodeURIComponent(userId)}`);
     const text = await resp.text();
     try {
         return JSON.parse(text);
@@ -389,17 +403,14 @@ async function fetchAccountsFromServer(userId) {
     }
 }
 
-async function fetchBalanceFromServer(accountNumber) {
-    if (USE_MOCK) {
-        return sendPostToServer("getBalance", { accountNumber });
-    }
-    const resp = await fetch(`${API_URL}?action=getBalance&accountNumber=${encodeURIComponent(accountNumber)}`);
-    const text = await resp.text();
-    try {
-        return JSON.parse(text);
-    } catch {
-        return { success: false, message: "Сервер вернул не JSON: " + text };
+function applyDashboard(res) {
+    currentAccounts = res.accounts || [];
+    if (res.user && res.user.fullName) {
+        currentUserName = res.user.fullName;
+        localStorage.setItem("currentUserName", currentUserName);
+        updateUserInfoUI();
     }
+    storeAccountsToLocal();
 }
 
 function initAuthPage() {
@@ -500,10 +511,9 @@ async function initMainPage() {
             window.location.href = "auth.html";
         });
     }
-    const res = await fetchAccountsFromServer(currentUserId);
+    const res = await fetchDashboardFromServer(currentUserId);
     if (res.success) {
-        currentAccounts = res.accounts || [];
-        storeAccountsToLocal();
+        applyDashboard(res);
         if (currentAccounts.length > 0) {
             selectedAccountNumber = currentAccounts[0].number;
         }
@@ -525,10 +535,9 @@ async function initMainPage() {
             setStatus("accountStatus", "Создание счёта...", "status--info");
             const r = await sendPostToServer("createAccount", { userId: currentUserId });
             if (r.success) {
-                const res2 = await fetchAccountsFromServer(currentUserId);
+                const res2 = await fetchDashboardFromServer(currentUserId);
                 if (res2.success) {
-                    currentAccounts = res2.accounts || [];
-                    storeAccountsToLocal();
+                    applyDashboard(res2);
                     selectedAccountNumber = r.accountNumber;
                     renderAccounts();
                     updateBalanceUI();
@@ -646,13 +655,15 @@ async function initMainPage() {
                 return;
             }
             setStatus("transferStatus", "Запрос баланса...", "status--info");
-            const r = await fetchBalanceFromServer(acc.number);
+            const r = await fetchDashboardFromServer(currentUserId);
             if (r.success) {
-                acc.balance = r.balance ?? acc.balance;
-                storeAccountsToLocal();
+                applyDashboard(r);
+                if (!getSelectedAccount()) {
+                    selectedAccountNumber = currentAccounts[0]?.number || null;
+                }
                 renderAccounts();
                 updateBalanceUI();
-                setStatus("transferStatus", r.message || "Баланс обновлён.", "status--success");
+                setStatus("transferStatus", "Балансы обновлены.", "status--success");
             } else {
                 setStatus("transferStatus", r.message || "Ошибка при запросе баланса.", "status--error");
             }
@@ -683,10 +694,9 @@ async function handleDeleteAccount(accountNumber) {
     });
 
     if (r.success) {
-        const res = await fetchAccountsFromServer(currentUserId);
+        const res = await fetchDashboardFromServer(currentUserId);
         if (res.success) {
-            currentAccounts = res.accounts || [];
-            storeAccountsToLocal();
+            applyDashboard(res);
             if (selectedAccountNumber === accountNumber) {
                 selectedAccountNumber = currentAccounts[0]?.number || null;
             }
@@ -1,28 +1,246 @@
+// Сборка:
+//   g++ -O2 -std=c++17 bank.cpp -o bank.cgi -pthread -lcgicc -lpq -lfcgi -lcrypto
+//
+// Один и тот же бинарник работает и как обычный CGI (процесс на запрос),
+// и как постоянный FastCGI-воркер (mod_fcgid, spawn-fcgi и т.п.) —
+// режим определяется автоматически при запуске.
+//
+// bank.cgi --serve [порт] — самостоятельный HTTP/1.1-сервер (epoll, keep-alive).
+
 #include <iostream>
 #include <string>
 #include <vector>
 #include <sstream>
 #include <cstdlib>
+#include <cmath>
 #include <ctime>
 #include <algorithm>
 #include <stdexcept>
+#include <fstream>
+#include <map>
+#include <deque>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <bitset>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <type_traits>
+#include <random>
+#include <memory>
+#include <unistd.h>
+#include <cerrno>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <csignal>
+#include <functional>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <cgicc/Cgicc.h>
 #include <cgicc/HTTPPlainHeader.h>
 #include <libpq-fe.h>
+#include <fcgiapp.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
 
 using namespace std;
 using namespace cgicc;
 
-// ===================== НАСТРОЙКИ ПОДКЛЮЧЕНИЯ К Postgres =====================
+// ===================== КОНФИГУРАЦИЯ =====================
+
+// Строка подключения по умолчанию (если не задана в конфиге)
+const char* DEFAULT_CONNINFO = "dbname=bankdb user=bank_user password=Dima1234 host=localhost port=5432";
+
+// Настройки читаются из файла key = value (путь в BANK_CONFIG, по умолчанию ./bank.conf).
+// Переменная окружения BANK_<KEY> (например BANK_POOL_MAX) перекрывает значение из файла.
+// Пример со всеми ключами — bank.conf.example.
+class Config {
+public:
+    Config() {
+        const char* path = std::getenv("BANK_CONFIG");
+        ifstream in(path ? path : "bank.conf");
+        string line;
+        while (getline(in, line)) {
+            size_t hash = line.find('#');
+            if (hash != string::npos) line.erase(hash);
+            size_t eq = line.find('=');
+            if (eq == string::npos) continue;
+            string key = trim(line.substr(0, eq));
+            if (!key.empty()) values[key] = trim(line.substr(eq + 1));
+        }
+    }
+
+    string get(const string& key, const string& def) const {
+        string envName = "BANK_";
+        for (char c : key) envName.push_back(static_cast<char>(toupper((unsigned char)c)));
+        const char* env = std::getenv(envName.c_str());
+        if (env) return env;
+
+        auto it = values.find(key);
+        return it != values.end() ? it->second : def;
+    }
+
+    int getInt(const string& key, int def) const {
+        string v = get(key, "");
+        if (v.empty()) return def;
+        char* end = nullptr;
+        long n = strtol(v.c_str(), &end, 10);
+        if (*end != '\0') return def;
+        return static_cast<int>(n);
+    }
+
+private:
+    static string trim(const string& s) {
+        size_t b = s.find_first_not_of(" \t\r");
+        if (b == string::npos) return "";
+        size_t e = s.find_last_not_of(" \t\r");
+        return s.substr(b, e - b + 1);
+    }
+
+    map<string, string> values;
+};
+
+const Config& config() {
+    static Config cfg;
+    return cfg;
+}
+
+// ===================== ДЕНЬГИ =====================
+
+// Денежная сумма в копейках. Все расчёты идут в целых числах: нет дрейфа
+// округления, а разбор и вывод не зависят от локали (в отличие от stod/to_string).
+// В БД баланс хранится как numeric(18,2); в запросы сумма уходит копейками
+// ($n::bigint / 100.0), обратно читается как (balance * 100)::bigint.
+struct Money {
+    int64_t minor = 0;
+
+    Money() {}
+    explicit Money(int64_t minorUnits) : minor(minorUnits) {}
+
+    bool operator<(const Money& o) const  { return minor < o.minor; }
+    bool operator>(const Money& o) const  { return minor > o.minor; }
+    bool operator<=(const Money& o) const { return minor <= o.minor; }
+    bool operator==(const Money& o) const { return minor == o.minor; }
+    Money operator+(const Money& o) const { return Money(minor + o.minor); }
+    Money operator-(const Money& o) const { return Money(minor - o.minor); }
+};
+
+// Разбор суммы вида "123", "-123", "123.4", "123.45" (разделитель — точка или запятая).
+// Больше двух знаков после разделителя, больше 16 знаков до него (предел numeric(18,2)),
+// экспонента и пробелы — ошибка.
+bool parseMoney(const char* s, size_t len, Money& out) {
+    size_t i = 0;
+    bool negative = false;
+    if (i < len && (s[i] == '-' || s[i] == '+')) {
+        negative = (s[i] == '-');
+        ++i;
+    }
+
+    int64_t units = 0;
+    size_t intDigits = 0;
+    while (i < len && s[i] >= '0' && s[i] <= '9') {
+        if (++intDigits > 16) return false;
+        units = units * 10 + (s[i] - '0');
+        ++i;
+    }
+
+    int64_t cents = 0;
+    size_t fracDigits = 0;
+    if (i < len && (s[i] == '.' || s[i] == ',')) {
+        ++i;
+        while (i < len && s[i] >= '0' && s[i] <= '9') {
+            if (++fracDigits > 2) return false;
+            cents = cents * 10 + (s[i] - '0');
+            ++i;
+        }
+    }
+    if (i != len || intDigits + fracDigits == 0) return false;
+    if (fracDigits == 1) cents *= 10;
+
+    int64_t minor = units * 100 + cents;
+    out.minor = negative ? -minor : minor;
+    return true;
+}
+
+bool parseMoney(const string& s, Money& out) {
+    return parseMoney(s.data(), s.size(), out);
+}
+
+// Запись суммы в виде "-123.45" в buf (нужно не меньше 24 байт), возвращает конец записи
+char* formatMoney(char* buf, Money m) {
+    char* p = buf;
+    uint64_t v;
+    if (m.minor < 0) {
+        *p++ = '-';
+        v = static_cast<uint64_t>(-(m.minor + 1)) + 1;
+    } else {
+        v = static_cast<uint64_t>(m.minor);
+    }
+
+    uint64_t units = v / 100;
+    unsigned cents = static_cast<unsigned>(v % 100);
+
+    char tmp[24];
+    int n = 0;
+    do {
+        tmp[n++] = static_cast<char>('0' + units % 10);
+        units /= 10;
+    } while (units != 0);
+    while (n > 0) *p++ = tmp[--n];
+
+    *p++ = '.';
+    *p++ = static_cast<char>('0' + cents / 10);
+    *p++ = static_cast<char>('0' + cents % 10);
+    return p;
+}
+
+string formatMoney(Money m) {
+    char buf[24];
+    return string(buf, formatMoney(buf, m));
+}
+
+ostream& operator<<(ostream& os, Money m) {
+    char buf[24];
+    return os.write(buf, formatMoney(buf, m) - buf);
+}
 
-const char* CONNINFO = "dbname=bankdb user=bank_user password=Dima1234 host=localhost port=5432";
+// ===================== СЛУЧАЙНЫЕ ЧИСЛА =====================
+
+// Генератор на поток, засеянный из random_device. В отличие от rand() со
+// srand(time(nullptr)) он потокобезопасен, и процессы, запущенные в одну
+// секунду, не получают одинаковых последовательностей.
+mt19937_64& rng() {
+    thread_local mt19937_64 gen([] {
+        random_device rd;
+        seed_seq seq{rd(), rd(), rd(), rd()};
+        return mt19937_64(seq);
+    }());
+    return gen;
+}
+
+// Случайное целое из [0, n)
+uint64_t randomBelow(uint64_t n) {
+    return uniform_int_distribution<uint64_t>(0, n - 1)(rng());
+}
 
 // ===================== ВСПОМОГАТЕЛЬНЫЕ СТРУКТУРЫ (НЕ БД, ПРОСТО ДЛЯ УДОБСТВА) =====================
 
 struct Account {
     string number;
-    double balance;
+    Money balance;
 };
 
 struct User {
@@ -32,956 +250,5772 @@ struct User {
     string password;
 };
 
-// ===================== RAII-ОБЁРТКА ДЛЯ СОЕДИНЕНИЯ С БД =====================
+// ===================== РЕЕСТР ПОДГОТОВЛЕННЫХ ЗАПРОСОВ =====================
+
+// Горячие запросы готовятся (PQprepare) один раз на соединение пула и дальше
+// выполняются через PQexecPrepared — без повторного разбора и планирования.
+// Типы параметров задаются явно: целые и суммы передаются в бинарном формате.
+enum StmtId {
+    STMT_USER_BY_ID,
+    STMT_USER_BY_EMAIL,
+    STMT_USER_ID_BY_EMAIL,
+    STMT_INSERT_USER,
+    STMT_UPGRADE_PASSWORD,
+    STMT_USER_WITH_ACCOUNTS,
+    STMT_CREATE_ACCOUNT,
+    STMT_OWNED_ACCOUNT_BALANCE,
+    STMT_DELETE_ACCOUNT,
+    STMT_ACCOUNT_BALANCE,
+    STMT_BALANCE_ADD,
+    STMT_WITHDRAW,
+    STMT_TRANSFER,
+    STMT_HISTORY,
+    STMT_STATEMENT_EXPORT,
+    STMT_TRANSFER_DEBIT,
+    STMT_TRANSFER_CREDIT,
+    STMT_XFER_DECIDE,
+    STMT_XFER_OUTCOME,
+    STMT_XFER_IN_DOUBT,
+    // Варианты для счетов со слотами баланса (account_slots = 1, см. resolveStmt)
+    STMT_USER_WITH_ACCOUNTS_SLOTS,
+    STMT_OWNED_ACCOUNT_BALANCE_SLOTS,
+    STMT_ACCOUNT_BALANCE_SLOTS,
+    STMT_BALANCE_ADD_SLOTS,
+    STMT_WITHDRAW_SLOTS,
+    STMT_TRANSFER_SLOTS,
+    STMT_TRANSFER_DEBIT_SLOTS,
+    STMT_TRANSFER_CREDIT_SLOTS,
+    STMT_COUNT
+};
 
-struct PgConn {
-    PGconn* conn;
+// OID базовых типов PostgreSQL (pg_type.h в клиентских заголовках нет)
+const Oid BOOLOID = 16;
+const Oid INT8OID = 20;
+const Oid INT4OID = 23;
+const Oid TEXTOID = 25;
+const Oid INT8ARRAYOID = 1016;
 
-    PgConn() {
-        conn = PQconnectdb(CONNINFO);
-        if (PQstatus(conn) != CONNECTION_OK) {
-            string msg = PQerrorMessage(conn);
-            PQfinish(conn);
-            throw runtime_error("Ошибка подключения к БД: " + msg);
-        }
-    }
+const int STMT_MAX_PARAMS = 4;
 
-    ~PgConn() {
-        if (conn) {
-            PQfinish(conn);
-        }
-    }
+struct StmtDef {
+    const char* name;
+    const char* sql;
+    int nParams;
+    Oid paramTypes[STMT_MAX_PARAMS];
 };
 
-// ===================== ВСПОМОГАТЕЛЬНЫЕ ШТУКИ =====================
+const StmtDef STATEMENTS[STMT_COUNT] = {
+    { "user_by_id",
+      "SELECT id, full_name, email, password FROM users WHERE id = $1", 1, { INT4OID } },
+    { "user_by_email",
+      "SELECT id, full_name, email, password FROM users WHERE email = $1", 1, { TEXTOID } },
+    { "user_id_by_email",
+      "SELECT id FROM users WHERE email = $1", 1, { TEXTOID } },
+    { "insert_user",
+      "INSERT INTO users(full_name, email, password) VALUES ($1, $2, $3) RETURNING id",
+      3, { TEXTOID, TEXTOID, TEXTOID } },
+    // Замена хранимого пароля новым хэшем при входе; условие на старое значение —
+    // чтобы не затереть пароль, сменившийся за это время
+    { "upgrade_password",
+      "UPDATE users SET password = $2 WHERE id = $1 AND password = $3",
+      3, { INT4OID, TEXTOID, TEXTOID } },
+    // Профиль и все счета пользователя одним запросом: по строке на счёт,
+    // у пользователя без счетов — одна строка с NULL в столбцах счёта,
+    // у несуществующего — ни одной.
+    { "user_with_accounts",
+      "SELECT u.id, u.full_name, u.email, a.number, (a.balance * 100)::bigint"
+      "  FROM users u LEFT JOIN accounts a ON a.user_id = u.id"
+      " WHERE u.id = $1"
+      " ORDER BY a.id",
+      1, { INT4OID } },
+    // Создание счёта за один запрос: проверка пользователя, лимита счетов и вставка
+    // под блокировкой строки пользователя (см. create_account в schema.sql).
+    // Занятый номер не даёт ошибки — вызывающий просто повторяет с другим номером.
+    // Результат: найден ли пользователь, сколько у него было счетов, вставлен ли счёт.
+    { "create_account",
+      "SELECT user_found, account_count, inserted FROM create_account($1, $2, $3)",
+      3, { INT4OID, TEXTOID, INT8OID } },
+    { "owned_account_balance",
+      "SELECT (balance * 100)::bigint FROM accounts WHERE user_id = $1 AND number = $2",
+      2, { INT4OID, TEXTOID } },
+    { "delete_account",
+      "DELETE FROM accounts WHERE user_id = $1 AND number = $2", 2, { INT4OID, TEXTOID } },
+    { "account_balance",
+      "SELECT (balance * 100)::bigint FROM accounts WHERE number = $1", 1, { TEXTOID } },
+    // Пополнение на сумму частей ($2 — массив сумм в копейках; несколько частей —
+    // при склейке пополнений). В журнал — по записи на часть, с балансом так,
+    // как если бы части применялись по одной в порядке массива.
+    { "balance_add",
+      "WITH parts AS ("
+      "    SELECT x, ord FROM unnest($2) WITH ORDINALITY AS p(x, ord)"
+      "), upd AS ("
+      "    UPDATE accounts SET balance = balance + (SELECT SUM(x) FROM parts) / 100.0"
+      "    WHERE number = $1 RETURNING id, balance"
+      "), ins AS ("
+      "    INSERT INTO ledger(account_id, kind, amount, balance_after)"
+      "    SELECT upd.id, 'topup', parts.x / 100.0,"
+      "           upd.balance - (SUM(parts.x) OVER (ORDER BY parts.ord DESC) - parts.x) / 100.0"
+      "    FROM upd, parts ORDER BY parts.ord"
+      ") "
+      "SELECT (balance * 100)::bigint FROM upd", 2, { TEXTOID, INT8ARRAYOID } },
+    // Снятие за один запрос: строка блокируется, списание выполняется только
+    // при достаточном балансе. Результат: найден ли счёт, новый баланс
+    // (NULL — недостаточно средств).
+    { "withdraw",
+      "WITH acc AS ("
+      "    SELECT balance FROM accounts WHERE number = $1 FOR UPDATE"
+      "), upd AS ("
+      "    UPDATE accounts SET balance = balance - $2 / 100.0"
+      "    WHERE number = $1 AND (SELECT balance FROM acc) >= $2 / 100.0"
+      "    RETURNING id, balance"
+      "), ins AS ("
+      "    INSERT INTO ledger(account_id, kind, amount, balance_after)"
+      "    SELECT id, 'withdraw', -($2 / 100.0), balance FROM upd"
+      ") "
+      "SELECT EXISTS (SELECT 1 FROM acc), (SELECT (balance * 100)::bigint FROM upd)",
+      2, { TEXTOID, INT8OID } },
+    // Перевод за один запрос: обе строки блокируются в порядке номеров счетов
+    // (а не в порядке from/to), поэтому встречные переводы между одной парой
+    // счетов не взаимоблокируются. Списание и зачисление выполняются только
+    // если оба счёта найдены и средств хватает; в журнал — обе стороны перевода.
+    // Результат: найден ли отправитель, найден ли получатель, новый баланс
+    // отправителя (NULL — перевод не выполнен).
+    { "transfer",
+      "WITH locked AS ("
+      "    SELECT number, balance FROM accounts"
+      "    WHERE number IN ($1, $2)"
+      "    ORDER BY number"
+      "    FOR UPDATE"
+      "), chk AS ("
+      "    SELECT (SELECT balance FROM locked WHERE number = $1) AS from_balance,"
+      "           EXISTS (SELECT 1 FROM locked WHERE number = $2) AS to_found"
+      "), upd AS ("
+      "    UPDATE accounts a"
+      "    SET balance = a.balance + CASE WHEN a.number = $1"
+      "                                   THEN -($3 / 100.0)"
+      "                                   ELSE $3 / 100.0 END"
+      "    FROM chk"
+      "    WHERE a.number IN ($1, $2)"
+      "      AND chk.to_found AND chk.from_balance >= $3 / 100.0"
+      "    RETURNING a.id, a.number, a.balance"
+      "), ins AS ("
+      "    INSERT INTO ledger(account_id, kind, amount, balance_after, counterparty)"
+      "    SELECT id,"
+      "           CASE WHEN number = $1 THEN 'transfer_out' ELSE 'transfer_in' END,"
+      "           CASE WHEN number = $1 THEN -($3 / 100.0) ELSE $3 / 100.0 END,"
+      "           balance,"
+      "           CASE WHEN number = $1 THEN $2 ELSE $1 END"
+      "    FROM upd ORDER BY number = $1 DESC"
+      ") "
+      "SELECT chk.from_balance IS NOT NULL, chk.to_found,"
+      "       (SELECT (balance * 100)::bigint FROM upd WHERE number = $1) "
+      "FROM chk", 3, { TEXTOID, TEXTOID, INT8OID } },
+    // Страница журнала счёта, от новых записей к старым: не больше $3 записей
+    // с id меньше курсора $2. Ключевая пагинация — индекс (account_id, id)
+    // отдаёт страницу за O(размер страницы) на любой глубине. У счёта без
+    // записей (на этой странице) — одна строка с NULL, у несуществующего — ни одной.
+    { "history",
+      "SELECT l.id, l.kind, (l.amount * 100)::bigint, (l.balance_after * 100)::bigint,"
+      "       l.counterparty,"
+      "       to_char(l.created_at AT TIME ZONE 'UTC', 'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"')"
+      "  FROM accounts a LEFT JOIN LATERAL ("
+      "      SELECT * FROM ledger"
+      "       WHERE account_id = a.id AND id < $2"
+      "       ORDER BY id DESC LIMIT $3"
+      "  ) l ON true"
+      " WHERE a.number = $1"
+      " ORDER BY l.id DESC",
+      3, { TEXTOID, INT8OID, INT4OID } },
+    // Выписка за период [$2, $3] (даты UTC включительно; '-infinity'/'infinity' —
+    // без границы), от старых записей к новым. Читается построчно (dbStreamPrepared).
+    { "statement_export",
+      "SELECT l.id, l.kind, (l.amount * 100)::bigint, (l.balance_after * 100)::bigint,"
+      "       l.counterparty,"
+      "       to_char(l.created_at AT TIME ZONE 'UTC', 'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"')"
+      "  FROM accounts a JOIN ledger l ON l.account_id = a.id"
+      " WHERE a.number = $1"
+      "   AND l.created_at >= $2::date::timestamp AT TIME ZONE 'UTC'"
+      "   AND l.created_at < ($3::date + 1)::timestamp AT TIME ZONE 'UTC'"
+      " ORDER BY l.created_at, l.id",
+      3, { TEXTOID, TEXTOID, TEXTOID } },
+    // Стороны перевода между шардами (ShardTransfers): каждая выполняется на своём
+    // шарде в транзакции, которая затем подготавливается (PREPARE TRANSACTION).
+    // $3 — номер второго счёта для журнала. Результат как у withdraw: найден ли
+    // счёт, новый баланс (NULL — недостаточно средств; у зачисления не бывает).
+    { "transfer_debit",
+      "WITH acc AS ("
+      "    SELECT balance FROM accounts WHERE number = $1 FOR UPDATE"
+      "), upd AS ("
+      "    UPDATE accounts SET balance = balance - $2 / 100.0"
+      "    WHERE number = $1 AND (SELECT balance FROM acc) >= $2 / 100.0"
+      "    RETURNING id, balance"
+      "), ins AS ("
+      "    INSERT INTO ledger(account_id, kind, amount, balance_after, counterparty)"
+      "    SELECT id, 'transfer_out', -($2 / 100.0), balance, $3 FROM upd"
+      ") "
+      "SELECT EXISTS (SELECT 1 FROM acc), (SELECT (balance * 100)::bigint FROM upd)",
+      3, { TEXTOID, INT8OID, TEXTOID } },
+    { "transfer_credit",
+      "WITH upd AS ("
+      "    UPDATE accounts SET balance = balance + $2 / 100.0"
+      "    WHERE number = $1 RETURNING id, balance"
+      "), ins AS ("
+      "    INSERT INTO ledger(account_id, kind, amount, balance_after, counterparty)"
+      "    SELECT id, 'transfer_in', $2 / 100.0, balance, $3 FROM upd"
+      ") "
+      "SELECT EXISTS (SELECT 1 FROM upd), (SELECT (balance * 100)::bigint FROM upd)",
+      3, { TEXTOID, INT8OID, TEXTOID } },
+    // Решение «фиксировать» перевод между шардами — на шарде отправителя.
+    // Конфликт ключа — восстановление уже решило «откатить».
+    { "xfer_decide",
+      "INSERT INTO xfer_outcomes(gid, committed) VALUES ($1, true)", 1, { TEXTOID } },
+    // Исход перевода; нет решения — записывается и возвращается «откатить»
+    { "xfer_outcome",
+      "SELECT xfer_outcome($1)", 1, { TEXTOID } },
+    // Подготовленные транзакции переводов старше $1 секунд — их координатор,
+    // по-видимому, не дожил до COMMIT/ROLLBACK PREPARED
+    { "xfer_in_doubt",
+      "SELECT gid FROM pg_prepared_xacts"
+      " WHERE database = current_database() AND gid LIKE 'bank\\_x:%'"
+      "   AND prepared < now() - $1 * interval '1 second'"
+      " ORDER BY prepared",
+      1, { INT4OID } },
+    // Слоты баланса: баланс счёта — основная строка плюс сумма слотов, запись
+    // идёт через функции из schema.sql. Формат результата совпадает
+    // с соответствующими запросами выше.
+    { "user_with_accounts_slots",
+      "SELECT u.id, u.full_name, u.email, a.number,"
+      "       ((a.balance + COALESCE((SELECT SUM(s.balance) FROM account_slots s"
+      "                                WHERE s.account_id = a.id), 0)) * 100)::bigint"
+      "  FROM users u LEFT JOIN accounts a ON a.user_id = u.id"
+      " WHERE u.id = $1"
+      " ORDER BY a.id",
+      1, { INT4OID } },
+    { "owned_account_balance_slots",
+      "SELECT (account_total(id) * 100)::bigint FROM accounts WHERE user_id = $1 AND number = $2",
+      2, { INT4OID, TEXTOID } },
+    { "account_balance_slots",
+      "SELECT (account_total(id) * 100)::bigint FROM accounts WHERE number = $1", 1, { TEXTOID } },
+    { "balance_add_slots",
+      "SELECT (b * 100)::bigint FROM slots_credit($1, $2) b WHERE b IS NOT NULL",
+      2, { TEXTOID, INT8ARRAYOID } },
+    { "withdraw_slots",
+      "SELECT acc_found, (new_balance * 100)::bigint FROM slots_withdraw($1, $2 / 100.0)",
+      2, { TEXTOID, INT8OID } },
+    { "transfer_slots",
+      "SELECT from_found, to_found, (new_balance * 100)::bigint"
+      "  FROM slots_transfer($1, $2, $3 / 100.0)",
+      3, { TEXTOID, TEXTOID, INT8OID } },
+    { "transfer_debit_slots",
+      "SELECT acc_found, (new_balance * 100)::bigint FROM slots_transfer_debit($1, $2 / 100.0, $3)",
+      3, { TEXTOID, INT8OID, TEXTOID } },
+    { "transfer_credit_slots",
+      "SELECT acc_found, (new_balance * 100)::bigint FROM slots_transfer_credit($1, $2 / 100.0, $3)",
+      3, { TEXTOID, INT8OID, TEXTOID } },
+};
 
-void printJsonHeader() {
-    cout << "Content-type: application/json\n\n";
+// С account_slots = 1 запросы к балансам заменяются вариантами со слотами.
+// Подмена делается здесь, в одном месте: обработчики и пакетный режим
+// по-прежнему ссылаются на обычные запросы.
+StmtId resolveStmt(StmtId id) {
+    static const bool slots = config().getInt("account_slots", 0) != 0;
+    if (!slots) return id;
+    switch (id) {
+    case STMT_USER_WITH_ACCOUNTS:    return STMT_USER_WITH_ACCOUNTS_SLOTS;
+    case STMT_OWNED_ACCOUNT_BALANCE: return STMT_OWNED_ACCOUNT_BALANCE_SLOTS;
+    case STMT_ACCOUNT_BALANCE:       return STMT_ACCOUNT_BALANCE_SLOTS;
+    case STMT_BALANCE_ADD:           return STMT_BALANCE_ADD_SLOTS;
+    case STMT_WITHDRAW:              return STMT_WITHDRAW_SLOTS;
+    case STMT_TRANSFER:              return STMT_TRANSFER_SLOTS;
+    case STMT_TRANSFER_DEBIT:        return STMT_TRANSFER_DEBIT_SLOTS;
+    case STMT_TRANSFER_CREDIT:       return STMT_TRANSFER_CREDIT_SLOTS;
+    default:                         return id;
+    }
 }
 
-void jsonError(const string& msg) {
-    printJsonHeader();
-    cout << "{ \"success\": false, \"message\": \"" << msg << "\" }";
-}
+// ===================== ТИПИЗИРОВАННЫЙ ОБМЕН С БД (БИНАРНЫЙ ФОРМАТ) =====================
 
-void jsonOkMessage(const string& msg) {
-    printJsonHeader();
-    cout << "{ \"success\": true, \"message\": \"" << msg << "\" }";
-}
+// Параметры запроса. Целые и суммы уходят в бинарном формате (сетевой порядок байт),
+// строки — текстом как есть. Значения лежат во встроенных буферах, без аллокаций;
+// строки не копируются, поэтому должны жить до выполнения запроса.
+class PgParams {
+public:
+    PgParams() {}
+    PgParams(const PgParams&) = delete;
+    PgParams& operator=(const PgParams&) = delete;
 
-bool parseIntSafe(const string& s, int& out) {
-    try {
-        size_t idx;
-        int v = stoi(s, &idx);
-        if (idx != s.size()) return false;
-        out = v;
-        return true;
-    } catch (...) {
-        return false;
+    PgParams& int4(int32_t v) {
+        uint32_t be = htonl(static_cast<uint32_t>(v));
+        return binary(&be, sizeof(be));
     }
-}
 
-bool parseDoubleSafe(const string& s, double& out) {
-    try {
-        size_t idx;
-        double v = stod(s, &idx);
-        if (idx != s.size()) return false;
-        out = v;
-        return true;
-    } catch (...) {
-        return false;
+    PgParams& int8(int64_t v) {
+        uint64_t be = htobe64(static_cast<uint64_t>(v));
+        return binary(&be, sizeof(be));
     }
-}
 
-string getParam(Cgicc& cgi, const string& name, bool& present) {
-    form_iterator it = cgi.getElement(name);
-    if (it == cgi.getElements().end()) {
-        present = false;
-        return "";
+    PgParams& money(Money m) {
+        return int8(m.minor);
     }
-    present = true;
-    return it->getValue();
-}
 
-bool isAllDigits(const string& s) {
-    if (s.empty()) return false;
-    for (char c : s) {
-        if (!isdigit((unsigned char)c)) return false;
+    PgParams& text(const string& s) {
+        checkRoom();
+        vals[n] = s.c_str();
+        lens[n] = static_cast<int>(s.size());
+        fmts[n] = 0;
+        ++n;
+        return *this;
     }
-    return true;
+
+    int size() const                  { return n; }
+    const char* const* values() const { return vals; }
+    const int* lengths() const        { return lens; }
+    const int* formats() const        { return fmts; }
+
+private:
+    PgParams& binary(const void* data, int len) {
+        checkRoom();
+        memcpy(bin[n], data, len);
+        vals[n] = bin[n];
+        lens[n] = len;
+        fmts[n] = 1;
+        ++n;
+        return *this;
+    }
+
+    void checkRoom() const {
+        if (n >= STMT_MAX_PARAMS) throw logic_error("Слишком много параметров запроса.");
+    }
+
+    const char* vals[STMT_MAX_PARAMS];
+    int lens[STMT_MAX_PARAMS];
+    int fmts[STMT_MAX_PARAMS];
+    char bin[STMT_MAX_PARAMS][8];
+    int n = 0;
+};
+
+// Массив сумм в копейках в текстовом виде ("{100,250}") — для параметра bigint[]
+string pgMoneyArray(const vector<Money>& parts) {
+    string out = "{";
+    for (size_t i = 0; i < parts.size(); ++i) {
+        if (i) out.push_back(',');
+        out += to_string(parts[i].minor);
+    }
+    out.push_back('}');
+    return out;
 }
 
-// генерация 16-значного номера счётa
-string generateAccountNumber() {
-    string num = "4000";
-    for (int i = 0; i < 12; ++i) {
-        int d = rand() % 10;
-        num.push_back('0' + d);
+// Чтение значений из бинарного результата. Длина проверяется, чтобы расхождение
+// типа в SQL и в коде давало понятную ошибку, а не мусорное значение.
+const char* pgBinaryValue(const PGresult* res, int row, int col, int expectedLen) {
+    if (PQfformat(res, col) != 1 || PQgetlength(res, row, col) != expectedLen) {
+        throw runtime_error("Неожиданный формат ответа БД (столбец " + to_string(col) + ").");
     }
-    return num;
+    return PQgetvalue(res, row, col);
 }
 
-// ===================== ВСПОМОГАТЕЛЬНЫЕ ФУНКЦИИ РАБОТЫ С БД =====================
+int32_t pgInt4(const PGresult* res, int row, int col) {
+    uint32_t be;
+    memcpy(&be, pgBinaryValue(res, row, col, 4), 4);
+    return static_cast<int32_t>(ntohl(be));
+}
 
-// Проверка, существует ли пользователь по id
-bool dbUserExists(PGconn* conn, int userId) {
-    const char* params[1];
-    string userIdStr = to_string(userId);
-    params[0] = userIdStr.c_str();
-
-    PGresult* res = PQexecParams(
-        conn,
-        "SELECT 1 FROM users WHERE id = $1",
-        1,
-        nullptr,
-        params,
-        nullptr,
-        nullptr,
-        0
-    );
+int64_t pgInt8(const PGresult* res, int row, int col) {
+    uint64_t be;
+    memcpy(&be, pgBinaryValue(res, row, col, 8), 8);
+    return static_cast<int64_t>(be64toh(be));
+}
 
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        PQclear(res);
-        throw runtime_error("Ошибка запроса к БД (dbUserExists)");
-    }
+bool pgBool(const PGresult* res, int row, int col) {
+    return pgBinaryValue(res, row, col, 1)[0] != 0;
+}
 
-    bool exists = (PQntuples(res) > 0);
-    PQclear(res);
-    return exists;
+Money pgMoney(const PGresult* res, int row, int col) {
+    return Money(pgInt8(res, row, col));
 }
 
-// Получить пользователя по логину (id или email)
-bool dbFindUserByLogin(PGconn* conn, const string& login, User& outUser) {
-    PGresult* res = nullptr;
-    const char* params[1];
+string pgText(const PGresult* res, int row, int col) {
+    return string(PQgetvalue(res, row, col), PQgetlength(res, row, col));
+}
 
-    if (isAllDigits(login)) {
-        string idStr = login;
-        params[0] = idStr.c_str();
-
-        res = PQexecParams(
-            conn,
-            "SELECT id, full_name, email, password FROM users WHERE id = $1::int",
-            1,
-            nullptr,
-            params,
-            nullptr,
-            nullptr,
-            0
-        );
-    } else {
-        params[0] = login.c_str();
-        res = PQexecParams(
-            conn,
-            "SELECT id, full_name, email, password FROM users WHERE email = $1",
-            1,
-            nullptr,
-            params,
-            nullptr,
-            nullptr,
-            0
-        );
-    }
+// Строки результатов, кроме Account и User
+struct WithdrawRow {
+    bool found;
+    bool applied;        // false — недостаточно средств
+    Money newBalance;
+};
 
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        PQclear(res);
-        throw runtime_error("Ошибка запроса к БД (dbFindUserByLogin)");
-    }
+struct UserAccountRow {
+    User user;           // без пароля
+    bool hasAccount;     // false — у пользователя нет счетов
+    Account account;
+};
 
-    if (PQntuples(res) == 0) {
-        PQclear(res);
-        return false;
-    }
+struct CreateAccountRow {
+    bool userFound;
+    int64_t accountCount;   // счетов у пользователя до вставки
+    bool inserted;          // false — лимит или номер занят
+};
 
-    outUser.id       = stoi(PQgetvalue(res, 0, 0));
-    outUser.fullName = PQgetvalue(res, 0, 1);
-    outUser.email    = PQgetvalue(res, 0, 2);
-    outUser.password = PQgetvalue(res, 0, 3);
+struct TransferRow {
+    bool fromFound;
+    bool toFound;
+    bool applied;        // false — недостаточно средств
+    Money newFromBalance;
+};
 
-    PQclear(res);
-    return true;
-}
+struct LedgerEntry {
+    int64_t id;
+    string kind;            // topup, withdraw, transfer_out, transfer_in
+    Money amount;           // со знаком
+    Money balanceAfter;
+    string counterparty;    // пусто, если не перевод
+    string createdAt;       // ISO 8601, UTC
+};
 
-// Получить все счета пользователя
-vector<Account> dbGetAccounts(PGconn* conn, int userId) {
-    const char* params[1];
-    string userIdStr = to_string(userId);
-    params[0] = userIdStr.c_str();
+struct HistoryRow {
+    bool hasEntry;          // false — на этой странице записей нет
+    LedgerEntry entry;
+};
 
-    PGresult* res = PQexecParams(
-        conn,
-        "SELECT number, balance FROM accounts WHERE user_id = $1 ORDER BY id",
-        1,
-        nullptr,
-        params,
-        nullptr,
-        nullptr,
-        0
-    );
+// Декодеры строк: раскладка столбцов каждого типа описана в одном месте
+// и проверяется на этапе компиляции выбором специализации.
+template <typename T> struct RowDecoder;
 
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        PQclear(res);
-        throw runtime_error("Ошибка запроса к БД (dbGetAccounts)");
+template <> struct RowDecoder<User> {
+    static const int columns = 4;   // id, full_name, email, password
+    static User decode(const PGresult* res, int row) {
+        User u;
+        u.id       = pgInt4(res, row, 0);
+        u.fullName = pgText(res, row, 1);
+        u.email    = pgText(res, row, 2);
+        u.password = pgText(res, row, 3);
+        return u;
     }
+};
 
-    vector<Account> result;
-    int rows = PQntuples(res);
-    for (int i = 0; i < rows; ++i) {
+template <> struct RowDecoder<Account> {
+    static const int columns = 2;   // number, (balance * 100)::bigint
+    static Account decode(const PGresult* res, int row) {
         Account a;
-        a.number  = PQgetvalue(res, i, 0);
-        a.balance = stod(PQgetvalue(res, i, 1));
-        result.push_back(a);
+        a.number  = pgText(res, row, 0);
+        a.balance = pgMoney(res, row, 1);
+        return a;
     }
+};
 
-    PQclear(res);
-    return result;
-}
-
-// Подсчитать количество счетов пользователя
-int dbCountAccounts(PGconn* conn, int userId) {
-    const char* params[1];
-    string userIdStr = to_string(userId);
-    params[0] = userIdStr.c_str();
-
-    PGresult* res = PQexecParams(
-        conn,
-        "SELECT COUNT(*) FROM accounts WHERE user_id = $1",
-        1,
-        nullptr,
-        params,
-        nullptr,
-        nullptr,
-        0
-    );
-
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        PQclear(res);
-        throw runtime_error("Ошибка запроса к БД (dbCountAccounts)");
+template <> struct RowDecoder<Money> {
+    static const int columns = 1;   // (balance * 100)::bigint
+    static Money decode(const PGresult* res, int row) {
+        return pgMoney(res, row, 0);
     }
+};
 
-    int count = stoi(PQgetvalue(res, 0, 0));
-    PQclear(res);
-    return count;
-}
+template <> struct RowDecoder<WithdrawRow> {
+    static const int columns = 2;   // найден, новый баланс или NULL
+    static WithdrawRow decode(const PGresult* res, int row) {
+        WithdrawRow w;
+        w.found      = pgBool(res, row, 0);
+        w.applied    = !PQgetisnull(res, row, 1);
+        w.newBalance = w.applied ? pgMoney(res, row, 1) : Money();
+        return w;
+    }
+};
 
-// Найти баланс счёта по номеру (если нет — возвращаем false)
-bool dbGetAccountBalance(PGconn* conn, const string& accNumber, double& balanceOut) {
-    const char* params[1];
-    params[0] = accNumber.c_str();
-
-    PGresult* res = PQexecParams(
-        conn,
-        "SELECT balance FROM accounts WHERE number = $1",
-        1,
-        nullptr,
-        params,
-        nullptr,
-        nullptr,
-        0
-    );
+template <> struct RowDecoder<UserAccountRow> {
+    static const int columns = 5;   // id, full_name, email, номер или NULL, баланс или NULL
+    static UserAccountRow decode(const PGresult* res, int row) {
+        UserAccountRow r;
+        r.user.id       = pgInt4(res, row, 0);
+        r.user.fullName = pgText(res, row, 1);
+        r.user.email    = pgText(res, row, 2);
+        r.hasAccount    = !PQgetisnull(res, row, 3);
+        if (r.hasAccount) {
+            r.account.number  = pgText(res, row, 3);
+            r.account.balance = pgMoney(res, row, 4);
+        }
+        return r;
+    }
+};
 
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        PQclear(res);
-        throw runtime_error("Ошибка запроса к БД (dbGetAccountBalance)");
+template <> struct RowDecoder<CreateAccountRow> {
+    static const int columns = 3;   // найден пользователь, число счетов, вставлен ли счёт
+    static CreateAccountRow decode(const PGresult* res, int row) {
+        CreateAccountRow c;
+        c.userFound    = pgBool(res, row, 0);
+        c.accountCount = pgInt8(res, row, 1);
+        c.inserted     = pgBool(res, row, 2);
+        return c;
     }
+};
 
-    if (PQntuples(res) == 0) {
-        PQclear(res);
-        return false;
+template <> struct RowDecoder<TransferRow> {
+    static const int columns = 3;   // найден отправитель, найден получатель, баланс или NULL
+    static TransferRow decode(const PGresult* res, int row) {
+        TransferRow t;
+        t.fromFound      = pgBool(res, row, 0);
+        t.toFound        = pgBool(res, row, 1);
+        t.applied        = !PQgetisnull(res, row, 2);
+        t.newFromBalance = t.applied ? pgMoney(res, row, 2) : Money();
+        return t;
     }
+};
 
-    balanceOut = stod(PQgetvalue(res, 0, 0));
-    PQclear(res);
-    return true;
-}
+template <> struct RowDecoder<LedgerEntry> {
+    static const int columns = 6;   // id, вид, сумма, баланс после, контрагент, время
+    static LedgerEntry decode(const PGresult* res, int row) {
+        LedgerEntry e;
+        e.id           = pgInt8(res, row, 0);
+        e.kind         = pgText(res, row, 1);
+        e.amount       = pgMoney(res, row, 2);
+        e.balanceAfter = pgMoney(res, row, 3);
+        e.counterparty = pgText(res, row, 4);
+        e.createdAt    = pgText(res, row, 5);
+        return e;
+    }
+};
 
-// ===================== HANDLERS =====================
+template <> struct RowDecoder<HistoryRow> {
+    static const int columns = 6;   // как у LedgerEntry или все NULL
+    static HistoryRow decode(const PGresult* res, int row) {
+        HistoryRow h;
+        h.hasEntry = !PQgetisnull(res, row, 0);
+        if (h.hasEntry) h.entry = RowDecoder<LedgerEntry>::decode(res, row);
+        return h;
+    }
+};
 
-// REGISTER
-void handleRegister(Cgicc& cgi) {
-    bool pFull, pEmail, pPwd;
-    string fullName = getParam(cgi, "fullName", pFull);
-    string email    = getParam(cgi, "email",    pEmail);
-    string password = getParam(cgi, "password", pPwd);
+template <typename T>
+T decodeRow(const PGresult* res, int row) {
+    if (PQnfields(res) != RowDecoder<T>::columns) {
+        throw runtime_error("Неожиданное число столбцов в ответе БД.");
+    }
+    return RowDecoder<T>::decode(res, row);
+}
 
-    if (!pFull || !pEmail || !pPwd || fullName.empty() || email.empty() || password.size() < 6) {
-        jsonError("Некорректные данные регистрации.");
-        return;
+template <typename T>
+vector<T> decodeRows(const PGresult* res) {
+    vector<T> rows;
+    int n = PQntuples(res);
+    rows.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        rows.push_back(decodeRow<T>(res, i));
     }
+    return rows;
+}
 
-    try {
-        PgConn db;
+using Clock = chrono::steady_clock;
 
-        // Проверка уникальности email
-        const char* params[1];
-        params[0] = email.c_str();
-        PGresult* res = PQexecParams(
-            db.conn,
-            "SELECT id FROM users WHERE email = $1",
-            1,
-            nullptr,
-            params,
-            nullptr,
-            nullptr,
-            0
-        );
+// ===================== ГИСТОГРАММЫ ЗАДЕРЖЕК =====================
 
-        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            PQclear(res);
-            throw runtime_error("Ошибка запроса к БД (register: check email)");
-        }
+// Гистограмма в духе HdrHistogram: интервалы [2^k, 2^(k+1)) поделены на 16 равных
+// частей, поэтому квантили считаются с относительной погрешностью не больше 1/16
+// во всём диапазоне от микросекунд до суток. Запись — атомарные инкременты без блокировок.
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int MAX_BITS = 40;   // до 2^40 мкс (~12 суток); больше — в последнее ведро
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT;
 
-        if (PQntuples(res) > 0) {
-            PQclear(res);
-            jsonError("Пользователь с таким email уже существует.");
-            return;
-        }
-        PQclear(res);
+    void record(uint64_t micros) {
+        counts[index(micros)].fetch_add(1, memory_order_relaxed);
+        total.fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(micros, memory_order_relaxed);
+    }
 
-        // Вставка пользователя
-        const char* params2[3];
-        params2[0] = fullName.c_str();
-        params2[1] = email.c_str();
-        params2[2] = password.c_str();
-
-        res = PQexecParams(
-            db.conn,
-            "INSERT INTO users(full_name, email, password) "
-            "VALUES ($1, $2, $3) RETURNING id",
-            3,
-            nullptr,
-            params2,
-            nullptr,
-            nullptr,
-            0
-        );
+    uint64_t count() const { return total.load(memory_order_relaxed); }
+    uint64_t sumMicros() const { return sum.load(memory_order_relaxed); }
 
-        if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
-            PQclear(res);
-            throw runtime_error("Ошибка вставки пользователя.");
+    // Сколько значений не превышает micros (с точностью до границ вёдер)
+    uint64_t countAtMost(uint64_t micros) const {
+        uint64_t n = 0;
+        for (int i = 0; i < BUCKETS && upperBound(i) - 1 <= micros; ++i) {
+            n += counts[i].load(memory_order_relaxed);
         }
+        return n;
+    }
 
-        int newId = stoi(PQgetvalue(res, 0, 0));
-        PQclear(res);
+    // Квантиль q (0..1): верхняя граница ведра, в которое он попадает
+    uint64_t quantile(double q) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(q * n + 0.5));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i].load(memory_order_relaxed);
+            if (seen >= rank) return upperBound(i) - 1;
+        }
+        return upperBound(BUCKETS - 1) - 1;
+    }
 
-        printJsonHeader();
-        cout << "{ \"success\": true, "
-             << "\"message\": \"Регистрация выполнена.\", "
-             << "\"userId\": " << newId << ", "
-             << "\"fullName\": \"" << fullName << "\" }";
+    static int index(uint64_t v) {
+        if (v < SUB_COUNT) return static_cast<int>(v);
+        int msb = 63 - __builtin_clzll(v);
+        if (msb >= MAX_BITS) return BUCKETS - 1;
+        int shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + static_cast<int>((v >> shift) - SUB_COUNT);
+    }
 
-    } catch (const exception& e) {
-        jsonError(string("Внутренняя ошибка (register): ") + e.what());
+    static uint64_t upperBound(int idx) {
+        if (idx < SUB_COUNT) return static_cast<uint64_t>(idx) + 1;
+        int shift = idx / SUB_COUNT - 1;
+        return (static_cast<uint64_t>(SUB_COUNT + idx % SUB_COUNT + 1)) << shift;
     }
+
+private:
+    atomic<uint64_t> counts[BUCKETS]{};
+    atomic<uint64_t> total{0};
+    atomic<uint64_t> sum{0};
+};
+
+uint64_t microsSince(Clock::time_point start) {
+    return static_cast<uint64_t>(
+        chrono::duration_cast<chrono::microseconds>(Clock::now() - start).count());
 }
 
-// LOGIN
-void handleLogin(Cgicc& cgi) {
-    bool pLogin, pPwd;
-    string login = getParam(cgi, "login", pLogin);
-    string password = getParam(cgi, "password", pPwd);
+// ===================== FIBER'Ы И ОЖИДАНИЕ ВВОДА-ВЫВОДА =====================
 
-    if (!pLogin || !pPwd || login.empty() || password.empty()) {
-        jsonError("Введите логин и пароль.");
-        return;
-    }
+struct Response;
 
-    try {
-        PgConn db;
-        User u;
-        if (!dbFindUserByLogin(db.conn, login, u) || u.password != password) {
-            jsonError("Неверный логин или пароль.");
-            return;
-        }
+// Виды неуспешных ответов (для метрик)
+enum ErrorKind {
+    ERR_NONE,
+    ERR_REJECTED,      // отказ по данным запроса: нет счёта, мало средств, неверный пароль...
+    ERR_INTERNAL,      // исключение в обработчике (БД недоступна, ошибка SQL и т.п.)
+    ERR_BAD_REQUEST,   // запрос не удалось разобрать
+    ERR_THROTTLED,     // не допущен контролем нагрузки (429/503)
+    ERR_TIMEOUT,       // истёк срок запроса (504)
+    ERROR_KIND_COUNT
+};
 
-        printJsonHeader();
-        cout << "{ \"success\": true, "
-             << "\"message\": \"Вход выполнен.\", "
-             << "\"userId\": " << u.id << ", "
-             << "\"fullName\": \"" << u.fullName << "\" }";
+const char* const ERROR_KIND_NAMES[ERROR_KIND_COUNT] = {
+    "none", "rejected", "internal", "bad_request", "throttled", "timeout"
+};
 
-    } catch (const exception& e) {
-        jsonError(string("Внутренняя ошибка (login): ") + e.what());
-    }
-}
+// Какой срок истёк (см. СРОКИ ЗАПРОСОВ)
+enum TimeoutKind {
+    TIMEOUT_NONE,
+    TIMEOUT_POOL,        // не дождались свободного соединения пула
+    TIMEOUT_CONNECT,     // не успели подключиться к БД
+    TIMEOUT_LOCK,        // сервер: lock_timeout (55P03)
+    TIMEOUT_STATEMENT,   // сервер: statement_timeout (57014)
+    TIMEOUT_DEADLINE,    // истёк срок запроса, запрос к БД отменён (PQcancel)
+    TIMEOUT_HASH,        // не дождались потока хэширования паролей
+    TIMEOUT_KIND_COUNT
+};
 
-// GET ACCOUNTS
-void handleGetAccounts(Cgicc& cgi) {
-    bool pUid;
-    string sUserId = getParam(cgi, "userId", pUid);
-    if (!pUid || sUserId.empty()) {
-        jsonError("Не указан userId.");
-        return;
-    }
+const char* const TIMEOUT_KIND_NAMES[TIMEOUT_KIND_COUNT] = {
+    "none", "pool", "connect", "lock", "statement", "deadline", "hash"
+};
 
-    int userId = 0;
-    if (!parseIntSafe(sUserId, userId)) {
-        jsonError("Некорректный userId.");
-        return;
-    }
+// Состояние запроса, который сейчас обрабатывается. В HTTP-сервере (--serve) один
+// поток по очереди выполняет много запросов, каждый в своём fiber'е, поэтому
+// указатель currentRequest сохраняется и восстанавливается при каждом переключении.
+struct RequestContext {
+    Response* response = nullptr;
+    CgiInput* input = nullptr;    // источник запроса (переменные окружения, cookie)
+    int action = -1;              // индекс в ACTIONS, -1 — не распознано
+    ErrorKind error = ERR_NONE;
+    uint32_t dbRoundTrips = 0;
+    Clock::time_point deadline = Clock::time_point::max();   // срок ответа; max() — без срока
+    TimeoutKind timeout = TIMEOUT_NONE;                      // первый истёкший срок
+};
 
-    try {
-        PgConn db;
+thread_local RequestContext* currentRequest = nullptr;
 
-        if (!dbUserExists(db.conn, userId)) {
-            jsonError("Пользователь не найден.");
-            return;
-        }
+// ===================== СРОКИ ЗАПРОСОВ =====================
+//
+// У каждого действия свой срок ответа (ActionDef::budgetMs, deadline_<action>).
+// Он ограничивает всё, чего запрос ждёт от БД: выдачу соединения пулом,
+// подключение, ответ на каждый запрос (по истечении запрос отменяется на
+// сервере через PQcancel). Сервер дополнительно ограничивает себя сам:
+// statement_timeout/lock_timeout сессии (db_statement_timeout, db_lock_timeout),
+// а в явных транзакциях — остатком срока запроса. Запрос, у которого истёк
+// какой-либо срок, получает ответ 504 с видом таймаута.
 
-        auto accounts = dbGetAccounts(db.conn, userId);
+atomic<uint64_t> timeoutsTotal[TIMEOUT_KIND_COUNT];   // запросы по виду истёкшего срока
 
-        printJsonHeader();
-        cout << "{ \"success\": true, \"accounts\": [";
+// Миллисекунд до момента t (не меньше 0)
+int msUntil(Clock::time_point t) {
+    auto left = chrono::duration_cast<chrono::milliseconds>(t - Clock::now()).count();
+    return static_cast<int>(max<int64_t>(0, left));
+}
 
-        for (size_t i = 0; i < accounts.size(); ++i) {
-            if (i > 0) cout << ", ";
-            cout << "{ \"number\": \"" << accounts[i].number << "\", "
-                 << "\"balance\": " << accounts[i].balance << " }";
-        }
+// Сколько мс осталось до срока текущего запроса; -1 — срока нет
+int requestTimeLeftMs() {
+    if (!currentRequest || currentRequest->deadline == Clock::time_point::max()) return -1;
+    return msUntil(currentRequest->deadline);
+}
 
-        cout << "] }";
+Clock::time_point requestDeadline() {
+    return currentRequest ? currentRequest->deadline : Clock::time_point::max();
+}
 
-    } catch (const exception& e) {
-        jsonError(string("Внутренняя ошибка (getAccounts): ") + e.what());
+// Учесть истёкший срок. Запрос считается один раз — по первому сроку,
+// остальные обычно лишь его следствие; фоновые потоки — каждый раз.
+void noteTimeout(TimeoutKind kind) {
+    if (currentRequest) {
+        if (currentRequest->timeout != TIMEOUT_NONE) return;
+        currentRequest->timeout = kind;
     }
+    ++timeoutsTotal[kind];
 }
 
-// CREATE ACCOUNT
-void handleCreateAccount(Cgicc& cgi) {
-    bool pUid;
-    string sUserId = getParam(cgi, "userId", pUid);
-    if (!pUid || sUserId.empty()) {
-        jsonError("Не указан userId.");
-        return;
+// На время жизни объекта снять срок текущего запроса: то, что начато, надо
+// довести до конца и после него (вторая фаза перевода, откат при возврате в пул)
+class DeadlineExempt {
+public:
+    DeadlineExempt() : ctx(currentRequest) {
+        if (ctx) {
+            saved = ctx->deadline;
+            ctx->deadline = Clock::time_point::max();
+        }
     }
 
-    int userId = 0;
-    if (!parseIntSafe(sUserId, userId)) {
-        jsonError("Некорректный userId.");
-        return;
+    ~DeadlineExempt() {
+        if (ctx) ctx->deadline = saved;
     }
 
-    try {
-        PgConn db;
+    DeadlineExempt(const DeadlineExempt&) = delete;
+    DeadlineExempt& operator=(const DeadlineExempt&) = delete;
 
-        if (!dbUserExists(db.conn, userId)) {
-            jsonError("Пользователь не найден.");
-            return;
-        }
+private:
+    RequestContext* ctx;
+    Clock::time_point saved;
+};
 
-        int cnt = dbCountAccounts(db.conn, userId);
-        if (cnt >= 3) {
-            jsonError("Нельзя создать больше 3 счетов.");
-            return;
+// Лёгкий поток выполнения со своим стеком (ucontext). Переключения кооперативные:
+// fiber отдаёт управление, только когда ждёт готовности сокета или таймера.
+struct Fiber {
+    ucontext_t ctx;
+    char* stack = nullptr;
+    size_t stackSize = 0;
+    function<void()> fn;
+    RequestContext* request = nullptr;
+    bool finished = false;
+    bool waiting = false;    // стоит в epoll/таймерах и ещё не разбужен
+    bool timedOut = false;
+};
+
+// Цикл событий одного потока: epoll + таймеры + очередь готовых fiber'ов
+class EventLoop {
+public:
+    EventLoop() : epfd(epoll_create1(EPOLL_CLOEXEC)) {
+        if (epfd < 0) throw runtime_error(string("epoll_create1: ") + strerror(errno));
+        long page = sysconf(_SC_PAGESIZE);
+        size_t kb = static_cast<size_t>(max(64, config().getInt("fiber_stack_kb", 256)));
+        stackSize = (kb * 1024 + page - 1) / page * page;
+    }
+
+    ~EventLoop() {
+        close(epfd);
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    void spawn(function<void()> fn) {
+        Fiber* f = new Fiber;
+        f->fn = move(fn);
+        f->stackSize = stackSize;
+        // Снизу стека — защитная страница: переполнение падает, а не портит соседей
+        void* mem = mmap(nullptr, stackSize + guardSize(), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (mem == MAP_FAILED) {
+            delete f;
+            throw runtime_error("Не удалось выделить стек fiber'а.");
         }
+        mprotect(mem, guardSize(), PROT_NONE);
+        f->stack = static_cast<char*>(mem);
 
-        // Генерим номер и вставляем. На всякий случай можно проверить на уникальность.
-        string accNumber;
+        getcontext(&f->ctx);
+        f->ctx.uc_stack.ss_sp = f->stack + guardSize();
+        f->ctx.uc_stack.ss_size = stackSize;
+        f->ctx.uc_link = nullptr;
+        makecontext(&f->ctx, &EventLoop::trampoline, 0);
+
+        ready.push_back(f);
+    }
+
+    // Крутить цикл в текущем потоке (не возвращается)
+    void run() {
+        currentLoop = this;
+        epoll_event events[256];
         while (true) {
-            accNumber = generateAccountNumber();
-            const char* paramsCheck[1];
-            paramsCheck[0] = accNumber.c_str();
-            PGresult* resCheck = PQexecParams(
-                db.conn,
-                "SELECT 1 FROM accounts WHERE number = $1",
-                1,
-                nullptr,
-                paramsCheck,
-                nullptr,
-                nullptr,
-                0
-            );
-            if (PQresultStatus(resCheck) != PGRES_TUPLES_OK) {
-                PQclear(resCheck);
-                throw runtime_error("Ошибка проверки номера счета.");
-            }
-            bool exists = (PQntuples(resCheck) > 0);
-            PQclear(resCheck);
-            if (!exists) break; // нашли уникальный
-        }
-
-        const char* params[2];
-        string userIdStr = to_string(userId);
-        params[0] = userIdStr.c_str();
-        params[1] = accNumber.c_str();
-
-        PGresult* res = PQexecParams(
-            db.conn,
-            "INSERT INTO accounts(user_id, number, balance) VALUES ($1::int, $2, 0)",
-            2,
-            nullptr,
-            params,
-            nullptr,
-            nullptr,
-            0
-        );
+            while (!ready.empty()) {
+                Fiber* f = ready.front();
+                ready.pop_front();
+                resume(f);
+            }
 
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            PQclear(res);
-            throw runtime_error("Ошибка вставки счета.");
-        }
-        PQclear(res);
+            int timeout = -1;
+            if (!timers.empty()) {
+                auto left = chrono::duration_cast<chrono::milliseconds>(timers.begin()->first - Clock::now());
+                timeout = static_cast<int>(max<int64_t>(0, left.count() + 1));
+            }
 
-        printJsonHeader();
-        cout << "{ \"success\": true, "
-             << "\"message\": \"Счёт создан.\", "
-             << "\"accountNumber\": \"" << accNumber << "\" }";
+            int n = epoll_wait(epfd, events, 256, timeout);
+            for (int i = 0; i < n; ++i) {
+                Fiber* f = static_cast<Fiber*>(events[i].data.ptr);
+                if (!f->waiting) continue;
+                f->waiting = false;
+                ready.push_back(f);
+            }
 
-    } catch (const exception& e) {
-        jsonError(string("Внутренняя ошибка (createAccount): ") + e.what());
+            // Истёкшие таймеры. Запись разбуженного по событию fiber'а удаляет он сам.
+            auto now = Clock::now();
+            for (auto it = timers.begin(); it != timers.end() && it->first <= now; ) {
+                Fiber* f = it->second;
+                if (f->waiting) {
+                    f->waiting = false;
+                    f->timedOut = true;
+                    ready.push_back(f);
+                    it = timers.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
     }
-}
 
-// DELETE ACCOUNT
-void handleDeleteAccount(Cgicc& cgi) {
-    bool pUid, pAcc;
-    string sUserId = getParam(cgi, "userId", pUid);
-    string accNumber = getParam(cgi, "accountNumber", pAcc);
+    // Вызывается из fiber'а: ждать событий events на fd не дольше deadline.
+    // false — истекло время.
+    bool waitFd(int fd, uint32_t events, Clock::time_point deadline) {
+        Fiber* self = current;
+        epoll_event ev{};
+        ev.events = events | EPOLLONESHOT;
+        ev.data.ptr = self;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0 &&
+            !(errno == EEXIST && epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0)) {
+            throw runtime_error(string("epoll_ctl: ") + strerror(errno));
+        }
 
-    if (!pUid || !pAcc || sUserId.empty() || accNumber.empty()) {
-        jsonError("Не указан userId или accountNumber.");
-        return;
+        bool ok = suspend(deadline);
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        return ok;
     }
 
-    int userId = 0;
-    if (!parseIntSafe(sUserId, userId)) {
-        jsonError("Некорректный userId.");
-        return;
+    // Вызывается из fiber'а: уснуть до deadline
+    void sleepUntil(Clock::time_point deadline) {
+        suspend(deadline);
     }
 
-    try {
-        PgConn db;
+    Fiber* current = nullptr;
 
-        // Сначала узнаём баланс и принадлежность
-        const char* params[2];
-        string userIdStr = to_string(userId);
-        params[0] = userIdStr.c_str();
-        params[1] = accNumber.c_str();
-
-        PGresult* res = PQexecParams(
-            db.conn,
-            "SELECT balance FROM accounts WHERE user_id = $1::int AND number = $2",
-            2,
-            nullptr,
-            params,
-            nullptr,
-            nullptr,
-            0
-        );
+    static thread_local EventLoop* currentLoop;
 
-        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            PQclear(res);
-            throw runtime_error("Ошибка запроса к БД (deleteAccount: select)");
-        }
+private:
+    static size_t guardSize() {
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
 
-        if (PQntuples(res) == 0) {
-            PQclear(res);
-            jsonError("Счёт не найден.");
-            return;
-        }
+    bool suspend(Clock::time_point deadline) {
+        Fiber* self = current;
+        bool timed = deadline != Clock::time_point::max();
+        multimap<Clock::time_point, Fiber*>::iterator timer;
+        if (timed) timer = timers.emplace(deadline, self);
 
-        double balance = stod(PQgetvalue(res, 0, 0));
-        PQclear(res);
+        self->waiting = true;
+        self->timedOut = false;
+        self->request = currentRequest;
+        swapcontext(&self->ctx, &loopCtx);
+        currentRequest = self->request;
 
-        if (balance > 0.0) {
-            jsonError("Нельзя удалить счёт с ненулевым балансом.");
-            return;
-        }
+        if (timed && !self->timedOut) timers.erase(timer);
+        return !self->timedOut;
+    }
 
-        // Удаляем
-        res = PQexecParams(
-            db.conn,
-            "DELETE FROM accounts WHERE user_id = $1::int AND number = $2",
-            2,
-            nullptr,
-            params,
-            nullptr,
-            nullptr,
-            0
-        );
+    void resume(Fiber* f) {
+        current = f;
+        swapcontext(&loopCtx, &f->ctx);
+        current = nullptr;
+        currentRequest = nullptr;
+        if (f->finished) {
+            munmap(f->stack, f->stackSize + guardSize());
+            delete f;
+        }
+    }
 
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            PQclear(res);
-            throw runtime_error("Ошибка удаления счета.");
+    static void trampoline() {
+        EventLoop* loop = currentLoop;
+        Fiber* self = loop->current;
+        try {
+            self->fn();
+        } catch (...) {
+            // Исключение не должно уйти за пределы стека fiber'а
         }
+        self->fn = nullptr;
+        self->finished = true;
+        setcontext(&loop->loopCtx);
+    }
 
-        PQclear(res);
-        jsonOkMessage("Счёт удалён.");
+    int epfd;
+    size_t stackSize;
+    ucontext_t loopCtx;
+    deque<Fiber*> ready;
+    multimap<Clock::time_point, Fiber*> timers;
+};
 
-    } catch (const exception& e) {
-        jsonError(string("Внутренняя ошибка (deleteAccount): ") + e.what());
+thread_local EventLoop* EventLoop::currentLoop = nullptr;
+
+// Ждать готовности fd (POLLIN/POLLOUT) не дольше timeoutMs (-1 — без ограничения).
+// Внутри fiber'а поток отдаётся циклу событий, в обычном потоке — блокирующий poll().
+// false — истекло время.
+bool waitFd(int fd, short events, int timeoutMs) {
+    EventLoop* loop = EventLoop::currentLoop;
+    if (loop && loop->current) {
+        auto deadline = timeoutMs < 0 ? Clock::time_point::max()
+                                      : Clock::now() + chrono::milliseconds(timeoutMs);
+        uint32_t ev = ((events & POLLIN) ? uint32_t(EPOLLIN) : 0u) | ((events & POLLOUT) ? uint32_t(EPOLLOUT) : 0u);
+        return loop->waitFd(fd, ev, deadline);
+    }
+
+    pollfd p{fd, events, 0};
+    while (true) {
+        int n = poll(&p, 1, timeoutMs);
+        if (n < 0 && errno == EINTR) continue;
+        return n != 0;
     }
 }
 
-// TOPUP
-void handleTopup(Cgicc& cgi) {
-    bool pAcc, pAmt;
-    string accNumber = getParam(cgi, "accountNumber", pAcc);
-    string sAmount   = getParam(cgi, "amount", pAmt);
+// Пауза, не блокирующая поток цикла событий
+void sleepMs(int ms) {
+    EventLoop* loop = EventLoop::currentLoop;
+    if (loop && loop->current) {
+        loop->sleepUntil(Clock::now() + chrono::milliseconds(ms));
+    } else {
+        usleep(static_cast<useconds_t>(ms) * 1000);
+    }
+}
 
-    if (!pAcc || !pAmt || accNumber.empty() || sAmount.empty()) {
-        jsonError("Не указан счёт или сумма.");
-        return;
+// Одноразовое событие между потоками на eventfd. Ожидание — через waitFd,
+// поэтому fiber, ждущий сигнала, не останавливает свой цикл событий.
+class Completion {
+public:
+    Completion() : fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+        if (fd < 0) throw runtime_error(string("eventfd: ") + strerror(errno));
     }
 
-    double amount = 0.0;
-    if (!parseDoubleSafe(sAmount, amount) || amount <= 0.0) {
-        jsonError("Сумма должна быть > 0.");
-        return;
+    ~Completion() {
+        close(fd);
     }
 
-    try {
-        PgConn db;
-
-        const char* params[2];
-        params[0] = accNumber.c_str();
-        string amountStr = to_string(amount);
-        params[1] = amountStr.c_str();
-
-        PGresult* res = PQexecParams(
-            db.conn,
-            "UPDATE accounts SET balance = balance + $2::double precision "
-            "WHERE number = $1 "
-            "RETURNING balance",
-            2,
-            nullptr,
-            params,
-            nullptr,
-            nullptr,
-            0
-        );
+    Completion(const Completion&) = delete;
+    Completion& operator=(const Completion&) = delete;
 
-        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            PQclear(res);
-            throw runtime_error("Ошибка обновления баланса (topup).");
-        }
+    void signal() {
+        uint64_t one = 1;
+        ssize_t n = write(fd, &one, sizeof(one));
+        (void)n;
+    }
 
-        if (PQntuples(res) == 0) {
-            PQclear(res);
-            jsonError("Счёт не найден.");
-            return;
-        }
+    bool wait(int timeoutMs) {
+        if (!waitFd(fd, POLLIN, timeoutMs)) return false;
+        uint64_t v;
+        ssize_t n = read(fd, &v, sizeof(v));
+        return n == sizeof(v);
+    }
 
-        double newBalance = stod(PQgetvalue(res, 0, 0));
-        PQclear(res);
+private:
+    int fd;
+};
 
-        printJsonHeader();
-        cout << "{ \"success\": true, "
-             << "\"message\": \"Баланс пополнен.\", "
-             << "\"newBalance\": " << newBalance << " }";
+// ===================== НЕБЛОКИРУЮЩИЙ ОБМЕН С libpq =====================
+//
+// Все соединения пула переведены в неблокирующий режим (PQsetnonblocking).
+// Запрос отправляется через PQsend*, а ответ собирается по готовности сокета
+// (PQconsumeInput/PQisBusy). В fiber'е это означает, что пока БД думает,
+// поток обслуживает другие запросы; в CGI/FastCGI ожидание — обычный poll().
 
-    } catch (const exception& e) {
-        jsonError(string("Внутренняя ошибка (topup): ") + e.what());
-    }
+// Учесть обмен с БД в счётчике текущего запроса
+void noteRoundTrip() {
+    if (currentRequest) ++currentRequest->dbRoundTrips;
 }
 
-// WITHDRAW
-void handleWithdraw(Cgicc& cgi) {
-    bool pAcc, pAmt;
-    string accNumber = getParam(cgi, "accountNumber", pAcc);
-    string sAmount   = getParam(cgi, "amount", pAmt);
-
-    if (!pAcc || !pAmt || accNumber.empty() || sAmount.empty()) {
-        jsonError("Не указан счёт или сумма.");
-        return;
-    }
-
-    double amount = 0.0;
-    if (!parseDoubleSafe(sAmount, amount) || amount <= 0.0) {
-        jsonError("Сумма должна быть > 0.");
-        return;
+// Отмена запросов на сервере (PQcancel). PQcancel сам открывает соединение
+// с сервером и ждёт его синхронно, поэтому в долгоживущих режимах отмены
+// отправляет отдельный поток, а цикл событий не останавливается; в CGI — сразу.
+class QueryCanceller {
+public:
+    atomic<uint64_t> sent{0};
+    atomic<uint64_t> failures{0};
+
+    void start() {
+        started = true;
+        thread([this] { loop(); }).detach();
     }
 
-    try {
-        PgConn db;
-
-        // Сначала узнаём баланс
-        double balance = 0.0;
-        if (!dbGetAccountBalance(db.conn, accNumber, balance)) {
-            jsonError("Счёт не найден.");
+    void cancel(PGconn* conn) {
+        PGcancel* c = PQgetCancel(conn);
+        if (!c) {
+            ++failures;
             return;
         }
-
-        if (balance < amount) {
-            jsonError("Недостаточно средств.");
+        if (!started) {
+            send(c);
             return;
         }
+        lock_guard<mutex> lock(m);
+        queue.push_back(c);
+        cv.notify_one();
+    }
 
-        const char* params[2];
-        params[0] = accNumber.c_str();
-        string amountStr = to_string(amount);
-        params[1] = amountStr.c_str();
-
-        PGresult* res = PQexecParams(
-            db.conn,
-            "UPDATE accounts SET balance = balance - $2::double precision "
-            "WHERE number = $1 "
-            "RETURNING balance",
-            2,
-            nullptr,
-            params,
-            nullptr,
-            nullptr,
-            0
-        );
-
-        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            PQclear(res);
-            throw runtime_error("Ошибка обновления баланса (withdraw).");
+private:
+    void send(PGcancel* c) {
+        char err[256];
+        if (PQcancel(c, err, sizeof(err))) {
+            ++sent;
+        } else {
+            ++failures;
+            cerr << "bank: PQcancel: " << err << "\n";
         }
+        PQfreeCancel(c);
+    }
 
-        if (PQntuples(res) == 0) {
-            PQclear(res);
-            jsonError("Счёт не найден.");
-            return;
+    void loop() {
+        while (true) {
+            PGcancel* c;
+            {
+                unique_lock<mutex> lock(m);
+                cv.wait(lock, [this] { return !queue.empty(); });
+                c = queue.front();
+                queue.pop_front();
+            }
+            send(c);
         }
+    }
 
-        double newBalance = stod(PQgetvalue(res, 0, 0));
-        PQclear(res);
+    atomic<bool> started{false};
+    mutex m;
+    condition_variable cv;
+    deque<PGcancel*> queue;
+};
 
-        printJsonHeader();
-        cout << "{ \"success\": true, "
-             << "\"message\": \"Снятие выполнено.\", "
-             << "\"newBalance\": " << newBalance << " }";
+QueryCanceller& queryCanceller() {
+    static QueryCanceller c;
+    return c;
+}
 
-    } catch (const exception& e) {
-        jsonError(string("Внутренняя ошибка (withdraw): ") + e.what());
-    }
+// Сколько ждать ответа на отмену, прежде чем бросить соединение
+int cancelGraceMs() {
+    static const int grace = max(1, config().getInt("db_cancel_grace", 1000));
+    return grace;
 }
 
-// TRANSFER
-void handleTransfer(Cgicc& cgi) {
-    bool pFrom, pTo, pAmt;
-    string fromAccNumber = getParam(cgi, "fromAccount", pFrom);
-    string toAccNumber   = getParam(cgi, "toAccount",   pTo);
-    string sAmount       = getParam(cgi, "amount",      pAmt);
+// Серверные таймауты: 55P03 — lock_timeout, 57014 — statement_timeout
+void noteServerTimeout(const PGresult* res) {
+    if (PQresultStatus(res) != PGRES_FATAL_ERROR) return;
+    const char* state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    if (!state) return;
+    if (strcmp(state, "55P03") == 0) noteTimeout(TIMEOUT_LOCK);
+    else if (strcmp(state, "57014") == 0) noteTimeout(TIMEOUT_STATEMENT);
+}
 
-    if (!pFrom || !pTo || !pAmt ||
-        fromAccNumber.empty() || toAccNumber.empty() || sAmount.empty()) {
-        jsonError("Нужно указать fromAccount, toAccount и amount.");
-        return;
+// Дописать исходящий буфер libpq в сокет (не дольше срока текущего запроса)
+bool pgFlush(PGconn* conn) {
+    while (true) {
+        int r = PQflush(conn);
+        if (r == 0) return true;
+        if (r < 0) return false;
+        // Пока сервер не вычитал наши данные, он может писать нам — забираем входящие,
+        // иначе оба буфера сокета переполнятся и обмен встанет
+        if (!waitFd(PQsocket(conn), POLLIN | POLLOUT, requestTimeLeftMs())) {
+            noteTimeout(TIMEOUT_DEADLINE);
+            return false;
+        }
+        if (!PQconsumeInput(conn)) return false;
     }
+}
 
-    if (fromAccNumber == toAccNumber) {
-        jsonError("Нельзя перевести на тот же счёт.");
-        return;
+// Следующий результат (аналог PQgetResult, не блокирующий поток). Ответа ждём
+// до срока текущего запроса; истёк — запрос отменяется на сервере, и ответ на
+// отмену (ошибка 57014) приходит обычным результатом. Если сервер не ответил
+// и за db_cancel_grace мс, соединение бросаем: возвращается nullptr, хотя оно
+// ещё занято, и пул его закроет.
+PGresult* pgGetResult(PGconn* conn) {
+    bool cancelled = false;
+    Clock::time_point giveUp;
+    while (PQisBusy(conn)) {
+        int timeoutMs = cancelled ? msUntil(giveUp) : requestTimeLeftMs();
+        if (!waitFd(PQsocket(conn), POLLIN, timeoutMs)) {
+            if (cancelled) return nullptr;
+            noteTimeout(TIMEOUT_DEADLINE);
+            queryCanceller().cancel(conn);
+            cancelled = true;
+            giveUp = Clock::now() + chrono::milliseconds(cancelGraceMs());
+            continue;
+        }
+        if (!PQconsumeInput(conn)) break;
     }
+    PGresult* res = PQgetResult(conn);
+    if (res && !cancelled) noteServerTimeout(res);   // 57014 после своей отмены уже учтён
+    return res;
+}
 
-    double amount = 0.0;
-    if (!parseDoubleSafe(sAmount, amount) || amount <= 0.0) {
-        jsonError("Сумма должна быть > 0.");
-        return;
+// Дождаться всех результатов отправленного запроса. Как и PQexec, возвращает
+// последний результат, а при ошибке — результат с ошибкой; никогда не nullptr.
+PGresult* pgAwait(PGconn* conn) {
+    noteRoundTrip();
+    PGresult* result = nullptr;
+    if (pgFlush(conn)) {
+        while (PGresult* r = pgGetResult(conn)) {
+            if (result && PQresultStatus(result) == PGRES_FATAL_ERROR) {
+                PQclear(r);
+                continue;
+            }
+            if (result) PQclear(result);
+            result = r;
+        }
     }
+    // Ответа не дождались (см. pgGetResult) — частичный результат не годится
+    if (result && PQisBusy(conn)) {
+        PQclear(result);
+        result = nullptr;
+    }
+    return result ? result : PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+}
 
-    try {
-        PgConn db;
-
-        // Транзакция
-        PGresult* res = PQexec(db.conn, "BEGIN");
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            PQclear(res);
-            throw runtime_error("Не удалось начать транзакцию.");
-        }
-        PQclear(res);
+// Неблокирующий аналог PQexec (простой протокол, без параметров)
+PGresult* pgExec(PGconn* conn, const char* sql) {
+    if (!PQsendQuery(conn, sql)) return PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+    return pgAwait(conn);
+}
 
-        // Блокируем обе записи (FOR UPDATE)
-        const char* paramsFrom[1];
-        paramsFrom[0] = fromAccNumber.c_str();
-        res = PQexecParams(
-            db.conn,
-            "SELECT balance FROM accounts WHERE number = $1 FOR UPDATE",
-            1,
-            nullptr,
-            paramsFrom,
-            nullptr,
-            nullptr,
-            0
-        );
+// Ограничения для явной транзакции по остатку срока текущего запроса:
+// statement_timeout — весь остаток, lock_timeout — не больше db_lock_timeout.
+// false — у запроса нет срока, хватит ограничений сессии.
+bool localTimeouts(int& statementMs, int& lockMs) {
+    int left = requestTimeLeftMs();
+    if (left < 0) return false;
+    statementMs = max(1, left);   // 0 в этих параметрах значит «без ограничения»
+    int sessionLock = config().getInt("db_lock_timeout", 2000);
+    lockMs = sessionLock > 0 ? min(sessionLock, statementMs) : statementMs;
+    return true;
+}
 
-        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            PQclear(res);
-            PQexec(db.conn, "ROLLBACK");
-            throw runtime_error("Ошибка выборки счета-отправителя.");
+// Довести PQconnectStart/PQresetStart до конца по готовности сокета.
+// Параметр connect_timeout из conninfo libpq в этом режиме не соблюдает,
+// поэтому срок ожидания ограничиваем сами.
+bool pgPollConnect(PGconn* conn, bool reset, int timeoutMs) {
+    auto deadline = Clock::now() + chrono::milliseconds(timeoutMs);
+    PostgresPollingStatusType st = PGRES_POLLING_WRITING;
+    while (st != PGRES_POLLING_OK && st != PGRES_POLLING_FAILED) {
+        if (PQstatus(conn) == CONNECTION_BAD) return false;
+        auto left = chrono::duration_cast<chrono::milliseconds>(deadline - Clock::now()).count();
+        if (left <= 0 ||
+            !waitFd(PQsocket(conn), st == PGRES_POLLING_READING ? POLLIN : POLLOUT, static_cast<int>(left))) {
+            return false;
         }
+        st = reset ? PQresetPoll(conn) : PQconnectPoll(conn);
+    }
+    return st == PGRES_POLLING_OK && PQsetnonblocking(conn, 1) == 0;
+}
 
-        if (PQntuples(res) == 0) {
-            PQclear(res);
-            PQexec(db.conn, "ROLLBACK");
-            jsonError("Счёт-отправитель не найден.");
-            return;
-        }
+// ===================== ПУЛ СОЕДИНЕНИЙ С БД =====================
 
-        double fromBalance = stod(PQgetvalue(res, 0, 0));
-        PQclear(res);
+struct PooledConn {
+    PGconn* conn;
+    Clock::time_point lastUsed;
+    bitset<STMT_COUNT> prepared;   // какие запросы из реестра уже подготовлены на этом соединении
+};
 
-        const char* paramsTo[1];
-        paramsTo[0] = toAccNumber.c_str();
-        res = PQexecParams(
-            db.conn,
-            "SELECT balance FROM accounts WHERE number = $1 FOR UPDATE",
-            1,
-            nullptr,
-            paramsTo,
-            nullptr,
-            nullptr,
-            0
-        );
+// Ограниченный пул соединений. В FastCGI-режиме соединения переживают запросы,
+// поэтому TCP-подключение и аутентификация не повторяются на каждый запрос.
+class PgPool {
+public:
+    explicit PgPool(const string& conninfo) : conninfo(conninfo) {
+        const Config& cfg = config();
+        minSize        = max(0, cfg.getInt("pool_min", 1));
+        maxSize        = max(1, cfg.getInt("pool_max", 8));
+        idleTimeout    = chrono::seconds(cfg.getInt("pool_idle_timeout", 300));
+        acquireTimeout = chrono::milliseconds(cfg.getInt("pool_acquire_timeout", 2000));
+        checkAfter     = chrono::seconds(cfg.getInt("pool_check_after", 30));
+        connectTimeoutMs = max(1, cfg.getInt("pool_connect_timeout", 5000));
+        statementTimeoutMs = max(0, cfg.getInt("db_statement_timeout", 30000));
+        lockTimeoutMs    = max(0, cfg.getInt("db_lock_timeout", 2000));
+        minSize = min(minSize, maxSize);
+    }
 
-        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            PQclear(res);
-            PQexec(db.conn, "ROLLBACK");
-            throw runtime_error("Ошибка выборки счета-получателя.");
+    ~PgPool() {
+        for (PooledConn* pc : idle) {
+            PQfinish(pc->conn);
+            delete pc;
         }
+    }
 
-        if (PQntuples(res) == 0) {
-            PQclear(res);
-            PQexec(db.conn, "ROLLBACK");
-            jsonError("Счёт-получатель не найден.");
-            return;
+    // Заранее открыть pool_min соединений (для долгоживущих режимов)
+    void warmUp() {
+        vector<PooledConn*> taken;
+        try {
+            while (static_cast<int>(taken.size()) < minSize) {
+                taken.push_back(acquire());
+            }
+        } catch (...) {
+            // БД может быть ещё недоступна — подключимся по первому запросу
         }
+        for (PooledConn* pc : taken) release(pc);
+    }
 
-        double toBalance = stod(PQgetvalue(res, 0, 0));
-        PQclear(res);
-
-        if (fromBalance < amount) {
-            PQexec(db.conn, "ROLLBACK");
-            jsonError("Недостаточно средств.");
-            return;
+    // Счётчики для метрик
+    atomic<uint64_t> acquisitions{0};
+    atomic<uint64_t> acquireWaits{0};      // сколько раз пришлось ждать свободного соединения
+    atomic<uint64_t> acquireTimeouts{0};
+    atomic<uint64_t> connects{0};
+    atomic<uint64_t> connectFailures{0};
+    LatencyHistogram acquireLatency;       // мкс от запроса соединения до его выдачи
+
+    PooledConn* acquire() {
+        auto start = Clock::now();
+        ++acquisitions;
+        try {
+            // Ждём не дольше pool_acquire_timeout и не дольше срока запроса
+            PooledConn* pc = acquireConn(min(start + acquireTimeout, requestDeadline()));
+            acquireLatency.record(microsSince(start));
+            return pc;
+        } catch (...) {
+            acquireLatency.record(microsSince(start));
+            throw;
         }
+    }
 
-        // Обновляем оба счета
-        const char* paramsUpdateFrom[2];
-        const char* paramsUpdateTo[2];
-        string amountStr = to_string(amount);
-        paramsUpdateFrom[0] = amountStr.c_str();
-        paramsUpdateFrom[1] = fromAccNumber.c_str();
-
-        paramsUpdateTo[0] = amountStr.c_str();
-        paramsUpdateTo[1] = toAccNumber.c_str();
-
-        res = PQexecParams(
-            db.conn,
-            "UPDATE accounts SET balance = balance - $1::double precision "
-            "WHERE number = $2",
-            2,
-            nullptr,
-            paramsUpdateFrom,
-            nullptr,
-            nullptr,
-            0
-        );
+    // Снимок состояния: всего соединений, простаивающих, ожидающих очереди
+    void snapshot(int& totalOut, int& idleOut, int& waitingOut) {
+        lock_guard<mutex> lock(m);
+        totalOut = total;
+        idleOut = static_cast<int>(idle.size());
+        waitingOut = static_cast<int>(waiters.size());
+    }
 
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            PQclear(res);
-            PQexec(db.conn, "ROLLBACK");
-            throw runtime_error("Ошибка списания со счета-отправителя.");
+    void release(PooledConn* pc) {
+        // Незавершённую транзакцию (например, после исключения) откатываем,
+        // иначе следующий запрос получил бы чужое состояние. Откат нужен и
+        // запросу, срок которого уже истёк.
+        if (PQstatus(pc->conn) == CONNECTION_OK && PQtransactionStatus(pc->conn) != PQTRANS_IDLE) {
+            DeadlineExempt exempt;
+            PQclear(pgExec(pc->conn, "ROLLBACK"));
         }
-        PQclear(res);
+        bool reusable = PQstatus(pc->conn) == CONNECTION_OK &&
+                        PQtransactionStatus(pc->conn) == PQTRANS_IDLE;
+
+        lock_guard<mutex> lock(m);
+        if (reusable) {
+            pc->lastUsed = Clock::now();
+            idle.push_back(pc);
+        } else {
+            PQfinish(pc->conn);
+            delete pc;
+            --total;
+        }
+        reapIdle();
+        wakeWaiter();
+    }
 
-        res = PQexecParams(
-            db.conn,
-            "UPDATE accounts SET balance = balance + $1::double precision "
-            "WHERE number = $2",
-            2,
-            nullptr,
-            paramsUpdateTo,
-            nullptr,
-            nullptr,
-            0
-        );
+private:
+    PooledConn* acquireConn(Clock::time_point deadline) {
+        unique_lock<mutex> lock(m);
+        bool waited = false;
 
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            PQclear(res);
-            PQexec(db.conn, "ROLLBACK");
-            throw runtime_error("Ошибка зачисления на счёт-получатель.");
+        while (true) {
+            while (!idle.empty()) {
+                PooledConn* pc = idle.back();
+                idle.pop_back();
+                lock.unlock();
+                if (checkHealth(*pc)) return pc;
+
+                PQfinish(pc->conn);
+                delete pc;
+                lock.lock();
+                --total;
+            }
+
+            if (total < maxSize) {
+                ++total;
+                lock.unlock();
+                try {
+                    return new PooledConn{connect(), Clock::now(), {}};
+                } catch (...) {
+                    lock.lock();
+                    --total;
+                    wakeWaiter();
+                    throw;
+                }
+            }
+
+            // Ждём освобождения соединения. Ожидание через Completion, а не condition_variable:
+            // в HTTP-сервере ждёт fiber, и поток его цикла событий должен работать дальше.
+            if (!waited) {
+                waited = true;
+                ++acquireWaits;
+            }
+            Completion freed;
+            waiters.push_back(&freed);
+            lock.unlock();
+            auto left = chrono::duration_cast<chrono::milliseconds>(deadline - Clock::now()).count();
+            bool woke = left > 0 && freed.wait(static_cast<int>(left));
+            lock.lock();
+            // Нет в очереди — release уже выбрал нас для пробуждения
+            auto it = find(waiters.begin(), waiters.end(), &freed);
+            bool signalled = it == waiters.end();
+            if (!signalled) waiters.erase(it);
+
+            if (!woke && idle.empty() && total >= maxSize) {
+                // Сигнал пришёл после таймаута — передаём его следующему, иначе он потерян
+                if (signalled) wakeWaiter();
+                ++acquireTimeouts;
+                noteTimeout(TIMEOUT_POOL);
+                throw runtime_error("Нет свободных соединений с БД (истекло время ожидания).");
+            }
         }
-        PQclear(res);
+    }
 
-        // Получим новый баланс отправителя для ответа
-        double newFromBalance = 0.0;
-        if (!dbGetAccountBalance(db.conn, fromAccNumber, newFromBalance)) {
-            PQexec(db.conn, "ROLLBACK");
-            jsonError("Счёт-отправитель не найден после обновления (странно).");
-            return;
+    // Подключение без блокировки потока (см. pgPollConnect); соединение сразу
+    // переводится в неблокирующий режим
+    PGconn* connect() {
+        ++connects;
+        PGconn* conn = PQconnectStart(conninfo.c_str());
+        if (!conn) throw runtime_error("Ошибка подключения к БД: нет памяти.");
+        if (!pgPollConnect(conn, false, connectBudgetMs())) {
+            ++connectFailures;
+            string msg = PQerrorMessage(conn);
+            if (PQstatus(conn) != CONNECTION_BAD) {
+                noteTimeout(TIMEOUT_CONNECT);
+                msg = "истекло время подключения";
+            }
+            PQfinish(conn);
+            throw runtime_error("Ошибка подключения к БД: " + msg);
         }
+        string err;
+        if (!initSession(conn, err)) {
+            ++connectFailures;
+            PQfinish(conn);
+            throw runtime_error("Ошибка настройки сессии БД: " + err);
+        }
+        return conn;
+    }
 
-        res = PQexec(db.conn, "COMMIT");
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+    // На подключение — pool_connect_timeout, но не дольше срока запроса
+    int connectBudgetMs() const {
+        int left = requestTimeLeftMs();
+        return left < 0 ? connectTimeoutMs : min(connectTimeoutMs, left);
+    }
+
+    // Ограничения сервера на всю сессию: запрос, клиент которого пропал,
+    // или ожидание блокировки не длятся дольше db_statement_timeout/db_lock_timeout
+    bool initSession(PGconn* conn, string& err) {
+        if (statementTimeoutMs == 0 && lockTimeoutMs == 0) return true;
+        string sql = "SET statement_timeout = " + to_string(statementTimeoutMs) +
+                     "; SET lock_timeout = " + to_string(lockTimeoutMs);
+        PGresult* res = pgExec(conn, sql.c_str());
+        bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        if (!ok) err = PQresultErrorMessage(res);
+        PQclear(res);
+        return ok;
+    }
+
+    // Проверка живости: разорванное соединение пробуем восстановить через PQreset,
+    // долго простоявшее — проверяем пустым запросом (сервер мог закрыть его сам).
+    bool checkHealth(PooledConn& pc) {
+        if (PQstatus(pc.conn) == CONNECTION_OK && Clock::now() - pc.lastUsed > checkAfter) {
+            PGresult* res = pgExec(pc.conn, "");
             PQclear(res);
-            throw runtime_error("Ошибка коммита транзакции.");
         }
-        PQclear(res);
+        if (PQstatus(pc.conn) != CONNECTION_OK) {
+            // После переподключения серверная сессия новая — подготовленных запросов в ней нет
+            string err;
+            if (PQresetStart(pc.conn) && pgPollConnect(pc.conn, true, connectBudgetMs())) {
+                if (!initSession(pc.conn, err)) return false;
+            } else if (PQstatus(pc.conn) != CONNECTION_BAD) {
+                noteTimeout(TIMEOUT_CONNECT);
+                return false;
+            }
+            pc.prepared.reset();
+        }
+        return PQstatus(pc.conn) == CONNECTION_OK;
+    }
 
-        printJsonHeader();
-        cout << "{ \"success\": true, "
-             << "\"message\": \"Перевод выполнен.\", "
-             << "\"newBalance\": " << newFromBalance << " }";
+    // Разбудить самого давнего ожидающего (вызывается под мьютексом)
+    void wakeWaiter() {
+        if (waiters.empty()) return;
+        waiters.front()->signal();
+        waiters.pop_front();
+    }
 
-    } catch (const exception& e) {
-        jsonError(string("Внутренняя ошибка (transfer): ") + e.what());
+    // Закрыть соединения сверх pool_min, простаивающие дольше pool_idle_timeout.
+    // Вызывается под мьютексом; idle упорядочен от давно использованных к свежим.
+    void reapIdle() {
+        auto now = Clock::now();
+        while (total > minSize && !idle.empty() && now - idle.front()->lastUsed > idleTimeout) {
+            PQfinish(idle.front()->conn);
+            delete idle.front();
+            idle.pop_front();
+            --total;
+        }
     }
-}
 
-// GET BALANCE
-void handleGetBalance(Cgicc& cgi) {
-    bool pAcc;
-    string accNumber = getParam(cgi, "accountNumber", pAcc);
-    if (!pAcc || accNumber.empty()) {
-        jsonError("Не указан номер счёта.");
-        return;
+    string conninfo;
+    int minSize;
+    int maxSize;
+    chrono::seconds idleTimeout;
+    chrono::milliseconds acquireTimeout;
+    chrono::seconds checkAfter;
+    int connectTimeoutMs;
+    int statementTimeoutMs;
+    int lockTimeoutMs;
+
+    mutex m;
+    deque<Completion*> waiters;
+    deque<PooledConn*> idle;
+    int total = 0;
+};
+
+// ===================== ШАРДЫ =====================
+
+// Список строк подключения через "|" (пустые элементы пропускаются)
+vector<string> splitConninfoList(const string& list) {
+    vector<string> out;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t bar = list.find('|', pos);
+        if (bar == string::npos) bar = list.size();
+        string ci = list.substr(pos, bar - pos);
+        if (ci.find_first_not_of(" \t") != string::npos) out.push_back(ci);
+        pos = bar + 1;
     }
+    return out;
+}
 
-    try {
-        PgConn db;
-        double balance = 0.0;
-        if (!dbGetAccountBalance(db.conn, accNumber, balance)) {
-            jsonError("Счёт не найден.");
-            return;
+const int MAX_SHARDS = 100;   // номер шарда — две цифры номера счёта
+
+// Пользователи и их счета распределены по узлам PostgreSQL: shard_conninfo —
+// строки подключения через "|", позиция в списке — номер шарда (с нуля), у всех
+// процессов список должен быть одинаковым. Пусто — один шард, conninfo.
+// Каждый узел — полная схема schema.sql, настроенная на свой номер
+// (SELECT configure_shard(номер, число_шардов)).
+//
+// Шард находится без обращения к БД:
+//   пользователь — по email (FNV-1a); его id выдаёт последовательность этого
+//                  шарда с шагом N, поэтому (id - 1) % N — тот же шард;
+//   счёт         — по цифрам 5-6 номера: счёт открывается на шарде владельца.
+// Переводы между шардами — двухфазная фиксация (ShardTransfers).
+class ShardMap {
+public:
+    ShardMap() {
+        conninfos = splitConninfoList(config().get("shard_conninfo", ""));
+        if (conninfos.empty()) conninfos.push_back(config().get("conninfo", DEFAULT_CONNINFO));
+        if (static_cast<int>(conninfos.size()) > MAX_SHARDS) {
+            throw runtime_error("Слишком много шардов в shard_conninfo (максимум " +
+                                to_string(MAX_SHARDS) + ").");
         }
+        for (const string& ci : conninfos) pools.emplace_back(new PgPool(ci));
+    }
 
-        printJsonHeader();
-        cout << "{ \"success\": true, "
-             << "\"balance\": " << balance << ", "
-             << "\"message\": \"Баланс получен.\" }";
+    int count() const {
+        return static_cast<int>(pools.size());
+    }
 
-    } catch (const exception& e) {
-        jsonError(string("Внутренняя ошибка (getBalance): ") + e.what());
+    PgPool& pool(int shard) {
+        return *pools[shard];
     }
-}
 
-// ===================== MAIN =====================
+    const string& conninfo(int shard) const {
+        return conninfos[shard];
+    }
 
-int main() {
-    try {
-        srand(static_cast<unsigned>(time(nullptr)));
+    void warmUp() {
+        for (auto& p : pools) p->warmUp();
+    }
 
-        Cgicc cgi;
+    int ofUser(int userId) const {
+        if (count() == 1 || userId <= 0) return 0;   // несуществующий id — любой шард
+        return (userId - 1) % count();
+    }
 
-        bool pAct;
-        string action = getParam(cgi, "action", pAct);
-        if (!pAct || action.empty()) {
-            jsonError("Не указан параметр action.");
-            return 0;
+    int ofEmail(const string& email) const {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char c : email) {
+            h ^= c;
+            h *= 1099511628211ULL;
         }
+        return static_cast<int>(h % static_cast<uint64_t>(count()));
+    }
 
-        if      (action == "register")      handleRegister(cgi);
-        else if (action == "login")         handleLogin(cgi);
-        else if (action == "getAccounts")   handleGetAccounts(cgi);
-        else if (action == "createAccount") handleCreateAccount(cgi);
-        else if (action == "deleteAccount") handleDeleteAccount(cgi);
-        else if (action == "topup")         handleTopup(cgi);
-        else if (action == "withdraw")      handleWithdraw(cgi);
-        else if (action == "transfer")      handleTransfer(cgi);
-        else if (action == "getBalance")    handleGetBalance(cgi);
-        else {
-            jsonError("Неизвестное действие: " + action);
+    // false — номер не указывает ни на один шард (такого счёта заведомо нет).
+    // С одним шардом подходит любой номер, в том числе выданный до шардирования.
+    bool ofAccount(const string& number, int& shard) const {
+        if (count() == 1) {
+            shard = 0;
+            return true;
         }
+        if (number.size() < 6 || !isdigit((unsigned char)number[4]) || !isdigit((unsigned char)number[5])) {
+            return false;
+        }
+        shard = (number[4] - '0') * 10 + (number[5] - '0');
+        return shard < count();
+    }
 
-    } catch (const exception& e) {
-        jsonError(string("Внутренняя ошибка: ") + e.what());
+private:
+    vector<string> conninfos;
+    vector<unique_ptr<PgPool>> pools;
+};
+
+ShardMap& shards() {
+    static ShardMap m;
+    return m;
+}
+
+// ===================== РЕПЛИКИ ДЛЯ ЧТЕНИЯ =====================
+
+// Чтения, которым допустимо небольшое отставание (вход, список счетов, баланс,
+// история, выписка), можно направить на реплики: replica_conninfo — строки
+// подключения через "|". Реплика используется, только если её отставание
+// (replay lag) не больше replica_max_lag_ms; отставание меряет фоновый поток
+// раз в replica_check_interval мс, поэтому маршрутизация работает в долгоживущих
+// режимах (FastCGI, --serve), а в CGI все запросы идут в основную БД.
+//
+// Свои записи клиент видит сразу: успешная запись ставит cookie bank_lw с её
+// временем, и следующие replica_sticky_ms мс чтения этого клиента идут в
+// основную БД, пока реплики их гарантированно не догонят.
+enum DbRoute {
+    DB_PRIMARY,
+    DB_READ,   // реплика, если есть подходящая, иначе основная БД
+};
+
+class ReplicaSet {
+public:
+    struct Replica {
+        unique_ptr<PgPool> pool;
+        atomic<int64_t> lagMs{-1};        // -1 — недоступна или ещё не проверена
+        atomic<int64_t> checkedAt{0};     // мс steady_clock последней проверки
+    };
+
+    // Куда ушли чтения DB_READ (для метрик)
+    atomic<uint64_t> replicaReads{0};
+    atomic<uint64_t> primaryReadsLag{0};      // нет реплики с допустимым отставанием
+    atomic<uint64_t> primaryReadsSticky{0};   // клиент только что писал
+
+    ReplicaSet() {
+        const Config& cfg = config();
+        maxLagMs = cfg.getInt("replica_max_lag_ms", 1000);
+        stickyMs = cfg.getInt("replica_sticky_ms", 5000);
+        intervalMs = max(50, cfg.getInt("replica_check_interval", 500));
+        vector<string> list = splitConninfoList(cfg.get("replica_conninfo", ""));
+        // Реплики описывают единственную основную БД; у каждого шарда были бы свои
+        if (!list.empty() && shards().count() > 1) {
+            cerr << "bank: replica_conninfo не используется вместе с shard_conninfo" << endl;
+            list.clear();
+        }
+        for (const string& ci : list) {
+            replicas.emplace_back(new Replica);
+            replicas.back()->pool.reset(new PgPool(ci));
+        }
+    }
+
+    bool configured() const {
+        return !replicas.empty();
+    }
+
+    int stickyMillis() const {
+        return stickyMs;
+    }
+
+    // Насколько может отставать ответ реплики: допустимый lag плюс время до следующего замера
+    int stalenessBoundMs() const {
+        return maxLagMs + intervalMs;
+    }
+
+    // Запустить проверку отставания; до первой проверки реплики не используются
+    void start() {
+        if (replicas.empty()) return;
+        for (auto& r : replicas) r->pool->warmUp();
+        thread([this] { checkLoop(); }).detach();
+    }
+
+    // Пул для чтения DB_READ: реплика по кругу среди подходящих или основная БД
+    PgPool& route(PgPool& primary) {
+        if (replicas.empty()) return primary;
+        if (recentlyWrote()) {
+            ++primaryReadsSticky;
+            return primary;
+        }
+        int64_t now = steadyMillis();
+        size_t n = replicas.size();
+        size_t first = next.fetch_add(1);
+        for (size_t i = 0; i < n; ++i) {
+            Replica& r = *replicas[(first + i) % n];
+            int64_t lag = r.lagMs.load();
+            // Замер устарел (проверка не проходит) — на реплику не полагаемся
+            if (lag < 0 || lag > maxLagMs || now - r.checkedAt.load() > 3 * intervalMs) continue;
+            ++replicaReads;
+            return *r.pool;
+        }
+        ++primaryReadsLag;
+        return primary;
+    }
+
+    const vector<unique_ptr<Replica>>& all() const {
+        return replicas;
+    }
+
+private:
+    static int64_t steadyMillis() {
+        return chrono::duration_cast<chrono::milliseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    // Cookie bank_lw текущего запроса моложе replica_sticky_ms
+    bool recentlyWrote() const {
+        if (!currentRequest || !currentRequest->input) return false;
+        int64_t at;
+        if (!cookieMillis(currentRequest->input->getenv("HTTP_COOKIE"), "bank_lw", at)) return false;
+        int64_t now = chrono::duration_cast<chrono::milliseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+        return now - at < stickyMs;
+    }
+
+    // Значение cookie name из заголовка Cookie ("a=1; b=2") как целое. Имя
+    // сравнивается целиком (xbank_lw — другая cookie), значение — только число.
+    static bool cookieMillis(const string& header, const char* name, int64_t& out) {
+        size_t nameLen = strlen(name);
+        for (size_t pos = 0; pos < header.size(); ) {
+            size_t end = header.find(';', pos);
+            if (end == string::npos) end = header.size();
+            size_t b = header.find_first_not_of(' ', pos);
+            if (b < end && header.compare(b, nameLen, name) == 0 && b + nameLen < end &&
+                header[b + nameLen] == '=') {
+                size_t v = b + nameLen + 1;
+                size_t e = header.find_last_not_of(' ', end - 1) + 1;
+                const char* first = header.data() + v;
+                const char* last = header.data() + max(v, e);
+                auto r = from_chars(first, last, out);
+                return r.ec == errc() && r.ptr == last && first != last;
+            }
+            pos = end + 1;
+        }
+        return false;
+    }
+
+    void checkLoop() {
+        while (true) {
+            // Позиция WAL основной БД берётся до замеров: реплика, воспроизведшая
+            // её, видит всё, что было зафиксировано к началу проверки
+            string primaryLsn = currentWalLsn(shards().pool(0));
+            for (auto& r : replicas) {
+                r->lagMs = primaryLsn.empty() ? -1 : measureLag(*r->pool, primaryLsn);
+                r->checkedAt = steadyMillis();
+            }
+            this_thread::sleep_for(chrono::milliseconds(intervalMs));
+        }
+    }
+
+    // pg_current_wal_lsn() основной БД; пусто — она недоступна
+    static string currentWalLsn(PgPool& primary) {
+        PooledConn* pc = nullptr;
+        try {
+            pc = primary.acquire();
+        } catch (const exception&) {
+            return "";
+        }
+        PGresult* res = pgExec(pc->conn, "SELECT pg_current_wal_lsn()::text");
+        string lsn;
+        if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+            lsn = PQgetvalue(res, 0, 0);
+        }
+        PQclear(res);
+        primary.release(pc);
+        // Подставляется в текст запроса — допускаем только вид "16/B374D848"
+        if (lsn.empty() || lsn.find_first_not_of("0123456789ABCDEF/") != string::npos) return "";
+        return lsn;
+    }
+
+    // Отставание воспроизведения WAL в мс. Реплика, воспроизведшая позицию
+    // основной БД primaryLsn, — 0 даже при давней последней транзакции; сравнение
+    // с собственным принятым WAL не годится: у реплики с оборванным приёмом
+    // принятое и воспроизведённое совпадают сколь угодно долго. -1 — реплика
+    // недоступна или её отставание не оценить.
+    static int64_t measureLag(PgPool& pool, const string& primaryLsn) {
+        PooledConn* pc = nullptr;
+        try {
+            pc = pool.acquire();
+        } catch (const exception&) {
+            return -1;
+        }
+        string sql =
+            "SELECT CASE WHEN NOT pg_is_in_recovery() THEN 0"
+            "            WHEN pg_last_wal_replay_lsn() >= '" + primaryLsn + "'::pg_lsn THEN 0"
+            "            ELSE COALESCE(EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()) * 1000, -1)"
+            "       END::bigint";
+        PGresult* res = pgExec(pc->conn, sql.c_str());
+        int64_t lag = -1;
+        if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+            lag = atoll(PQgetvalue(res, 0, 0));
+        }
+        PQclear(res);
+        pool.release(pc);
+        return lag;
+    }
+
+    vector<unique_ptr<Replica>> replicas;
+    atomic<size_t> next{0};
+    int maxLagMs;
+    int stickyMs;
+    int intervalMs;
+};
+
+ReplicaSet& replicas() {
+    static ReplicaSet r;
+    return r;
+}
+
+// ===================== RAII-ОБЁРТКА ДЛЯ СОЕДИНЕНИЯ С БД =====================
+
+// Берёт соединение из пула на время жизни объекта и возвращает его обратно.
+// PgConn db(shard) — соединение с основной БД шарда, PgConn db(shard, DB_READ) —
+// для чтения, возможно с реплики.
+struct PgConn {
+    PgPool* pool;
+    PooledConn* pooled;
+    PGconn* conn;
+    int shard;
+
+    PgConn(PgPool& p, int shard) : pool(&p), pooled(p.acquire()), conn(pooled->conn), shard(shard) {}
+
+    explicit PgConn(int shard = 0, DbRoute route = DB_PRIMARY)
+        : PgConn(route == DB_READ ? replicas().route(shards().pool(shard)) : shards().pool(shard), shard) {}
+
+    ~PgConn() {
+        pool->release(pooled);
+    }
+
+    bool fromReplica() const {
+        return pool != &shards().pool(shard);
+    }
+
+    PgConn(const PgConn&) = delete;
+    PgConn& operator=(const PgConn&) = delete;
+};
+
+// Подготовить запрос из реестра на этом соединении, если это ещё не сделано
+void dbPrepare(PgConn& db, StmtId id) {
+    id = resolveStmt(id);
+    if (db.pooled->prepared[id]) return;
+
+    const StmtDef& def = STATEMENTS[id];
+    PGresult* prep = PQsendPrepare(db.conn, def.name, def.sql, def.nParams, def.paramTypes)
+                     ? pgAwait(db.conn) : PQmakeEmptyPGresult(db.conn, PGRES_FATAL_ERROR);
+    if (PQresultStatus(prep) != PGRES_COMMAND_OK) {
+        string msg = PQresultErrorMessage(prep);
+        PQclear(prep);
+        throw runtime_error(string("Ошибка подготовки запроса ") + def.name + ": " + msg);
+    }
+    PQclear(prep);
+    db.pooled->prepared.set(id);
+}
+
+// Выполнить запрос из реестра, при необходимости подготовив его на этом соединении.
+// Результат всегда в бинарном формате (читать через pgInt4/pgMoney/decodeRow...).
+// Возвращённый PGresult освобождает вызывающий (PQclear), как и у PQexecParams.
+PGresult* dbExecPrepared(PgConn& db, StmtId id, const PgParams& params) {
+    id = resolveStmt(id);
+    const StmtDef& def = STATEMENTS[id];
+    if (params.size() != def.nParams) {
+        throw logic_error(string("Неверное число параметров запроса ") + def.name);
+    }
+
+    for (int attempt = 0; ; ++attempt) {
+        dbPrepare(db, id);
+
+        PGresult* res = PQsendQueryPrepared(db.conn, def.name, def.nParams,
+                                            params.values(), params.lengths(), params.formats(), 1)
+                        ? pgAwait(db.conn) : PQmakeEmptyPGresult(db.conn, PGRES_FATAL_ERROR);
+
+        // 26000 — подготовленного запроса на сервере нет (например, после DISCARD ALL).
+        // Вне транзакции его можно безопасно подготовить заново и повторить.
+        const char* state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+        if (attempt == 0 && state && string(state) == "26000" &&
+            PQtransactionStatus(db.conn) == PQTRANS_IDLE) {
+            PQclear(res);
+            db.pooled->prepared.reset(id);
+            continue;
+        }
+        return res;
+    }
+}
+
+// Ошибки, после которых запрос можно просто повторить:
+// 40P01 — взаимоблокировка, 40001 — сбой сериализации
+bool isRetryableError(const PGresult* res) {
+    const char* state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    if (!state) return false;
+    string st = state;
+    return st == "40P01" || st == "40001";
+}
+
+// То же, что dbExecPrepared, но взаимоблокировки и сбои сериализации
+// повторяются (до transfer_retries раз) с нарастающей паузой
+PGresult* dbExecPreparedRetry(PgConn& db, StmtId id, const PgParams& params) {
+    int retries = config().getInt("transfer_retries", 3);
+    for (int attempt = 0; ; ++attempt) {
+        PGresult* res = dbExecPrepared(db, id, params);
+        if (PQresultStatus(res) == PGRES_TUPLES_OK || attempt >= retries || !isRetryableError(res)) {
+            return res;
+        }
+        PQclear(res);
+        sleepMs((1 << attempt) + static_cast<int>(randomBelow(2)));
+    }
+}
+
+// Выполнить запрос из реестра построчно (single-row mode): onRow получает PGresult
+// ровно с одной строкой, так что в памяти не бывает больше одной строки ответа,
+// сколько бы их ни вернул запрос. Ошибка БД — исключение. Если выдача прервана
+// исключением из onRow, остаток ответа не дочитывается: соединение остаётся
+// занятым запросом и при возврате в пул закрывается.
+void dbStreamPrepared(PgConn& db, StmtId id, const PgParams& params,
+                      const function<void(const PGresult*)>& onRow) {
+    id = resolveStmt(id);
+    const StmtDef& def = STATEMENTS[id];
+    if (params.size() != def.nParams) {
+        throw logic_error(string("Неверное число параметров запроса ") + def.name);
+    }
+    dbPrepare(db, id);
+
+    if (!PQsendQueryPrepared(db.conn, def.name, def.nParams,
+                             params.values(), params.lengths(), params.formats(), 1) ||
+        !PQsetSingleRowMode(db.conn)) {
+        throw runtime_error(string("Ошибка отправки запроса ") + def.name + ": " + PQerrorMessage(db.conn));
+    }
+    noteRoundTrip();
+    if (!pgFlush(db.conn)) {
+        throw runtime_error(string("Ошибка отправки запроса ") + def.name + ": " + PQerrorMessage(db.conn));
+    }
+
+    string error;
+    while (PGresult* res = pgGetResult(db.conn)) {
+        ExecStatusType st = PQresultStatus(res);
+        if (st == PGRES_SINGLE_TUPLE && error.empty()) {
+            try {
+                onRow(res);
+            } catch (...) {
+                PQclear(res);
+                throw;
+            }
+        } else if (st != PGRES_SINGLE_TUPLE && st != PGRES_TUPLES_OK && error.empty()) {
+            error = PQresultErrorMessage(res);
+        }
+        PQclear(res);
+    }
+    if (error.empty() && PQisBusy(db.conn)) error = "истекло время ожидания ответа";   // см. pgGetResult
+    if (!error.empty()) {
+        throw runtime_error(string("Ошибка запроса ") + def.name + ": " + error);
+    }
+}
+
+// ===================== ОТВЕТ И JSON =====================
+
+// Получатель потокового ответа — свой у каждого транспорта (CGI, FastCGI, HTTP).
+// Все методы возвращают false, если клиент отключился.
+class ResponseSink {
+public:
+    virtual ~ResponseSink() {}
+    virtual bool begin(const Response& resp) = 0;          // заголовки
+    virtual bool write(const char* data, size_t len) = 0;  // очередная часть тела
+    virtual bool end() = 0;                                // тело закончилось
+    virtual void abort() {}                                // тело оборвано ошибкой
+};
+
+// Последняя строка оборванного потока там, где у транспорта нет своей разметки
+// конца тела (CGI, FastCGI): иначе усечённая выгрузка неотличима от полной
+const char STREAM_ABORTED_MARKER[] = "\r\n#ERROR: ответ оборван ошибкой сервера\r\n";
+
+// Ответ на текущий запрос. Тело собирается в один буфер, который в долгоживущих
+// режимах переиспользуется между запросами (без новых аллокаций), а заголовки
+// и тело уходят транспорту одной записью.
+//
+// Большие ответы можно отдавать потоком (beginStream/streamFlush/endStream):
+// заголовки уходят сразу, тело — частями через sink, буфер после каждой части
+// очищается. Транспорт, у которого sink нет, получит тело целиком, как обычно.
+struct Response {
+    int status = 200;
+    string contentType = "application/json";
+    string extraHeaders;   // готовые строки "Имя: значение\r\n"
+    string body;
+
+    ResponseSink* sink = nullptr;   // выставляет транспорт, reset() его не трогает
+    bool streamed = false;          // заголовки уже ушли через sink
+    bool streamEnded = false;       // поток завершён штатно (false — оборван ошибкой)
+
+    Response() {
+        body.reserve(4096);
+    }
+
+    void reset() {
+        status = 200;
+        contentType = "application/json";
+        extraHeaders.clear();
+        body.clear();
+        streamed = false;
+        streamEnded = false;
+    }
+};
+
+// Ответ, который сейчас формирует обработчик (выставляется в handleRequest)
+Response& response() {
+    return *currentRequest->response;
+}
+
+const char* statusText(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default:  return "Unknown";
+    }
+}
+
+// Запись целого в буфер без локали; возвращает конец записи
+template <typename T>
+char* formatInt(char* buf, T v) {
+    return to_chars(buf, buf + 24, v).ptr;
+}
+
+// Потоковый построитель JSON поверх строки-буфера. Запятые между элементами
+// расставляются автоматически, строки экранируются по RFC 8259.
+class JsonWriter {
+public:
+    explicit JsonWriter(string& out) : out(out) {}
+
+    JsonWriter& beginObject() { separator(); out.push_back('{'); push(); return *this; }
+    JsonWriter& endObject()   { pop(); out.push_back('}'); return *this; }
+    JsonWriter& beginArray()  { separator(); out.push_back('['); push(); return *this; }
+    JsonWriter& endArray()    { pop(); out.push_back(']'); return *this; }
+
+    JsonWriter& key(const char* k) {
+        separator();
+        writeString(k, strlen(k));
+        out.push_back(':');
+        afterKey = true;
+        return *this;
+    }
+
+    JsonWriter& value(const char* s)   { separator(); writeString(s, strlen(s)); return *this; }
+    JsonWriter& value(const string& s) { separator(); writeString(s.data(), s.size()); return *this; }
+    JsonWriter& value(bool b)          { separator(); out.append(b ? "true" : "false"); return *this; }
+    JsonWriter& null()                 { separator(); out.append("null"); return *this; }
+
+    JsonWriter& value(Money m) {
+        separator();
+        char buf[24];
+        out.append(buf, formatMoney(buf, m) - buf);
+        return *this;
+    }
+
+    template <typename T, typename enable_if<is_integral<T>::value, int>::type = 0>
+    JsonWriter& value(T v) {
+        separator();
+        char buf[24];
+        out.append(buf, formatInt(buf, v) - buf);
+        return *this;
+    }
+
+    template <typename T>
+    JsonWriter& field(const char* k, const T& v) {
+        key(k);
+        return value(v);
+    }
+
+private:
+    void separator() {
+        if (afterKey) {
+            afterKey = false;
+            return;
+        }
+        if (depth > 0) {
+            if (hasItems & (1ull << depth)) out.push_back(',');
+            hasItems |= (1ull << depth);
+        }
+    }
+
+    void push() {
+        ++depth;
+        hasItems &= ~(1ull << depth);
+    }
+
+    void pop() {
+        --depth;
+    }
+
+    void writeString(const char* s, size_t len) {
+        static const char hex[] = "0123456789abcdef";
+        out.push_back('"');
+        size_t run = 0;   // начало участка, который копируется без изменений
+        for (size_t i = 0; i < len; ++i) {
+            unsigned char c = static_cast<unsigned char>(s[i]);
+            if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+            out.append(s + run, i - run);
+            run = i + 1;
+            switch (c) {
+                case '"':  out.append("\\\""); break;
+                case '\\': out.append("\\\\"); break;
+                case '\n': out.append("\\n"); break;
+                case '\r': out.append("\\r"); break;
+                case '\t': out.append("\\t"); break;
+                default: {
+                    char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+                    out.append(esc, 6);
+                }
+            }
+        }
+        out.append(s + run, len - run);
+        out.push_back('"');
+    }
+
+    string& out;
+    int depth = 0;
+    uint64_t hasItems = 0;   // бит на уровень вложенности: был ли уже элемент
+    bool afterKey = false;
+};
+
+// Начать JSON-тело ответа; всё, что обработчик успел записать раньше, отбрасывается
+JsonWriter jsonBody() {
+    Response& r = response();
+    r.contentType = "application/json";
+    r.body.clear();
+    return JsonWriter(r.body);
+}
+
+// Порог, после которого накопленная часть потокового ответа уходит клиенту
+const size_t STREAM_FLUSH_BYTES = 64 * 1024;
+
+// Начать потоковый ответ: заголовки уходят сразу, тело дописывается в
+// response().body и отдаётся частями через streamFlush
+void beginStream(const string& contentType) {
+    Response& r = response();
+    r.contentType = contentType;
+    r.body.clear();
+    if (!r.sink) return;
+    r.streamed = true;
+    if (!r.sink->begin(r)) throw runtime_error("Клиент отключился.");
+}
+
+// Отдать накопленную часть тела, если её набралось STREAM_FLUSH_BYTES (force — любую)
+void streamFlush(bool force = false) {
+    Response& r = response();
+    if (!r.streamed || r.body.empty() || (!force && r.body.size() < STREAM_FLUSH_BYTES)) return;
+    bool ok = r.sink->write(r.body.data(), r.body.size());
+    r.body.clear();
+    if (!ok) throw runtime_error("Клиент отключился.");
+}
+
+void endStream() {
+    Response& r = response();
+    if (!r.streamed) return;
+    streamFlush(true);
+    if (!r.sink->end()) throw runtime_error("Клиент отключился.");
+    r.streamEnded = true;
+}
+
+// ===================== ВСПОМОГАТЕЛЬНЫЕ ШТУКИ =====================
+
+// Отметить вид ошибки текущего запроса (для метрик)
+void markError(ErrorKind kind) {
+    if (currentRequest) currentRequest->error = kind;
+}
+
+void jsonError(const string& msg) {
+    jsonBody().beginObject()
+        .field("success", false)
+        .field("message", msg)
+        .endObject();
+    markError(ERR_REJECTED);
+}
+
+// Отказ «повторите позже» (429/503) с Retry-After: error — машинный код причины
+void jsonRetryLater(int status, const char* error, const char* msg, int retryAfter) {
+    Response& r = response();
+    jsonBody().beginObject()
+        .field("success", false)
+        .field("error", error)
+        .field("message", msg)
+        .field("retryAfter", retryAfter)
+        .endObject();
+    r.status = status;
+    r.extraHeaders += "Retry-After: " + to_string(retryAfter) + "\r\n";
+    markError(ERR_THROTTLED);
+}
+
+// Истёк срок запроса (см. СРОКИ ЗАПРОСОВ): 504 с видом таймаута. Изменение
+// могло и успеть зафиксироваться, поэтому клиенту стоит проверить результат.
+void jsonTimeout() {
+    jsonBody().beginObject()
+        .field("success", false)
+        .field("error", "timeout")
+        .field("timeout", TIMEOUT_KIND_NAMES[currentRequest->timeout])
+        .field("message", "Истекло время обработки запроса. Проверьте результат операции перед повтором.")
+        .endObject();
+    response().status = 504;
+    markError(ERR_TIMEOUT);
+}
+
+// Ответ на исключение внутри обработчика действия where. Исключение
+// из-за истёкшего срока — ответ о таймауте, а не внутренняя ошибка.
+void jsonInternalError(const char* where, const exception& e) {
+    if (currentRequest && currentRequest->timeout != TIMEOUT_NONE) {
+        jsonTimeout();
+        return;
+    }
+    jsonError(string("Внутренняя ошибка (") + where + "): " + e.what());
+    markError(ERR_INTERNAL);
+}
+
+void jsonOkMessage(const string& msg) {
+    jsonBody().beginObject()
+        .field("success", true)
+        .field("message", msg)
+        .endObject();
+}
+
+// Целое из строки целиком, без исключений (поток мусорных запросов не должен
+// каждый раз раскручивать стек, как было со stoi)
+template <typename T>
+bool parseIntSafe(const string& s, T& out) {
+    const char* first = s.data();
+    const char* last = first + s.size();
+    if (first != last && *first == '+') ++first;
+    T v;
+    auto r = from_chars(first, last, v);
+    if (r.ec != errc() || r.ptr != last || first == last) return false;
+    out = v;
+    return true;
+}
+
+string getParam(Cgicc& cgi, const string& name, bool& present) {
+    form_iterator it = cgi.getElement(name);
+    if (it == cgi.getElements().end()) {
+        present = false;
+        return "";
+    }
+    present = true;
+    return it->getValue();
+}
+
+bool isAllDigits(const string& s) {
+    if (s.empty()) return false;
+    for (char c : s) {
+        if (!isdigit((unsigned char)c)) return false;
+    }
+    return true;
+}
+
+// Дата в виде YYYY-MM-DD, с проверкой числа дней в месяце
+bool isValidDate(const string& s) {
+    if (s.size() != 10 || s[4] != '-' || s[7] != '-') return false;
+    string ys = s.substr(0, 4), ms = s.substr(5, 2), ds = s.substr(8, 2);
+    if (!isAllDigits(ys) || !isAllDigits(ms) || !isAllDigits(ds)) return false;
+    int y = stoi(ys), m = stoi(ms), d = stoi(ds);
+    static const int DAYS[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    if (y < 1 || m < 1 || m > 12 || d < 1) return false;
+    bool leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    return d <= DAYS[m - 1] + (m == 2 && leap ? 1 : 0);
+}
+
+// Разбор JSON-массива плоских объектов: [{"key": "value", "n": 10}, ...].
+// Значения любых скалярных типов сохраняются строками (числа — как записаны).
+// Вложенные объекты и массивы не поддерживаются — для параметров запросов не нужны.
+class JsonArrayParser {
+public:
+    explicit JsonArrayParser(const string& text) : s(text), pos(0) {}
+
+    bool parse(vector<map<string, string>>& out) {
+        skipWs();
+        if (!consume('[')) return false;
+        skipWs();
+        if (consume(']')) return atEnd();
+
+        while (true) {
+            map<string, string> obj;
+            if (!parseObject(obj)) return false;
+            out.push_back(std::move(obj));
+            skipWs();
+            if (consume(']')) return atEnd();
+            if (!consume(',')) return false;
+            skipWs();
+        }
+    }
+
+private:
+    bool parseObject(map<string, string>& obj) {
+        if (!consume('{')) return false;
+        skipWs();
+        if (consume('}')) return true;
+
+        while (true) {
+            string key, value;
+            skipWs();
+            if (!parseString(key)) return false;
+            skipWs();
+            if (!consume(':')) return false;
+            skipWs();
+            if (!parseScalar(value)) return false;
+            obj[key] = value;
+            skipWs();
+            if (consume('}')) return true;
+            if (!consume(',')) return false;
+        }
+    }
+
+    bool parseScalar(string& out) {
+        if (pos < s.size() && s[pos] == '"') return parseString(out);
+        size_t start = pos;
+        while (pos < s.size() && (isalnum((unsigned char)s[pos]) || s[pos] == '-' ||
+                                  s[pos] == '+' || s[pos] == '.')) {
+            ++pos;
+        }
+        out = s.substr(start, pos - start);
+        return !out.empty();
+    }
+
+    bool parseString(string& out) {
+        if (!consume('"')) return false;
+        while (pos < s.size()) {
+            char c = s[pos++];
+            if (c == '"') return true;
+            if (c != '\\') {
+                out.push_back(c);
+                continue;
+            }
+            if (pos >= s.size()) return false;
+            char e = s[pos++];
+            switch (e) {
+                case '"': case '\\': case '/': out.push_back(e); break;
+                case 'n': out.push_back('\n'); break;
+                case 't': out.push_back('\t'); break;
+                case 'r': out.push_back('\r'); break;
+                case 'b': out.push_back('\b'); break;
+                case 'f': out.push_back('\f'); break;
+                case 'u': {
+                    if (pos + 4 > s.size()) return false;
+                    unsigned cp = static_cast<unsigned>(strtoul(s.substr(pos, 4).c_str(), nullptr, 16));
+                    pos += 4;
+                    appendUtf8(out, cp);
+                    break;
+                }
+                default: return false;
+            }
+        }
+        return false;
+    }
+
+    static void appendUtf8(string& out, unsigned cp) {
+        if (cp < 0x80) {
+            out.push_back(static_cast<char>(cp));
+        } else if (cp < 0x800) {
+            out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else {
+            out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+
+    void skipWs() {
+        while (pos < s.size() && isspace((unsigned char)s[pos])) ++pos;
+    }
+
+    bool consume(char c) {
+        if (pos < s.size() && s[pos] == c) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+
+    bool atEnd() {
+        skipWs();
+        return pos == s.size();
+    }
+
+    const string& s;
+    size_t pos;
+};
+
+// Контрольная цифра по алгоритму Луна для строки цифр (без неё самой)
+char luhnCheckDigit(const string& digits) {
+    int sum = 0;
+    bool dbl = true;   // справа налево, начиная с цифры перед контрольной
+    for (size_t i = digits.size(); i-- > 0; ) {
+        int d = digits[i] - '0';
+        if (dbl) {
+            d *= 2;
+            if (d > 9) d -= 9;
+        }
+        sum += d;
+        dbl = !dbl;
+    }
+    return static_cast<char>('0' + (10 - sum % 10) % 10);
+}
+
+const int MAX_ACCOUNTS_PER_USER = 3;
+const int ACCOUNT_NUMBER_ATTEMPTS = 8;   // попыток вставки при совпадении номера
+
+// генерация 16-значного номера счётa: "4000", номер шарда (2 цифры, см. ShardMap),
+// 9 случайных цифр и контрольная цифра Луна
+string generateAccountNumber(int shard) {
+    char body[16];
+    snprintf(body, sizeof(body), "4000%02d%09llu", shard,
+             static_cast<unsigned long long>(randomBelow(1000000000ULL)));
+    string num = body;
+    num.push_back(luhnCheckDigit(num));
+    return num;
+}
+
+// ===================== ВСПОМОГАТЕЛЬНЫЕ ФУНКЦИИ РАБОТЫ С БД =====================
+
+// Получить пользователя по логину (id или email)
+bool dbFindUserByLogin(PgConn& db, const string& login, User& outUser) {
+    PgParams params;
+    StmtId stmt;
+    if (isAllDigits(login)) {
+        int id = 0;
+        if (!parseIntSafe(login, id)) return false;   // такого id заведомо нет
+        params.int4(id);
+        stmt = STMT_USER_BY_ID;
+    } else {
+        params.text(login);
+        stmt = STMT_USER_BY_EMAIL;
+    }
+
+    PGresult* res = dbExecPrepared(db, stmt, params);
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        PQclear(res);
+        throw runtime_error("Ошибка запроса к БД (dbFindUserByLogin)");
+    }
+
+    if (PQntuples(res) == 0) {
+        PQclear(res);
+        return false;
+    }
+
+    outUser = decodeRow<User>(res, 0);
+    PQclear(res);
+    return true;
+}
+
+// Получить все счета пользователя (и, если нужно, его профиль без пароля).
+// false — пользователя нет.
+bool dbGetAccounts(PgConn& db, int userId, vector<Account>& accounts, User* profile = nullptr) {
+    PgParams params;
+    params.int4(userId);
+
+    PGresult* res = dbExecPrepared(db, STMT_USER_WITH_ACCOUNTS, params);
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        PQclear(res);
+        throw runtime_error("Ошибка запроса к БД (dbGetAccounts)");
+    }
+
+    vector<UserAccountRow> rows = decodeRows<UserAccountRow>(res);
+    PQclear(res);
+    if (rows.empty()) return false;
+
+    if (profile) *profile = rows[0].user;
+    accounts.clear();
+    for (const UserAccountRow& r : rows) {
+        if (r.hasAccount) accounts.push_back(r.account);
+    }
+    return true;
+}
+
+// Найти баланс счёта по номеру (если нет — возвращаем false)
+bool dbGetAccountBalance(PgConn& db, const string& accNumber, Money& balanceOut) {
+    PgParams params;
+    params.text(accNumber);
+
+    PGresult* res = dbExecPrepared(db, STMT_ACCOUNT_BALANCE, params);
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        PQclear(res);
+        throw runtime_error("Ошибка запроса к БД (dbGetAccountBalance)");
+    }
+
+    if (PQntuples(res) == 0) {
+        PQclear(res);
+        return false;
+    }
+
+    balanceOut = decodeRow<Money>(res, 0);
+    PQclear(res);
+    return true;
+}
+
+// Зачислить на счёт сумму частей (каждая — отдельная запись журнала); false — счёта нет
+bool dbCredit(PgConn& db, const string& accNumber, const vector<Money>& parts, Money& newBalance) {
+    string amounts = pgMoneyArray(parts);
+    PgParams params;
+    params.text(accNumber).text(amounts);
+
+    PGresult* res = dbExecPrepared(db, STMT_BALANCE_ADD, params);
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        PQclear(res);
+        throw runtime_error("Ошибка обновления баланса (topup).");
+    }
+
+    if (PQntuples(res) == 0) {
+        PQclear(res);
+        return false;
+    }
+
+    newBalance = decodeRow<Money>(res, 0);
+    PQclear(res);
+    return true;
+}
+
+// ===================== КЭШ БАЛАНСОВ И СПИСКОВ СЧЕТОВ =====================
+
+// Кэш для чтений getBalance / getAccounts в долгоживущих режимах (в CGI-процессе
+// он бесполезен и выключен). Открытие и закрытие счетов приходят уведомлениями
+// PostgreSQL: триггер на accounts (schema.sql) шлёт NOTIFY bank_changes с
+// "номер:user_id", отдельный поток слушает канал. Изменения баланса
+// не уведомляют (NOTIFY выстраивал бы все записи кластера в очередь):
+// свои записи обработчики сбрасывают сами, чужие видны через cache_ttl.
+// Пока слушатель не подключён, кэш не отдаёт ничего — иначе изменения
+// из других процессов можно пропустить.
+class AccountCache {
+public:
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> misses{0};
+    atomic<uint64_t> invalidations{0};
+
+    // Запустить поток-слушатель; до его подключения кэш пропускает все запросы в БД
+    void start() {
+        const Config& cfg = config();
+        if (!cfg.getInt("cache_enabled", 1)) return;
+        ttl = chrono::seconds(cfg.getInt("cache_ttl", 1));
+        maxEntries = static_cast<size_t>(max(1, cfg.getInt("cache_max_entries", 100000)));
+        if (replicas().configured()) replicaWindow = chrono::milliseconds(replicas().stalenessBoundMs());
+        // Уведомления приходят от каждого шарда — по слушателю на шард
+        for (int s = 0; s < shards().count(); ++s) {
+            thread([this, s] { listenLoop(s); }).detach();
+        }
+    }
+
+    // Поколение растёт при каждой инвалидации, и сброшенный ключ получает его
+    // номер как свою версию. Читатель запоминает поколение до запроса в БД
+    // и кладёт результат, только если за это время не сбрасывался этот ключ —
+    // так ответ, прочитанный до чужой записи, не перетрёт свежую инвалидацию,
+    // а записи в другие счета заполнению не мешают.
+    uint64_t generation() const {
+        return gen.load();
+    }
+
+    bool getBalance(const string& number, Money& out) {
+        if (!ready()) return false;
+        lock_guard<mutex> lock(m);
+        auto it = balances.find(number);
+        if (it == balances.end() || Clock::now() > it->second.expires) {
+            ++misses;
+            return false;
+        }
+        ++hits;
+        out = it->second.value;
+        return true;
+    }
+
+    // fromReplica — значение прочитано с реплики: оно может не содержать изменений
+    // последних replicaWindow, поэтому не кладётся, если ключ недавно сбрасывался
+    void putBalance(const string& number, Money value, uint64_t readGen, bool fromReplica = false) {
+        if (!ready()) return;
+        lock_guard<mutex> lock(m);
+        if (changedSince(accountVersions, number, readGen)) return;
+        if (fromReplica && recentlyInvalidated(recentAccounts, number)) return;
+        makeRoom();
+        balances[number] = { value, Clock::now() + ttl };
+    }
+
+    bool getAccounts(int userId, vector<Account>& out) {
+        if (!ready()) return false;
+        lock_guard<mutex> lock(m);
+        auto it = userAccounts.find(userId);
+        if (it == userAccounts.end() || Clock::now() > it->second.expires) {
+            ++misses;
+            return false;
+        }
+        ++hits;
+        out = it->second.value;
+        return true;
+    }
+
+    void putAccounts(int userId, const vector<Account>& accounts, uint64_t readGen,
+                     bool fromReplica = false) {
+        if (!ready()) return;
+        lock_guard<mutex> lock(m);
+        // Список несёт и балансы — он устарел, если сбрасывался любой его счёт
+        if (changedSince(userVersions, userId, readGen)) return;
+        for (const Account& a : accounts) {
+            if (changedSince(accountVersions, a.number, readGen)) return;
+        }
+        if (fromReplica && recentlyInvalidated(recentUsers, userId)) return;
+        makeRoom();
+        userAccounts[userId] = { accounts, Clock::now() + ttl };
+        for (const Account& a : accounts) owners[a.number] = userId;
+    }
+
+    // Локальная инвалидация сразу после собственной записи: уведомление (если оно
+    // вообще будет — баланс не уведомляет) придёт асинхронно, а следующий запрос
+    // того же клиента должен видеть свои изменения.
+    void invalidateAccount(const string& number) {
+        lock_guard<mutex> lock(m);
+        stamp(accountVersions, number);
+        ++invalidations;
+        remember(recentAccounts, number);
+        balances.erase(number);
+        auto it = owners.find(number);
+        if (it != owners.end()) {
+            userAccounts.erase(it->second);
+            owners.erase(it);
+        }
+    }
+
+    void invalidateUser(int userId) {
+        lock_guard<mutex> lock(m);
+        stamp(userVersions, userId);
+        ++invalidations;
+        remember(recentUsers, userId);
+        userAccounts.erase(userId);
+    }
+
+private:
+    template <typename T>
+    struct Entry {
+        T value;
+        Clock::time_point expires;
+    };
+
+    // Кэш работает, только пока подключены слушатели всех шардов
+    bool ready() const {
+        return listening.load() == shards().count();
+    }
+
+    void clear() {
+        lock_guard<mutex> lock(m);
+        forgetVersions();
+        balances.clear();
+        userAccounts.clear();
+        owners.clear();
+    }
+
+    // Версии ключей. Вызываются под мьютексом.
+    template <typename K>
+    void stamp(unordered_map<K, uint64_t>& versions, const K& key) {
+        uint64_t v = ++gen;
+        if (accountVersions.size() + userVersions.size() >= maxEntries) forgetVersions();
+        versions[key] = v;
+    }
+
+    // Версии забыты — всё, что прочитано раньше, считается сброшенным
+    void forgetVersions() {
+        accountVersions.clear();
+        userVersions.clear();
+        floorGen = ++gen;
+    }
+
+    template <typename K>
+    bool changedSince(const unordered_map<K, uint64_t>& versions, const K& key, uint64_t readGen) const {
+        if (readGen < floorGen) return true;
+        auto it = versions.find(key);
+        return it != versions.end() && it->second > readGen;
+    }
+
+    // Время инвалидации ключа запоминается на replicaWindow (только при репликах);
+    // устаревшие отметки вычищаются, когда их набирается много
+    template <typename K>
+    void remember(unordered_map<K, Clock::time_point>& recent, const K& key) {
+        if (replicaWindow.count() == 0) return;
+        auto now = Clock::now();
+        if (recent.size() >= 4096) {
+            for (auto it = recent.begin(); it != recent.end(); ) {
+                it = now - it->second >= replicaWindow ? recent.erase(it) : next(it);
+            }
+        }
+        recent[key] = now;
+    }
+
+    template <typename K>
+    bool recentlyInvalidated(const unordered_map<K, Clock::time_point>& recent, const K& key) const {
+        auto it = recent.find(key);
+        return it != recent.end() && Clock::now() - it->second < replicaWindow;
+    }
+
+    // Простейшее ограничение памяти: при переполнении кэш очищается целиком
+    void makeRoom() {
+        if (balances.size() + userAccounts.size() >= maxEntries) {
+            balances.clear();
+            userAccounts.clear();
+            owners.clear();
+        }
+    }
+
+    // Полезная нагрузка уведомления: "номер_счёта:user_id"
+    void onNotify(const string& payload) {
+        // "*" — массовое изменение (bank_tool): сбросить всё
+        if (payload == "*") {
+            clear();
+            return;
+        }
+        size_t colon = payload.rfind(':');
+        invalidateAccount(payload.substr(0, colon));
+        int userId = 0;
+        if (colon != string::npos && parseIntSafe(payload.substr(colon + 1), userId)) {
+            invalidateUser(userId);
+        }
+    }
+
+    void listenLoop(int shard) {
+        while (true) {
+            PGconn* conn = PQconnectdb(shards().conninfo(shard).c_str());
+            PGresult* res = nullptr;
+            if (PQstatus(conn) == CONNECTION_OK) {
+                res = PQexec(conn, "LISTEN bank_changes");
+            }
+            if (!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+                if (res) PQclear(res);
+                PQfinish(conn);
+                sleep(1);
+                continue;
+            }
+            PQclear(res);
+
+            // Всё, что лежало в кэше до подписки, могло устареть незаметно для нас
+            clear();
+            ++listening;
+
+            while (true) {
+                pollfd pfd = { PQsocket(conn), POLLIN, 0 };
+                if (poll(&pfd, 1, 1000) < 0 && errno != EINTR) break;
+                if (!PQconsumeInput(conn)) break;
+                while (PGnotify* n = PQnotifies(conn)) {
+                    onNotify(n->extra);
+                    PQfreemem(n);
+                }
+            }
+
+            --listening;
+            clear();
+            PQfinish(conn);
+        }
+    }
+
+    chrono::seconds ttl{1};
+    size_t maxEntries = 100000;
+
+    atomic<int> listening{0};   // подключённых слушателей
+    atomic<uint64_t> gen{0};
+    uint64_t floorGen = 0;   // версии до него забыты (под мьютексом)
+
+    mutex m;
+    unordered_map<string, Entry<Money>> balances;
+    unordered_map<int, Entry<vector<Account>>> userAccounts;
+    unordered_map<string, int> owners;   // номер счёта -> владелец (для сброса его списка)
+    unordered_map<string, uint64_t> accountVersions;   // поколение последнего сброса ключа
+    unordered_map<int, uint64_t> userVersions;
+    unordered_map<string, Clock::time_point> recentAccounts;   // недавние инвалидации
+    unordered_map<int, Clock::time_point> recentUsers;
+    chrono::milliseconds replicaWindow{0};
+};
+
+AccountCache& accountCache() {
+    static AccountCache cache;
+    return cache;
+}
+
+// ===================== СКЛЕЙКА ПОПОЛНЕНИЙ =====================
+
+// Пополнения одного счёта, пришедшие одновременно, выполняются одним UPDATE.
+// Пока по счёту выполняется очередной UPDATE, новые пополнения копятся в следующую
+// партию (не больше topup_coalesce_max); когда он завершается, следующая партия
+// уходит в БД целиком. Без конкуренции пополнение уходит сразу, без задержки.
+//
+// Каждый вызывающий получает свой баланс так, как если бы пополнения партии
+// применялись по одному в порядке поступления: после последнего — итоговый
+// баланс, после предыдущего — итоговый минус последнее, и т.д.
+//
+// Включается topup_coalesce = 1 и работает только в HTTP-сервере (--serve):
+// в CGI и FastCGI процесс обслуживает один запрос за раз, склеивать нечего.
+class TopupCoalescer {
+public:
+    TopupCoalescer() {
+        on = config().getInt("topup_coalesce", 0) != 0;
+        maxBatch = static_cast<size_t>(max(1, config().getInt("topup_coalesce_max", 64)));
+    }
+
+    bool enabled() const {
+        return on && EventLoop::currentLoop && EventLoop::currentLoop->current;
+    }
+
+    atomic<uint64_t> batches{0};     // выполненных UPDATE
+    atomic<uint64_t> topups{0};      // пополнений в них
+
+    // Зачислить amount на счёт шарда shard. false — счёта нет; ошибки БД — исключением.
+    bool credit(const string& account, int shard, Money amount, Money& newBalance) {
+        Pending me;
+        me.amount = amount;
+
+        Batch* mine;
+        {
+            lock_guard<mutex> lock(m);
+            deque<unique_ptr<Batch>>& q = queues[account];
+            // Партия в голове очереди уже выполняется — к ней не присоединяемся
+            bool runNow = q.empty();
+            if (runNow || q.size() == 1 || q.back()->items.size() >= maxBatch) {
+                q.emplace_back(new Batch);
+            }
+            mine = q.back().get();
+            me.lead = runNow;
+            mine->items.push_back(&me);
+        }
+
+        bool lead = me.lead;
+        if (!lead) {
+            // Ведомый ждёт результата, первый в следующей партии — своей очереди
+            // (его будит предыдущий ведущий, назначив ведущим). Срок запроса истёк,
+            // а партия ещё не ушла в БД — выходим из неё; ушла — ждём: её UPDATE
+            // ограничен сроком ведущего.
+            if (!me.done.wait(requestTimeLeftMs())) {
+                if (leave(account, mine, me)) {
+                    noteTimeout(TIMEOUT_DEADLINE);
+                    throw runtime_error("Истекло время ожидания пополнения.");
+                }
+                me.done.wait(-1);
+            }
+            lock_guard<mutex> lock(m);
+            lead = me.lead;
+        }
+        if (!lead) return me.finish(newBalance);
+
+        vector<Pending*> items;
+        {
+            lock_guard<mutex> lock(m);
+            mine->started = true;
+            items = mine->items;   // начатая партия больше не пополняется
+        }
+
+        vector<Money> parts;
+        for (Pending* p : items) parts.push_back(p->amount);
+
+        bool found = false;
+        Money balance;
+        string error;
+        try {
+            PgConn db(shard);
+            found = dbCredit(db, account, parts, balance);
+        } catch (const exception& e) {
+            error = e.what();
+        }
+        // Истёк срок ведущего — у ведомых тот же исход (UPDATE мог и зафиксироваться)
+        TimeoutKind timeout = currentRequest ? currentRequest->timeout : TIMEOUT_NONE;
+
+        for (size_t i = items.size(); i-- > 0; ) {
+            items[i]->found = found;
+            items[i]->newBalance = balance;
+            items[i]->error = error;
+            items[i]->timeout = timeout;
+            balance = balance - items[i]->amount;
+        }
+        ++batches;
+        topups += items.size();
+
+        {
+            lock_guard<mutex> lock(m);
+            deque<unique_ptr<Batch>>& q = queues[account];
+            q.pop_front();
+            advance(account, q);
+        }
+        for (Pending* p : items) {
+            if (p != &me) p->done.signal();
+        }
+        return me.finish(newBalance);
+    }
+
+private:
+    struct Pending {
+        Money amount;
+        Completion done;
+        bool lead = false;   // ведущий партии (под мьютексом)
+        bool found = false;
+        Money newBalance;
+        string error;
+        TimeoutKind timeout = TIMEOUT_NONE;
+
+        bool finish(Money& out) {
+            if (!error.empty()) {
+                if (timeout != TIMEOUT_NONE) noteTimeout(timeout);
+                throw runtime_error(error);
+            }
+            out = newBalance;
+            return found;
+        }
+    };
+
+    struct Batch {
+        vector<Pending*> items;   // items[0] — ведущий, он и выполняет UPDATE
+        bool started = false;     // ведущий забрал партию в работу
+    };
+
+    // Голова очереди выполнена или пуста — разбудить ведущего следующей партии.
+    // Вызывается под мьютексом.
+    void advance(const string& account, deque<unique_ptr<Batch>>& q) {
+        if (q.empty()) {
+            queues.erase(account);
+            return;
+        }
+        Pending* next = q.front()->items.front();
+        next->lead = true;
+        next->done.signal();
+    }
+
+    // Выйти из партии, ещё не ушедшей в БД; false — уже ушла
+    bool leave(const string& account, Batch* mine, Pending& me) {
+        lock_guard<mutex> lock(m);
+        if (mine->started) return false;
+        vector<Pending*>& items = mine->items;
+        items.erase(find(items.begin(), items.end(), &me));
+        if (!items.empty()) {
+            // Ведущим был назначен уходящий — передаём следующему в партии
+            if (me.lead) {
+                items.front()->lead = true;
+                items.front()->done.signal();
+            }
+            return true;
+        }
+        deque<unique_ptr<Batch>>& q = queues[account];
+        bool head = q.front().get() == mine;
+        q.erase(find_if(q.begin(), q.end(), [mine](const unique_ptr<Batch>& b) { return b.get() == mine; }));
+        if (head) advance(account, q);
+        return true;
+    }
+
+    bool on;
+    size_t maxBatch;
+    mutex m;
+    unordered_map<string, deque<unique_ptr<Batch>>> queues;   // голова — выполняемая партия
+};
+
+TopupCoalescer& topupCoalescer() {
+    static TopupCoalescer c;
+    return c;
+}
+
+// ===================== СВЁРТКА СЛОТОВ БАЛАНСА =====================
+
+// Счета со слотами (schema.sql, enable_account_slots) копят зачисления в слотах;
+// списание берёт деньги из слота или основной строки, а если ни в одной
+// строке по отдельности не хватает — сводит слоты под блокировкой счёта.
+// Чтобы этот медленный путь был редкостью, отдельный поток раз в
+// account_slots_fold_interval секунд переносит деньги из слотов в основную
+// строку (fold_all_account_slots, занятые строки пропускаются) на каждом шарде.
+// Работает только в долгоживущих режимах (FastCGI, --serve).
+class SlotFolder {
+public:
+    atomic<uint64_t> runs{0};
+    atomic<uint64_t> foldedAccounts{0};
+    atomic<uint64_t> failures{0};
+
+    void start() {
+        const Config& cfg = config();
+        if (!cfg.getInt("account_slots", 0)) return;
+        int seconds = cfg.getInt("account_slots_fold_interval", 5);
+        if (seconds <= 0) return;
+        thread([this, seconds] { foldLoop(seconds); }).detach();
+    }
+
+private:
+    void foldLoop(int seconds) {
+        while (true) {
+            this_thread::sleep_for(chrono::seconds(seconds));
+            for (int s = 0; s < shards().count(); ++s) {
+                try {
+                    PgConn db(s);
+                    PGresult* res = pgExec(db.conn, "SELECT fold_all_account_slots()");
+                    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+                        ++runs;
+                        foldedAccounts += static_cast<uint64_t>(atoll(PQgetvalue(res, 0, 0)));
+                    } else {
+                        ++failures;
+                    }
+                    PQclear(res);
+                } catch (const exception&) {
+                    ++failures;   // шард недоступен — попробуем в следующий раз
+                }
+            }
+        }
+    }
+};
+
+SlotFolder& slotFolder() {
+    static SlotFolder f;
+    return f;
+}
+
+// ===================== ПЕРЕВОДЫ МЕЖДУ ШАРДАМИ =====================
+
+// Перевод между счетами разных шардов — двухфазная фиксация. Списание и зачисление
+// выполняются каждое на своём шарде и подготавливаются (PREPARE TRANSACTION);
+// стороны идут в порядке номеров счетов, как блокировки в запросе transfer,
+// поэтому встречные переводы не взаимоблокируются и через границу шардов.
+// Точка фиксации — строка xfer_outcomes на шарде отправителя; после неё обе
+// стороны фиксируются (COMMIT PREPARED).
+//
+// gid транзакции стороны: "bank_x:<шард отправителя>:<случайная часть>:<шард стороны>",
+// без последнего элемента — ключ решения в xfer_outcomes. Координатор, упавший
+// между PREPARE и COMMIT PREPARED, оставляет транзакцию «в сомнении» (она держит
+// блокировку строки счёта); такие транзакции старше xfer_recovery_after секунд
+// раз в xfer_recovery_interval завершает фоновый поток по записанному решению.
+// Решения нет — откат, и это решение тоже записывается, так что опоздавший
+// координатор уже не сможет зафиксировать перевод.
+const char* const XFER_GID_PREFIX = "bank_x:";
+
+class ShardTransfers {
+public:
+    atomic<uint64_t> committed{0};
+    atomic<uint64_t> aborted{0};             // откачены после подготовки одной из сторон
+    atomic<uint64_t> recoveredCommits{0};    // завершены восстановлением
+    atomic<uint64_t> recoveredRollbacks{0};
+    atomic<uint64_t> recoveryFailures{0};
+
+    // Фоновое восстановление (долгоживущие режимы, больше одного шарда)
+    void start() {
+        const Config& cfg = config();
+        if (shards().count() < 2) return;
+        int interval = cfg.getInt("xfer_recovery_interval", 30);
+        if (interval <= 0) return;
+        recoverAfter = max(1, cfg.getInt("xfer_recovery_after", 60));
+        thread([this, interval] { recoveryLoop(interval); }).detach();
+    }
+
+    // Результат — как у запроса transfer
+    TransferRow transfer(int fromShard, const string& from, int toShard, const string& to, Money amount) {
+        char rnd[17];
+        snprintf(rnd, sizeof(rnd), "%016llx", static_cast<unsigned long long>(rng()()));
+        string base = XFER_GID_PREFIX + to_string(fromShard) + ":" + rnd;
+        string fromGid = base + ":" + to_string(fromShard);
+        string toGid = base + ":" + to_string(toShard);
+
+        // Соединения берутся в порядке номеров шардов: иначе два встречных перевода,
+        // взяв каждый последнее свободное соединение «своего» шарда, ждали бы друг друга
+        unique_ptr<PgConn> lower(new PgConn(min(fromShard, toShard)));
+        unique_ptr<PgConn> upper(new PgConn(max(fromShard, toShard)));
+        PgConn& src = fromShard < toShard ? *lower : *upper;
+        PgConn& dst = fromShard < toShard ? *upper : *lower;
+        WithdrawRow debit{}, credit{};
+        bool debitTried = false, creditTried = false;
+        auto prepareDebit = [&] {
+            debitTried = true;
+            debit = prepareSide(src, STMT_TRANSFER_DEBIT, from, to, amount, fromGid);
+        };
+        auto prepareCredit = [&] {
+            creditTried = true;
+            credit = prepareSide(dst, STMT_TRANSFER_CREDIT, to, from, amount, toGid);
+        };
+        auto prepared = [](const WithdrawRow& w) { return w.found && w.applied; };
+
+        try {
+            if (from < to) {
+                prepareDebit();
+                if (prepared(debit)) prepareCredit();
+            } else {
+                prepareCredit();
+                if (prepared(credit)) prepareDebit();
+            }
+        } catch (...) {
+            // Подготовленную сторону откатываем; не вышло — это сделает восстановление
+            if (prepared(debit)) finish(src, fromGid, false);
+            if (prepared(credit)) finish(dst, toGid, false);
+            throw;
+        }
+
+        // Подготовка позади — дальше срок запроса не действует: оборванная вторая
+        // фаза держала бы блокировки счетов до восстановления
+        DeadlineExempt exempt;
+        TransferRow t{};
+        if (!prepared(debit) || !prepared(credit)) {
+            if (prepared(debit)) finish(src, fromGid, false);
+            if (prepared(credit)) finish(dst, toGid, false);
+            // Вторая сторона не выполнялась — её счёт проверяем отдельно,
+            // чтобы ответ совпадал с переводом внутри шарда
+            Money unused;
+            t.fromFound = debitTried ? debit.found : dbGetAccountBalance(src, from, unused);
+            t.toFound = creditTried ? credit.found : dbGetAccountBalance(dst, to, unused);
+            t.applied = false;
+            return t;
+        }
+
+        bool commit = decide(src, base);
+        finish(src, fromGid, commit);
+        finish(dst, toGid, commit);
+        if (!commit) {
+            ++aborted;
+            throw runtime_error("Перевод между шардами отменён: решение не удалось записать.");
+        }
+        ++committed;
+
+        t.fromFound = t.toFound = t.applied = true;
+        t.newFromBalance = debit.newBalance;
+        return t;
+    }
+
+private:
+    // Сторона перевода в своей транзакции, подготовленной под gid. Сторона,
+    // которая не прошла (нет счёта, мало средств), откатывается и не готовится.
+    static WithdrawRow prepareSide(PgConn& db, StmtId stmt, const string& account,
+                                   const string& counterparty, Money amount, const string& gid) {
+        string begin = "BEGIN";
+        int statementMs, lockMs;
+        if (localTimeouts(statementMs, lockMs)) {
+            begin += "; SET LOCAL statement_timeout = " + to_string(statementMs) +
+                     "; SET LOCAL lock_timeout = " + to_string(lockMs);
+        }
+        command(db, begin);
+        PgParams params;
+        params.text(account).money(amount).text(counterparty);
+        PGresult* res = dbExecPrepared(db, stmt, params);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1) {
+            string msg = PQresultErrorMessage(res);
+            PQclear(res);
+            throw runtime_error("Ошибка перевода между шардами: " + msg);   // пул откатит транзакцию
+        }
+        WithdrawRow w = decodeRow<WithdrawRow>(res, 0);
+        PQclear(res);
+        command(db, w.found && w.applied ? "PREPARE TRANSACTION '" + gid + "'" : string("ROLLBACK"));
+        return w;
+    }
+
+    static void command(PgConn& db, const string& sql) {
+        PGresult* res = pgExec(db.conn, sql.c_str());
+        bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        string msg = PQresultErrorMessage(res);
+        PQclear(res);
+        if (!ok) throw runtime_error("Ошибка перевода между шардами: " + msg);
+    }
+
+    // Записать решение «фиксировать». Если запись не удалась (ответ потерян,
+    // или восстановление уже решило откатить), исход читается заново на том же
+    // соединении (третье из пула взять нельзя — см. transfer) — он мог и записаться.
+    static bool decide(PgConn& src, const string& base) {
+        PgParams params;
+        params.text(base);
+        PGresult* res = dbExecPrepared(src, STMT_XFER_DECIDE, params);
+        bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        PQclear(res);
+        if (ok) return true;
+        try {
+            return outcome(src, base);
+        } catch (const exception& e) {
+            throw runtime_error(string("Исход перевода между шардами неизвестен, "
+                                       "его определит восстановление: ") + e.what());
+        }
+    }
+
+    // Исход перевода по решению на шарде отправителя (db — соединение с ним)
+    static bool outcome(PgConn& db, const string& base) {
+        PgParams params;
+        params.text(base);
+        PGresult* res = dbExecPrepared(db, STMT_XFER_OUTCOME, params);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1) {
+            string msg = PQresultErrorMessage(res);
+            PQclear(res);
+            throw runtime_error(msg);
+        }
+        bool commit = pgBool(res, 0, 0);
+        PQclear(res);
+        return commit;
+    }
+
+    // COMMIT/ROLLBACK PREPARED; неудача не ошибка запроса — транзакцию
+    // доведёт восстановление
+    static bool finish(PgConn& db, const string& gid, bool commit) {
+        DeadlineExempt exempt;
+        string sql = (commit ? "COMMIT PREPARED '" : "ROLLBACK PREPARED '") + gid + "'";
+        PGresult* res = pgExec(db.conn, sql.c_str());
+        bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        if (!ok) cerr << "bank: " << sql << ": " << PQresultErrorMessage(res);
+        PQclear(res);
+        return ok;
+    }
+
+    // gid стороны перевода -> ключ решения и шард отправителя; false — чужой gid
+    static bool parseGid(const string& gid, string& base, int& fromShard) {
+        size_t prefix = strlen(XFER_GID_PREFIX);
+        if (gid.compare(0, prefix, XFER_GID_PREFIX) != 0) return false;
+        if (gid.find_first_not_of("0123456789abcdef:", prefix) != string::npos) return false;
+        size_t colon = gid.find(':', prefix);
+        size_t last = gid.rfind(':');
+        if (colon == string::npos || last <= colon) return false;
+        base = gid.substr(0, last);
+        fromShard = atoi(gid.c_str() + prefix);
+        return fromShard < shards().count();
+    }
+
+    void recoveryLoop(int interval) {
+        while (true) {
+            for (int s = 0; s < shards().count(); ++s) recoverShard(s);
+            this_thread::sleep_for(chrono::seconds(interval));
+        }
+    }
+
+    void recoverShard(int shard) {
+        vector<string> gids;
+        try {
+            PgConn db(shard);
+            PgParams params;
+            params.int4(recoverAfter);
+            PGresult* res = dbExecPrepared(db, STMT_XFER_IN_DOUBT, params);
+            if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+                for (int i = 0; i < PQntuples(res); ++i) gids.push_back(pgText(res, i, 0));
+            } else {
+                ++recoveryFailures;
+            }
+            PQclear(res);
+            // Решения старше недели не нужны: транзакции «в сомнении» столько не живут
+            PQclear(pgExec(db.conn, "DELETE FROM xfer_outcomes WHERE decided_at < now() - interval '7 days'"));
+        } catch (const exception&) {
+            ++recoveryFailures;   // шард недоступен — попробуем в следующий раз
+            return;
+        }
+
+        for (const string& gid : gids) {
+            string base;
+            int fromShard;
+            if (!parseGid(gid, base, fromShard)) continue;
+            try {
+                bool commit;
+                {
+                    PgConn from(fromShard);
+                    commit = outcome(from, base);
+                }
+                PgConn db(shard);
+                if (!finish(db, gid, commit)) {
+                    ++recoveryFailures;
+                    continue;
+                }
+                if (commit) ++recoveredCommits;
+                else        ++recoveredRollbacks;
+            } catch (const exception&) {
+                ++recoveryFailures;
+            }
+        }
+    }
+
+    int recoverAfter = 60;
+};
+
+ShardTransfers& shardTransfers() {
+    static ShardTransfers t;
+    return t;
+}
+
+// ===================== ПАРОЛИ =====================
+//
+// Пароли хранятся как хэш scrypt со случайной солью:
+//   $scrypt$ln=<log2 N>,r=<r>,p=<p>$<соль hex>$<хэш hex>
+// Стоимость задают password_scrypt_log2n/_r/_p. Хэш с другими параметрами, как и
+// пароль, оставшийся открытым текстом от прежних версий, при следующем удачном
+// входе заменяется хэшем с текущими параметрами.
+//
+// scrypt намеренно дорог (десятки мс процессора и 128 * r * N байт памяти), поэтому
+// в долгоживущих режимах он считается на отдельных потоках (password_hash_threads)
+// с ограниченной очередью (password_hash_queue): всплеск входов занимает только
+// их, а циклы событий и соединения с БД обслуживают остальные запросы.
+// Очередь полна — отказ 503.
+
+const char* const SCRYPT_PREFIX = "$scrypt$";
+const size_t SCRYPT_SALT_BYTES = 16;
+const size_t SCRYPT_HASH_BYTES = 32;
+const size_t SCRYPT_MAX_HASH_BYTES = 64;
+
+struct ScryptParams {
+    int log2n;
+    int r;
+    int p;
+
+    uint64_t memory() const {
+        return (128ULL * static_cast<uint64_t>(r)) << log2n;
+    }
+
+    // Пределы и для конфигурации, и для хранимых хэшей: чужая строка в БД
+    // не должна заставить считать scrypt на гигабайтах
+    bool sane() const {
+        return log2n >= 10 && log2n <= 24 && r >= 1 && r <= 32 && p >= 1 && p <= 16 &&
+               memory() <= (1ULL << 30);
+    }
+
+    bool operator==(const ScryptParams& o) const {
+        return log2n == o.log2n && r == o.r && p == o.p;
+    }
+};
+
+// Текущие параметры из конфигурации
+const ScryptParams& scryptParams() {
+    static const ScryptParams params = [] {
+        const Config& cfg = config();
+        ScryptParams sp{ cfg.getInt("password_scrypt_log2n", 15), cfg.getInt("password_scrypt_r", 8),
+                         cfg.getInt("password_scrypt_p", 1) };
+        if (!sp.sane()) throw runtime_error("Недопустимые параметры scrypt (password_scrypt_*).");
+        return sp;
+    }();
+    return params;
+}
+
+string toHex(const unsigned char* data, size_t n) {
+    static const char digits[] = "0123456789abcdef";
+    string out(n * 2, '0');
+    for (size_t i = 0; i < n; ++i) {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 0xF];
+    }
+    return out;
+}
+
+bool fromHex(const char* s, size_t len, vector<unsigned char>& out) {
+    if (len % 2 != 0) return false;
+    out.resize(len / 2);
+    for (size_t i = 0; i < len; ++i) {
+        char c = s[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (v < 0) return false;
+        out[i / 2] = static_cast<unsigned char>(i % 2 == 0 ? v << 4 : out[i / 2] | v);
+    }
+    return true;
+}
+
+bool scryptDerive(const string& password, const unsigned char* salt, size_t saltLen,
+                  const ScryptParams& sp, unsigned char* out, size_t outLen) {
+    // maxmem — с запасом на буфер B (128 * r * p) сверх основного массива
+    uint64_t maxmem = sp.memory() + 128ULL * static_cast<uint64_t>(sp.r) * static_cast<uint64_t>(sp.p + 2);
+    return EVP_PBE_scrypt(password.data(), password.size(), salt, saltLen,
+                          1ULL << sp.log2n, static_cast<uint64_t>(sp.r), static_cast<uint64_t>(sp.p),
+                          maxmem, out, outLen) == 1;
+}
+
+// Хэш пароля в формате хранения (считается в вызывающем потоке)
+string scryptHash(const string& password, const ScryptParams& sp) {
+    unsigned char salt[SCRYPT_SALT_BYTES];
+    unsigned char key[SCRYPT_HASH_BYTES];
+    if (RAND_bytes(salt, sizeof(salt)) != 1 || !scryptDerive(password, salt, sizeof(salt), sp, key, sizeof(key))) {
+        throw runtime_error("Ошибка вычисления хэша пароля.");
+    }
+    char head[64];
+    snprintf(head, sizeof(head), "%sln=%d,r=%d,p=%d$", SCRYPT_PREFIX, sp.log2n, sp.r, sp.p);
+    return head + toHex(salt, sizeof(salt)) + "$" + toHex(key, sizeof(key));
+}
+
+// Проверить пароль по хранимому значению. rehash — пароль верный, но хранится
+// не в текущем формате (открытый текст или другие параметры scrypt).
+bool scryptVerify(const string& password, const string& stored, bool& rehash) {
+    rehash = false;
+    size_t prefix = strlen(SCRYPT_PREFIX);
+    if (stored.compare(0, prefix, SCRYPT_PREFIX) != 0) {
+        bool ok = stored.size() == password.size() &&
+                  CRYPTO_memcmp(stored.data(), password.data(), stored.size()) == 0;
+        rehash = ok;
+        return ok;
+    }
+
+    ScryptParams sp{};
+    int consumed = 0;
+    if (sscanf(stored.c_str() + prefix, "ln=%d,r=%d,p=%d$%n", &sp.log2n, &sp.r, &sp.p, &consumed) != 3 ||
+        consumed == 0 || !sp.sane()) {
+        return false;
+    }
+    const char* saltHex = stored.c_str() + prefix + consumed;
+    const char* dollar = strchr(saltHex, '$');
+    vector<unsigned char> salt, expected;
+    if (!dollar || !fromHex(saltHex, dollar - saltHex, salt) ||
+        !fromHex(dollar + 1, strlen(dollar + 1), expected) ||
+        expected.empty() || expected.size() > SCRYPT_MAX_HASH_BYTES) {
+        return false;
+    }
+
+    unsigned char key[SCRYPT_MAX_HASH_BYTES];
+    if (!scryptDerive(password, salt.data(), salt.size(), sp, key, expected.size())) {
+        throw runtime_error("Ошибка вычисления хэша пароля.");
+    }
+    bool ok = CRYPTO_memcmp(key, expected.data(), expected.size()) == 0;
+    rehash = ok && !(sp == scryptParams());
+    return ok;
+}
+
+// Потоки для дорогих вычислений с паролями. Без start() (CGI) задание
+// выполняется сразу в вызывающем потоке: там процесс обслуживает один запрос.
+class PasswordHasher {
+public:
+    atomic<uint64_t> jobs{0};       // выполненных заданий
+    atomic<uint64_t> rejected{0};   // отказов: очередь полна
+
+    enum JobState { JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_CANCELLED };
+
+    struct Job {
+        function<void()> fn;
+        Completion done;
+        atomic<int> state{JOB_QUEUED};
+        exception_ptr error;
+    };
+
+    // threads = 0 — password_hash_threads, по умолчанию половина ядер:
+    // вторая половина остаётся циклам событий
+    void start(int threads = 0) {
+        const Config& cfg = config();
+        if (threads <= 0) threads = cfg.getInt("password_hash_threads", 0);
+        if (threads <= 0) threads = static_cast<int>(max(1u, thread::hardware_concurrency() / 2));
+        queueMax = max(1, cfg.getInt("password_hash_queue", 256));
+        workers = threads;
+        for (int i = 0; i < threads; ++i) thread([this] { loop(); }).detach();
+    }
+
+    int threadCount() const {
+        return workers;
+    }
+
+    // Сколько заданий можно поставить в очередь без отказа
+    int capacity() const {
+        return queueMax;
+    }
+
+    int queued() {
+        lock_guard<mutex> lock(m);
+        return static_cast<int>(queue.size());
+    }
+
+    // Поставить fn в очередь; nullptr — очередь полна
+    shared_ptr<Job> submit(function<void()> fn) {
+        auto job = make_shared<Job>();
+        job->fn = move(fn);
+        if (workers == 0) {
+            execute(*job);
+            return job;
+        }
+        lock_guard<mutex> lock(m);
+        if (static_cast<int>(queue.size()) >= queueMax) {
+            ++rejected;
+            return nullptr;
+        }
+        queue.push_back(job);
+        cv.notify_one();
+        return job;
+    }
+
+    // Дождаться задания, но не дольше срока текущего запроса. Не успевшее
+    // начаться задание снимается (таймаут "hash"), начатое — дожидаемся:
+    // fn пишет в переменные ожидающего. Исключение из fn пробрасывается.
+    void wait(const shared_ptr<Job>& job) {
+        if (!job->done.wait(requestTimeLeftMs())) {
+            int expected = JOB_QUEUED;
+            if (job->state.compare_exchange_strong(expected, JOB_CANCELLED)) {
+                noteTimeout(TIMEOUT_HASH);
+                throw runtime_error("Истекло время ожидания проверки пароля.");
+            }
+            job->done.wait(-1);
+        }
+        if (job->error) rethrow_exception(job->error);
+    }
+
+private:
+    void execute(Job& job) {
+        int expected = JOB_QUEUED;
+        if (!job.state.compare_exchange_strong(expected, JOB_RUNNING)) return;   // ожидавший ушёл
+        try {
+            job.fn();
+        } catch (...) {
+            job.error = current_exception();
+        }
+        ++jobs;
+        job.state = JOB_DONE;
+        job.done.signal();
+    }
+
+    void loop() {
+        while (true) {
+            shared_ptr<Job> job;
+            {
+                unique_lock<mutex> lock(m);
+                cv.wait(lock, [this] { return !queue.empty(); });
+                job = move(queue.front());
+                queue.pop_front();
+            }
+            execute(*job);
+        }
+    }
+
+    int workers = 0;
+    int queueMax = 256;
+    mutex m;
+    condition_variable cv;
+    deque<shared_ptr<Job>> queue;
+};
+
+// Не разрушается при выходе: bank_tool и bench_micro завершаются обычным
+// return, а деструктор condition_variable ждал бы вечно спящие потоки
+PasswordHasher& passwordHasher() {
+    static PasswordHasher* h = new PasswordHasher;
+    return *h;
+}
+
+// Хэш нового пароля на потоке хэширования; false — очередь полна
+bool hashPassword(const string& password, string& out) {
+    PasswordHasher& h = passwordHasher();
+    auto job = h.submit([&] { out = scryptHash(password, scryptParams()); });
+    if (!job) return false;
+    h.wait(job);
+    return true;
+}
+
+enum PasswordCheck { PWD_MISMATCH, PWD_OK, PWD_BUSY };
+
+// Проверить пароль. Если он верен, но хранится не в текущем формате,
+// upgraded — новый хэш для записи в БД (считается тем же заданием).
+PasswordCheck checkPassword(const string& password, const string& stored, string& upgraded) {
+    PasswordHasher& h = passwordHasher();
+    bool ok = false;
+    auto job = h.submit([&] {
+        bool rehash;
+        ok = scryptVerify(password, stored, rehash);
+        if (ok && rehash) upgraded = scryptHash(password, scryptParams());
+    });
+    if (!job) return PWD_BUSY;
+    h.wait(job);
+    return ok ? PWD_OK : PWD_MISMATCH;
+}
+
+// Хэш, с которым сверяется пароль несуществующего пользователя: вход с неизвестным
+// логином стоит столько же, сколько с неверным паролем, и не выдаёт, есть ли логин.
+// Параметры текущие, поэтому и цена та же.
+const string& dummyPasswordHash() {
+    static const string hash = scryptHash("\x01dummy", scryptParams());
+    return hash;
+}
+
+// Очередь хэширования полна
+void jsonHashBusy() {
+    jsonRetryLater(503, "overloaded", "Сервер перегружен, повторите запрос позже.", 1);
+}
+
+// ===================== HANDLERS =====================
+
+// REGISTER
+void handleRegister(Cgicc& cgi) {
+    bool pFull, pEmail, pPwd;
+    string fullName = getParam(cgi, "fullName", pFull);
+    string email    = getParam(cgi, "email",    pEmail);
+    string password = getParam(cgi, "password", pPwd);
+
+    if (!pFull || !pEmail || !pPwd || fullName.empty() || email.empty() || password.size() < 6) {
+        jsonError("Некорректные данные регистрации.");
+        return;
+    }
+
+    try {
+        // Хэш — до взятия соединения, чтобы не держать его, пока считается scrypt
+        string passwordHash;
+        if (!hashPassword(password, passwordHash)) {
+            jsonHashBusy();
+            return;
+        }
+
+        // Пользователь живёт на шарде своего email — там и проверяется уникальность
+        PgConn db(shards().ofEmail(email));
+
+        // Проверка уникальности email
+        PgParams params;
+        params.text(email);
+        PGresult* res = dbExecPrepared(db, STMT_USER_ID_BY_EMAIL, params);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            PQclear(res);
+            throw runtime_error("Ошибка запроса к БД (register: check email)");
+        }
+
+        if (PQntuples(res) > 0) {
+            PQclear(res);
+            jsonError("Пользователь с таким email уже существует.");
+            return;
+        }
+        PQclear(res);
+
+        // Вставка пользователя
+        PgParams params2;
+        params2.text(fullName).text(email).text(passwordHash);
+
+        res = dbExecPrepared(db, STMT_INSERT_USER, params2);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
+            PQclear(res);
+            throw runtime_error("Ошибка вставки пользователя.");
+        }
+
+        int newId = pgInt4(res, 0, 0);
+        PQclear(res);
+
+        jsonBody().beginObject()
+            .field("success", true)
+            .field("message", "Регистрация выполнена.")
+            .field("userId", newId)
+            .field("fullName", fullName)
+            .endObject();
+
+    } catch (const exception& e) {
+        jsonInternalError("register", e);
+    }
+}
+
+// Заменить хранимый пароль хэшем в текущем формате (в основной БД шарда).
+// Неудача не мешает входу — замена повторится при следующем.
+void upgradePassword(int shard, const User& u, const string& hash) {
+    try {
+        PgConn db(shard);
+        PgParams params;
+        params.int4(u.id).text(hash).text(u.password);
+        PQclear(dbExecPrepared(db, STMT_UPGRADE_PASSWORD, params));
+    } catch (const exception& e) {
+        cerr << "bank: не удалось обновить хэш пароля пользователя " << u.id << ": " << e.what() << "\n";
+    }
+}
+
+// LOGIN
+void handleLogin(Cgicc& cgi) {
+    bool pLogin, pPwd;
+    string login = getParam(cgi, "login", pLogin);
+    string password = getParam(cgi, "password", pPwd);
+
+    if (!pLogin || !pPwd || login.empty() || password.empty()) {
+        jsonError("Введите логин и пароль.");
+        return;
+    }
+
+    try {
+        int userId = 0;
+        int shard = isAllDigits(login) ? (parseIntSafe(login, userId) ? shards().ofUser(userId) : 0)
+                                       : shards().ofEmail(login);
+        User u;
+        bool found;
+        {
+            PgConn db(shard, DB_READ);
+            found = dbFindUserByLogin(db, login, u);
+        }
+
+        // Пароль проверяется уже без соединения с БД на руках
+        string upgraded;
+        PasswordCheck check = checkPassword(password, found ? u.password : dummyPasswordHash(), upgraded);
+        if (!found && check == PWD_OK) check = PWD_MISMATCH;
+        if (check == PWD_BUSY) {
+            jsonHashBusy();
+            return;
+        }
+        if (check != PWD_OK) {
+            jsonError("Неверный логин или пароль.");
+            return;
+        }
+        if (!upgraded.empty()) upgradePassword(shard, u, upgraded);
+
+        jsonBody().beginObject()
+            .field("success", true)
+            .field("message", "Вход выполнен.")
+            .field("userId", u.id)
+            .field("fullName", u.fullName)
+            .endObject();
+
+    } catch (const exception& e) {
+        jsonInternalError("login", e);
+    }
+}
+
+// GET ACCOUNTS
+void handleGetAccounts(Cgicc& cgi) {
+    bool pUid;
+    string sUserId = getParam(cgi, "userId", pUid);
+    if (!pUid || sUserId.empty()) {
+        jsonError("Не указан userId.");
+        return;
+    }
+
+    int userId = 0;
+    if (!parseIntSafe(sUserId, userId)) {
+        jsonError("Некорректный userId.");
+        return;
+    }
+
+    try {
+        AccountCache& cache = accountCache();
+        vector<Account> accounts;
+
+        // Список в кэше бывает только у существующего пользователя
+        if (!cache.getAccounts(userId, accounts)) {
+            uint64_t gen = cache.generation();
+            PgConn db(shards().ofUser(userId), DB_READ);
+
+            if (!dbGetAccounts(db, userId, accounts)) {
+                jsonError("Пользователь не найден.");
+                return;
+            }
+            cache.putAccounts(userId, accounts, gen, db.fromReplica());
+        }
+
+        JsonWriter w = jsonBody();
+        w.beginObject().field("success", true).key("accounts").beginArray();
+        for (const Account& a : accounts) {
+            w.beginObject()
+                .field("number", a.number)
+                .field("balance", a.balance)
+                .endObject();
+        }
+        w.endArray().endObject();
+
+    } catch (const exception& e) {
+        jsonInternalError("getAccounts", e);
+    }
+}
+
+// CREATE ACCOUNT
+void handleCreateAccount(Cgicc& cgi) {
+    bool pUid;
+    string sUserId = getParam(cgi, "userId", pUid);
+    if (!pUid || sUserId.empty()) {
+        jsonError("Не указан userId.");
+        return;
+    }
+
+    int userId = 0;
+    if (!parseIntSafe(sUserId, userId)) {
+        jsonError("Некорректный userId.");
+        return;
+    }
+
+    try {
+        // Счёт открывается на шарде владельца, номер указывает на этот шард
+        int shard = shards().ofUser(userId);
+        PgConn db(shard);
+
+        // Проверка пользователя, лимита и вставка — один запрос. Совпадение номера
+        // (при 10^9 вариантах на шард — редкость) просто повторяем с новым номером.
+        string accNumber;
+        CreateAccountRow row{};
+        for (int attempt = 0; attempt < ACCOUNT_NUMBER_ATTEMPTS && !row.inserted; ++attempt) {
+            accNumber = generateAccountNumber(shard);
+            PgParams params;
+            params.int4(userId).text(accNumber).int8(MAX_ACCOUNTS_PER_USER);
+
+            PGresult* res = dbExecPrepared(db, STMT_CREATE_ACCOUNT, params);
+            if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1) {
+                PQclear(res);
+                throw runtime_error("Ошибка вставки счета.");
+            }
+            row = decodeRow<CreateAccountRow>(res, 0);
+            PQclear(res);
+
+            if (!row.userFound) {
+                jsonError("Пользователь не найден.");
+                return;
+            }
+            if (row.accountCount >= MAX_ACCOUNTS_PER_USER) {
+                jsonError("Нельзя создать больше 3 счетов.");
+                return;
+            }
+        }
+        if (!row.inserted) {
+            throw runtime_error("Не удалось подобрать свободный номер счета.");
+        }
+        accountCache().invalidateUser(userId);
+
+        jsonBody().beginObject()
+            .field("success", true)
+            .field("message", "Счёт создан.")
+            .field("accountNumber", accNumber)
+            .endObject();
+
+    } catch (const exception& e) {
+        jsonInternalError("createAccount", e);
+    }
+}
+
+// DELETE ACCOUNT
+void handleDeleteAccount(Cgicc& cgi) {
+    bool pUid, pAcc;
+    string sUserId = getParam(cgi, "userId", pUid);
+    string accNumber = getParam(cgi, "accountNumber", pAcc);
+
+    if (!pUid || !pAcc || sUserId.empty() || accNumber.empty()) {
+        jsonError("Не указан userId или accountNumber.");
+        return;
+    }
+
+    int userId = 0;
+    if (!parseIntSafe(sUserId, userId)) {
+        jsonError("Некорректный userId.");
+        return;
+    }
+
+    try {
+        // Счёт пользователя может быть только на его шарде
+        PgConn db(shards().ofUser(userId));
+
+        // Сначала узнаём баланс и принадлежность
+        PgParams params;
+        params.int4(userId).text(accNumber);
+
+        PGresult* res = dbExecPrepared(db, STMT_OWNED_ACCOUNT_BALANCE, params);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            PQclear(res);
+            throw runtime_error("Ошибка запроса к БД (deleteAccount: select)");
+        }
+
+        if (PQntuples(res) == 0) {
+            PQclear(res);
+            jsonError("Счёт не найден.");
+            return;
+        }
+
+        Money balance = decodeRow<Money>(res, 0);
+        PQclear(res);
+
+        if (balance > Money()) {
+            jsonError("Нельзя удалить счёт с ненулевым балансом.");
+            return;
+        }
+
+        // Удаляем
+        res = dbExecPrepared(db, STMT_DELETE_ACCOUNT, params);
+        accountCache().invalidateAccount(accNumber);
+        accountCache().invalidateUser(userId);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            PQclear(res);
+            throw runtime_error("Ошибка удаления счета.");
+        }
+
+        PQclear(res);
+        jsonOkMessage("Счёт удалён.");
+
+    } catch (const exception& e) {
+        jsonInternalError("deleteAccount", e);
+    }
+}
+
+// TOPUP
+void handleTopup(Cgicc& cgi) {
+    bool pAcc, pAmt;
+    string accNumber = getParam(cgi, "accountNumber", pAcc);
+    string sAmount   = getParam(cgi, "amount", pAmt);
+
+    if (!pAcc || !pAmt || accNumber.empty() || sAmount.empty()) {
+        jsonError("Не указан счёт или сумма.");
+        return;
+    }
+
+    Money amount;
+    if (!parseMoney(sAmount, amount) || amount <= Money()) {
+        jsonError("Сумма должна быть > 0.");
+        return;
+    }
+
+    int shard;
+    if (!shards().ofAccount(accNumber, shard)) {
+        jsonError("Счёт не найден.");
+        return;
+    }
+
+    try {
+        Money newBalance;
+        bool found;
+        TopupCoalescer& coalescer = topupCoalescer();
+        if (coalescer.enabled()) {
+            found = coalescer.credit(accNumber, shard, amount, newBalance);
+        } else {
+            PgConn db(shard);
+            found = dbCredit(db, accNumber, { amount }, newBalance);
+        }
+        accountCache().invalidateAccount(accNumber);
+
+        if (!found) {
+            jsonError("Счёт не найден.");
+            return;
+        }
+
+        jsonBody().beginObject()
+            .field("success", true)
+            .field("message", "Баланс пополнен.")
+            .field("newBalance", newBalance)
+            .endObject();
+
+    } catch (const exception& e) {
+        jsonInternalError("topup", e);
+    }
+}
+
+// WITHDRAW
+void handleWithdraw(Cgicc& cgi) {
+    bool pAcc, pAmt;
+    string accNumber = getParam(cgi, "accountNumber", pAcc);
+    string sAmount   = getParam(cgi, "amount", pAmt);
+
+    if (!pAcc || !pAmt || accNumber.empty() || sAmount.empty()) {
+        jsonError("Не указан счёт или сумма.");
+        return;
+    }
+
+    Money amount;
+    if (!parseMoney(sAmount, amount) || amount <= Money()) {
+        jsonError("Сумма должна быть > 0.");
+        return;
+    }
+
+    int shard;
+    if (!shards().ofAccount(accNumber, shard)) {
+        jsonError("Счёт не найден.");
+        return;
+    }
+
+    try {
+        PgConn db(shard);
+
+        PgParams params;
+        params.text(accNumber).money(amount);
+
+        // Проверка баланса и списание — одним запросом под блокировкой строки
+        PGresult* res = dbExecPrepared(db, STMT_WITHDRAW, params);
+        accountCache().invalidateAccount(accNumber);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
+            PQclear(res);
+            throw runtime_error("Ошибка обновления баланса (withdraw).");
+        }
+
+        WithdrawRow w = decodeRow<WithdrawRow>(res, 0);
+        PQclear(res);
+
+        if (!w.found) {
+            jsonError("Счёт не найден.");
+            return;
+        }
+        if (!w.applied) {
+            jsonError("Недостаточно средств.");
+            return;
+        }
+
+        jsonBody().beginObject()
+            .field("success", true)
+            .field("message", "Снятие выполнено.")
+            .field("newBalance", w.newBalance)
+            .endObject();
+
+    } catch (const exception& e) {
+        jsonInternalError("withdraw", e);
+    }
+}
+
+// TRANSFER
+void handleTransfer(Cgicc& cgi) {
+    bool pFrom, pTo, pAmt;
+    string fromAccNumber = getParam(cgi, "fromAccount", pFrom);
+    string toAccNumber   = getParam(cgi, "toAccount",   pTo);
+    string sAmount       = getParam(cgi, "amount",      pAmt);
+
+    if (!pFrom || !pTo || !pAmt ||
+        fromAccNumber.empty() || toAccNumber.empty() || sAmount.empty()) {
+        jsonError("Нужно указать fromAccount, toAccount и amount.");
+        return;
+    }
+
+    if (fromAccNumber == toAccNumber) {
+        jsonError("Нельзя перевести на тот же счёт.");
+        return;
+    }
+
+    Money amount;
+    if (!parseMoney(sAmount, amount) || amount <= Money()) {
+        jsonError("Сумма должна быть > 0.");
+        return;
+    }
+
+    int fromShard, toShard;
+    if (!shards().ofAccount(fromAccNumber, fromShard)) {
+        jsonError("Счёт-отправитель не найден.");
+        return;
+    }
+    if (!shards().ofAccount(toAccNumber, toShard)) {
+        jsonError("Счёт-получатель не найден.");
+        return;
+    }
+
+    try {
+        TransferRow t;
+        if (fromShard != toShard) {
+            t = shardTransfers().transfer(fromShard, fromAccNumber, toShard, toAccNumber, amount);
+            accountCache().invalidateAccount(fromAccNumber);
+            accountCache().invalidateAccount(toAccNumber);
+        } else {
+            PgConn db(fromShard);
+
+            PgParams params;
+            params.text(fromAccNumber).text(toAccNumber).money(amount);
+
+            // Весь перевод — один атомарный запрос. Взаимоблокировки с посторонними
+            // транзакциями всё же возможны, поэтому 40P01/40001 повторяем с паузой.
+            PGresult* res = dbExecPreparedRetry(db, STMT_TRANSFER, params);
+            accountCache().invalidateAccount(fromAccNumber);
+            accountCache().invalidateAccount(toAccNumber);
+
+            if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
+                string msg = PQresultErrorMessage(res);
+                PQclear(res);
+                throw runtime_error("Ошибка выполнения перевода: " + msg);
+            }
+
+            t = decodeRow<TransferRow>(res, 0);
+            PQclear(res);
+        }
+
+        if (!t.fromFound) {
+            jsonError("Счёт-отправитель не найден.");
+            return;
+        }
+        if (!t.toFound) {
+            jsonError("Счёт-получатель не найден.");
+            return;
+        }
+        if (!t.applied) {
+            jsonError("Недостаточно средств.");
+            return;
+        }
+
+        jsonBody().beginObject()
+            .field("success", true)
+            .field("message", "Перевод выполнен.")
+            .field("newBalance", t.newFromBalance)
+            .endObject();
+
+    } catch (const exception& e) {
+        jsonInternalError("transfer", e);
+    }
+}
+
+// GET BALANCE
+void handleGetBalance(Cgicc& cgi) {
+    bool pAcc;
+    string accNumber = getParam(cgi, "accountNumber", pAcc);
+    if (!pAcc || accNumber.empty()) {
+        jsonError("Не указан номер счёта.");
+        return;
+    }
+
+    int shard;
+    if (!shards().ofAccount(accNumber, shard)) {
+        jsonError("Счёт не найден.");
+        return;
+    }
+
+    try {
+        AccountCache& cache = accountCache();
+        Money balance;
+
+        if (!cache.getBalance(accNumber, balance)) {
+            uint64_t gen = cache.generation();
+            PgConn db(shard, DB_READ);
+            if (!dbGetAccountBalance(db, accNumber, balance)) {
+                jsonError("Счёт не найден.");
+                return;
+            }
+            cache.putBalance(accNumber, balance, gen, db.fromReplica());
+        }
+
+        jsonBody().beginObject()
+            .field("success", true)
+            .field("balance", balance)
+            .field("message", "Баланс получен.")
+            .endObject();
+
+    } catch (const exception& e) {
+        jsonInternalError("getBalance", e);
+    }
+}
+
+// DASHBOARD
+// Всё для главной страницы одним ответом и одним запросом к БД:
+// профиль, счета с балансами и сколько ещё счетов можно открыть.
+void handleDashboard(Cgicc& cgi) {
+    bool pUid;
+    string sUserId = getParam(cgi, "userId", pUid);
+    if (!pUid || sUserId.empty()) {
+        jsonError("Не указан userId.");
+        return;
+    }
+
+    int userId = 0;
+    if (!parseIntSafe(sUserId, userId)) {
+        jsonError("Некорректный userId.");
+        return;
+    }
+
+    try {
+        AccountCache& cache = accountCache();
+        uint64_t gen = cache.generation();
+        User user;
+        vector<Account> accounts;
+        bool fromReplica;
+        {
+            PgConn db(shards().ofUser(userId), DB_READ);
+            if (!dbGetAccounts(db, userId, accounts, &user)) {
+                jsonError("Пользователь не найден.");
+                return;
+            }
+            fromReplica = db.fromReplica();
+        }
+        cache.putAccounts(userId, accounts, gen, fromReplica);
+
+        JsonWriter w = jsonBody();
+        w.beginObject()
+            .field("success", true)
+            .key("user").beginObject()
+                .field("id", user.id)
+                .field("fullName", user.fullName)
+                .field("email", user.email)
+            .endObject()
+            .key("accounts").beginArray();
+        for (const Account& a : accounts) {
+            w.beginObject()
+                .field("number", a.number)
+                .field("balance", a.balance)
+                .endObject();
+        }
+        w.endArray()
+            .field("accountCount", accounts.size())
+            .field("accountLimit", MAX_ACCOUNTS_PER_USER)
+            .endObject();
+
+    } catch (const exception& e) {
+        jsonInternalError("dashboard", e);
+    }
+}
+
+// История операций по счёту (журнал ledger), от новых к старым, постранично.
+// Первая страница — без before; следующая — before = nextBefore из ответа.
+// nextBefore = null — записей больше нет.
+const int HISTORY_DEFAULT_LIMIT = 20;
+const int HISTORY_MAX_LIMIT = 100;
+
+void handleHistory(Cgicc& cgi) {
+    bool pAcc, pBefore, pLimit;
+    string accNumber = getParam(cgi, "accountNumber", pAcc);
+    string sBefore   = getParam(cgi, "before", pBefore);
+    string sLimit    = getParam(cgi, "limit", pLimit);
+
+    if (!pAcc || accNumber.empty()) {
+        jsonError("Не указан номер счёта.");
+        return;
+    }
+
+    int64_t before = numeric_limits<int64_t>::max();
+    if (pBefore && !sBefore.empty() && (!parseIntSafe(sBefore, before) || before <= 0)) {
+        jsonError("Некорректный курсор before.");
+        return;
+    }
+
+    int limit = HISTORY_DEFAULT_LIMIT;
+    if (pLimit && !sLimit.empty() &&
+        (!parseIntSafe(sLimit, limit) || limit < 1 || limit > HISTORY_MAX_LIMIT)) {
+        jsonError("limit должен быть от 1 до " + to_string(HISTORY_MAX_LIMIT) + ".");
+        return;
+    }
+
+    int shard;
+    if (!shards().ofAccount(accNumber, shard)) {
+        jsonError("Счёт не найден.");
+        return;
+    }
+
+    try {
+        PgConn db(shard, DB_READ);
+        PgParams params;
+        // Одна запись сверх страницы — чтобы знать, есть ли следующая
+        params.text(accNumber).int8(before).int4(limit + 1);
+
+        PGresult* res = dbExecPrepared(db, STMT_HISTORY, params);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            string msg = PQresultErrorMessage(res);
+            PQclear(res);
+            throw runtime_error("Ошибка чтения истории: " + msg);
+        }
+
+        int rows = PQntuples(res);
+        if (rows == 0) {
+            PQclear(res);
+            jsonError("Счёт не найден.");
+            return;
+        }
+
+        vector<HistoryRow> page = decodeRows<HistoryRow>(res);
+        PQclear(res);
+
+        bool more = rows > limit;
+        vector<LedgerEntry> entries;
+        for (HistoryRow& r : page) {
+            if (!r.hasEntry || static_cast<int>(entries.size()) == limit) break;
+            entries.push_back(move(r.entry));
+        }
+
+        JsonWriter w = jsonBody();
+        w.beginObject()
+            .field("success", true)
+            .key("entries").beginArray();
+        for (const LedgerEntry& e : entries) {
+            w.beginObject()
+                .field("id", e.id)
+                .field("type", e.kind)
+                .field("amount", e.amount)
+                .field("balanceAfter", e.balanceAfter);
+            if (e.counterparty.empty()) w.key("counterparty").null();
+            else                        w.field("counterparty", e.counterparty);
+            w.field("createdAt", e.createdAt).endObject();
+        }
+        w.endArray();
+        if (more) w.field("nextBefore", entries.back().id);
+        else      w.key("nextBefore").null();
+        w.endObject();
+
+    } catch (const exception& e) {
+        jsonInternalError("history", e);
+    }
+}
+
+// Выписка по счёту за период (action=exportStatement): accountNumber, from и to
+// (YYYY-MM-DD, UTC, включительно; обе необязательны), format = csv (по умолчанию)
+// или json. Записи читаются из БД построчно и уходят клиенту частями по мере
+// накопления — память не зависит от длины выписки.
+void handleExportStatement(Cgicc& cgi) {
+    bool pAcc, pFrom, pTo, pFormat;
+    string accNumber = getParam(cgi, "accountNumber", pAcc);
+    string from      = getParam(cgi, "from", pFrom);
+    string to        = getParam(cgi, "to", pTo);
+    string format    = getParam(cgi, "format", pFormat);
+
+    if (!pAcc || accNumber.empty()) {
+        jsonError("Не указан номер счёта.");
+        return;
+    }
+    if (!isAllDigits(accNumber)) {
+        jsonError("Некорректный номер счёта.");
+        return;
+    }
+    if (format.empty()) format = "csv";
+    if (format != "csv" && format != "json") {
+        jsonError("format должен быть csv или json.");
+        return;
+    }
+    if ((!from.empty() && !isValidDate(from)) || (!to.empty() && !isValidDate(to))) {
+        jsonError("Даты указываются в виде ГГГГ-ММ-ДД.");
+        return;
+    }
+    if (!from.empty() && !to.empty() && from > to) {
+        jsonError("Начало периода позже конца.");
+        return;
+    }
+
+    int shard;
+    if (!shards().ofAccount(accNumber, shard)) {
+        jsonError("Счёт не найден.");
+        return;
+    }
+
+    try {
+        PgConn db(shard, DB_READ);
+        Money balance;
+        if (!dbGetAccountBalance(db, accNumber, balance)) {
+            jsonError("Счёт не найден.");
+            return;
+        }
+
+        string fromParam = from.empty() ? "-infinity" : from;
+        string toParam   = to.empty() ? "infinity" : to;
+        PgParams params;
+        params.text(accNumber).text(fromParam).text(toParam);
+
+        Response& r = response();
+        r.extraHeaders += "Content-Disposition: attachment; filename=\"statement-" +
+                          accNumber + "." + format + "\"\r\n";
+
+        if (format == "csv") {
+            beginStream("text/csv");
+            r.body += "id,created_at,type,amount,balance_after,counterparty\r\n";
+            char buf[32];
+            dbStreamPrepared(db, STMT_STATEMENT_EXPORT, params, [&](const PGresult* res) {
+                LedgerEntry e = decodeRow<LedgerEntry>(res, 0);
+                r.body.append(buf, formatInt(buf, e.id));
+                r.body += ',';
+                r.body += e.createdAt;
+                r.body += ',';
+                r.body += e.kind;
+                r.body += ',';
+                r.body.append(buf, formatMoney(buf, e.amount));
+                r.body += ',';
+                r.body.append(buf, formatMoney(buf, e.balanceAfter));
+                r.body += ',';
+                r.body += e.counterparty;
+                r.body += "\r\n";
+                streamFlush();
+            });
+        } else {
+            beginStream("application/json");
+            JsonWriter w(r.body);
+            w.beginObject()
+                .field("success", true)
+                .field("account", accNumber);
+            if (from.empty()) w.key("from").null(); else w.field("from", from);
+            if (to.empty())   w.key("to").null();   else w.field("to", to);
+            w.field("currentBalance", balance)
+                .key("entries").beginArray();
+            uint64_t count = 0;
+            dbStreamPrepared(db, STMT_STATEMENT_EXPORT, params, [&](const PGresult* res) {
+                LedgerEntry e = decodeRow<LedgerEntry>(res, 0);
+                w.beginObject()
+                    .field("id", e.id)
+                    .field("createdAt", e.createdAt)
+                    .field("type", e.kind)
+                    .field("amount", e.amount)
+                    .field("balanceAfter", e.balanceAfter);
+                if (e.counterparty.empty()) w.key("counterparty").null();
+                else                        w.field("counterparty", e.counterparty);
+                w.endObject();
+                ++count;
+                streamFlush();
+            });
+            w.endArray().field("count", count).endObject();
+        }
+        endStream();
+
+    } catch (const exception& e) {
+        jsonInternalError("exportStatement", e);
+    }
+}
+
+// ===================== ПАКЕТНЫЕ ОПЕРАЦИИ (batch) =====================
+
+// Одна операция пакета. Запрос к БД строится по тем же подготовленным
+// запросам, что и у одиночных topup / withdraw / transfer.
+struct BatchOp {
+    string type;
+    string account;      // для topup/withdraw — счёт, для transfer — счёт-отправитель
+    string toAccount;    // только для transfer
+    Money amount;
+
+    // Результат
+    bool sent = false;
+    bool ok = false;
+    bool hasBalance = false;
+    Money newBalance;
+    string message;
+};
+
+// Проверка и разбор операции без обращения к БД
+bool validateBatchOp(const map<string, string>& fields, BatchOp& op) {
+    auto field = [&](const char* key) {
+        auto it = fields.find(key);
+        return it != fields.end() ? it->second : string();
+    };
+
+    op.type = field("type");
+    string sAmount = field("amount");
+
+    if (op.type == "topup" || op.type == "withdraw") {
+        op.account = field("accountNumber");
+        if (op.account.empty()) {
+            op.message = "Не указан счёт.";
+            return false;
+        }
+    } else if (op.type == "transfer") {
+        op.account   = field("fromAccount");
+        op.toAccount = field("toAccount");
+        if (op.account.empty() || op.toAccount.empty()) {
+            op.message = "Нужно указать fromAccount и toAccount.";
+            return false;
+        }
+        if (op.account == op.toAccount) {
+            op.message = "Нельзя перевести на тот же счёт.";
+            return false;
+        }
+    } else {
+        op.message = "Неизвестный тип операции: " + op.type;
+        return false;
+    }
+
+    if (!parseMoney(sAmount, op.amount) || op.amount <= Money()) {
+        op.message = "Сумма должна быть > 0.";
+        return false;
+    }
+    return true;
+}
+
+StmtId batchStmt(const BatchOp& op) {
+    if (op.type == "topup")    return STMT_BALANCE_ADD;
+    if (op.type == "withdraw") return STMT_WITHDRAW;
+    return STMT_TRANSFER;
+}
+
+void sendBatchOp(PgConn& db, const BatchOp& op) {
+    StmtId id = batchStmt(op);
+    string amounts;
+    PgParams params;
+    params.text(op.account);
+    if (id == STMT_TRANSFER) params.text(op.toAccount);
+    if (id == STMT_BALANCE_ADD) {
+        amounts = pgMoneyArray({ op.amount });
+        params.text(amounts);
+    } else {
+        params.money(op.amount);
+    }
+
+    if (!PQsendQueryPrepared(db.conn, STATEMENTS[resolveStmt(id)].name, params.size(),
+                             params.values(), params.lengths(), params.formats(), 1)) {
+        throw runtime_error(string("Ошибка отправки запроса (batch): ") + PQerrorMessage(db.conn));
+    }
+}
+
+// Итог перевода (внутри шарда или между шардами); false — перевод не выполнен
+bool applyTransferRow(BatchOp& op, const TransferRow& t) {
+    if (!t.fromFound) {
+        op.message = "Счёт-отправитель не найден.";
+        return false;
+    }
+    if (!t.toFound) {
+        op.message = "Счёт-получатель не найден.";
+        return false;
+    }
+    if (!t.applied) {
+        op.message = "Недостаточно средств.";
+        return false;
+    }
+    op.newBalance = t.newFromBalance;
+    op.message = "Перевод выполнен.";
+    return true;
+}
+
+// Разбор результата операции. Формат строк совпадает с одиночными обработчиками.
+void applyBatchResult(BatchOp& op, const PGresult* res) {
+    ExecStatusType st = PQresultStatus(res);
+    if (st == PGRES_PIPELINE_ABORTED) {
+        op.message = "Не выполнено: пакет прерван предыдущей ошибкой.";
+        return;
+    }
+    if (st != PGRES_TUPLES_OK) {
+        op.message = string("Ошибка БД: ") + PQresultErrorMessage(res);
+        return;
+    }
+
+    StmtId id = batchStmt(op);
+    if (id == STMT_BALANCE_ADD) {
+        if (PQntuples(res) == 0) {
+            op.message = "Счёт не найден.";
+            return;
+        }
+        op.newBalance = decodeRow<Money>(res, 0);
+        op.message = "Баланс пополнен.";
+    } else if (id == STMT_WITHDRAW) {
+        WithdrawRow w = decodeRow<WithdrawRow>(res, 0);
+        if (!w.found) {
+            op.message = "Счёт не найден.";
+            return;
+        }
+        if (!w.applied) {
+            op.message = "Недостаточно средств.";
+            return;
+        }
+        op.newBalance = w.newBalance;
+        op.message = "Снятие выполнено.";
+    } else if (!applyTransferRow(op, decodeRow<TransferRow>(res, 0))) {
+        return;
+    }
+    op.ok = true;
+    op.hasBalance = true;
+}
+
+// Результат очередного запроса конвейера (с поглощением завершающего NULL)
+PGresult* pipelineResult(PgConn& db) {
+    PGresult* res = pgGetResult(db.conn);
+    if (!res) {
+        throw runtime_error(string("Конвейер БД оборвался: ") + PQerrorMessage(db.conn));
+    }
+    if (PQresultStatus(res) != PGRES_PIPELINE_SYNC) {
+        PGresult* tail = pgGetResult(db.conn);
+        if (tail) PQclear(tail);
+    }
+    return res;
+}
+
+void expectPipelineSync(PgConn& db) {
+    PGresult* res = pipelineResult(db);
+    ExecStatusType st = PQresultStatus(res);
+    PQclear(res);
+    if (st != PGRES_PIPELINE_SYNC) {
+        throw runtime_error("Нарушен порядок результатов конвейера БД.");
+    }
+}
+
+void sendControl(PgConn& db, const char* sql) {
+    if (!PQsendQueryParams(db.conn, sql, 0, nullptr, nullptr, nullptr, nullptr, 0)) {
+        throw runtime_error(string("Ошибка отправки запроса (batch): ") + PQerrorMessage(db.conn));
+    }
+}
+
+// Выполнить пакет в конвейерном режиме libpq. Запросы уходят окнами по batch_window
+// штук: внутри окна клиент не ждёт ответа на каждый запрос, а между окнами вычитывает
+// результаты, чтобы буферы сокета не переполнились в обе стороны одновременно.
+//
+// atomic = false: после каждой операции — точка синхронизации, т.е. каждая операция
+//                 выполняется в своей неявной транзакции и ошибки не влияют на соседей.
+// atomic = true:  весь пакет внутри BEGIN ... COMMIT; при первой неудаче отправка
+//                 прекращается и транзакция откатывается. Возвращает, зафиксирован ли пакет.
+bool runBatchPipelined(PgConn& db, vector<BatchOp>& ops, bool atomic) {
+    dbPrepare(db, STMT_BALANCE_ADD);
+    dbPrepare(db, STMT_WITHDRAW);
+    dbPrepare(db, STMT_TRANSFER);
+
+    size_t window = static_cast<size_t>(max(1, config().getInt("batch_window", 64)));
+
+    if (!PQenterPipelineMode(db.conn)) {
+        throw runtime_error(string("Не удалось включить конвейерный режим: ") + PQerrorMessage(db.conn));
+    }
+
+    // Атомарный пакет — одна транзакция: ограничиваем её остатком срока запроса
+    // (одним запросом, в конвейере несколько команд в одной строке нельзя)
+    string limits;
+    int statementMs, lockMs;
+    if (atomic && localTimeouts(statementMs, lockMs)) {
+        limits = "SELECT set_config('statement_timeout', '" + to_string(statementMs) + "', true), "
+                 "set_config('lock_timeout', '" + to_string(lockMs) + "', true)";
+    }
+
+    bool failed = false;
+    try {
+        if (atomic) sendControl(db, "BEGIN");
+        if (!limits.empty()) sendControl(db, limits.c_str());
+
+        for (size_t start = 0; start < ops.size() && !failed; start += window) {
+            size_t end = min(ops.size(), start + window);
+
+            for (size_t i = start; i < end; ++i) {
+                sendBatchOp(db, ops[i]);
+                ops[i].sent = true;
+                if (!atomic) PQpipelineSync(db.conn);
+            }
+            if (atomic) PQsendFlushRequest(db.conn);
+            if (!pgFlush(db.conn)) {
+                throw runtime_error(string("Ошибка отправки пакета: ") + PQerrorMessage(db.conn));
+            }
+            noteRoundTrip();   // окно — один обмен с БД, сколько бы запросов в нём ни было
+
+            if (atomic && start == 0) {
+                PGresult* res = pipelineResult(db);
+                bool begun = PQresultStatus(res) == PGRES_COMMAND_OK;
+                PQclear(res);
+                if (!begun) failed = true;
+                if (!limits.empty()) {
+                    res = pipelineResult(db);
+                    if (PQresultStatus(res) != PGRES_TUPLES_OK) failed = true;
+                    PQclear(res);
+                }
+            }
+
+            for (size_t i = start; i < end; ++i) {
+                PGresult* res = pipelineResult(db);
+                applyBatchResult(ops[i], res);
+                PQclear(res);
+                if (!atomic) expectPipelineSync(db);
+                // Без atomic операции независимы: неудача одной не останавливает остальные
+                if (atomic && !ops[i].ok) failed = true;
+            }
+        }
+
+        if (atomic) {
+            sendControl(db, failed ? "ROLLBACK" : "COMMIT");
+            PQpipelineSync(db.conn);
+            pgFlush(db.conn);
+            noteRoundTrip();
+            PGresult* res = pipelineResult(db);
+            if (PQresultStatus(res) != PGRES_COMMAND_OK) failed = true;
+            PQclear(res);
+            expectPipelineSync(db);
+        }
+    } catch (...) {
+        // Соединение в неизвестном состоянии конвейера — пул его закроет
+        PQexitPipelineMode(db.conn);
+        throw;
+    }
+
+    PQexitPipelineMode(db.conn);
+
+    // Если COMMIT/ROLLBACK не дошёл (конвейер был прерван ошибкой),
+    // транзакционный блок ещё открыт — закрываем его обычным запросом.
+    if (PQtransactionStatus(db.conn) != PQTRANS_IDLE) {
+        PQclear(pgExec(db.conn, "ROLLBACK"));
+    }
+
+    if (atomic && failed) {
+        for (auto& op : ops) {
+            if (op.ok) {
+                op.ok = false;
+                op.hasBalance = false;
+                op.message = "Отменено: пакет выполняется целиком, другая операция не прошла.";
+            }
+        }
+    }
+    return !(atomic && failed);
+}
+
+// Шард операции пакета; -1 — перевод между шардами. false — счёт операции
+// заведомо не существует (op.message заполнен).
+const int CROSS_SHARD = -1;
+
+bool batchOpShard(BatchOp& op, int& shard) {
+    ShardMap& sm = shards();
+    if (!sm.ofAccount(op.account, shard)) {
+        op.message = op.toAccount.empty() ? "Счёт не найден." : "Счёт-отправитель не найден.";
+        return false;
+    }
+    int toShard;
+    if (!op.toAccount.empty()) {
+        if (!sm.ofAccount(op.toAccount, toShard)) {
+            op.message = "Счёт-получатель не найден.";
+            return false;
+        }
+        if (toShard != shard) shard = CROSS_SHARD;
+    }
+    return true;
+}
+
+// BATCH
+// Параметры: operations — JSON-массив операций вида
+//   {"type": "topup",    "accountNumber": "...", "amount": 100}
+//   {"type": "withdraw", "accountNumber": "...", "amount": 50}
+//   {"type": "transfer", "fromAccount": "...", "toAccount": "...", "amount": 10}
+// atomic = 1 — всё или ничего, иначе операции независимы.
+// Операции каждого шарда выполняются одним конвейером на его соединении
+// (порядок внутри шарда сохраняется), переводы между шардами — после них,
+// по одному. Атомарный пакет должен целиком лежать на одном шарде.
+void handleBatch(Cgicc& cgi) {
+    bool pOps, pAtomic;
+    string sOps    = getParam(cgi, "operations", pOps);
+    string sAtomic = getParam(cgi, "atomic", pAtomic);
+
+    if (!pOps || sOps.empty()) {
+        jsonError("Не указан список операций.");
+        return;
+    }
+    bool atomic = pAtomic && (sAtomic == "1" || sAtomic == "true");
+
+    vector<map<string, string>> items;
+    if (!JsonArrayParser(sOps).parse(items) || items.empty()) {
+        jsonError("Некорректный список операций.");
+        return;
+    }
+    if (static_cast<int>(items.size()) > config().getInt("batch_max_ops", 1000)) {
+        jsonError("Слишком много операций в пакете.");
+        return;
+    }
+
+    vector<BatchOp> ops(items.size());
+    vector<BatchOp> valid;
+    vector<size_t> validIndex;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (validateBatchOp(items[i], ops[i])) {
+            valid.push_back(ops[i]);
+            validIndex.push_back(i);
+        } else if (atomic) {
+            jsonError("Операция #" + to_string(i) + ": " + ops[i].message);
+            return;
+        }
+    }
+
+    vector<int> opShard(valid.size());
+    for (size_t k = 0; k < valid.size(); ++k) {
+        if (!batchOpShard(valid[k], opShard[k])) {
+            if (atomic) {
+                jsonError("Операция #" + to_string(validIndex[k]) + ": " + valid[k].message);
+                return;
+            }
+            opShard[k] = -2;   // не выполняется
+        } else if (atomic && (opShard[k] == CROSS_SHARD || opShard[k] != opShard[0])) {
+            jsonError("Атомарный пакет должен затрагивать счета одного шарда.");
+            return;
+        }
+    }
+
+    try {
+        bool committed = true;
+        for (int s = 0; s < shards().count(); ++s) {
+            vector<BatchOp> part;
+            vector<size_t> partIndex;
+            for (size_t k = 0; k < valid.size(); ++k) {
+                if (opShard[k] != s) continue;
+                part.push_back(valid[k]);
+                partIndex.push_back(k);
+            }
+            if (part.empty()) continue;
+            PgConn db(s);
+            committed = runBatchPipelined(db, part, atomic) && committed;
+            for (size_t j = 0; j < part.size(); ++j) valid[partIndex[j]] = part[j];
+        }
+        for (size_t k = 0; k < valid.size(); ++k) {
+            if (opShard[k] != CROSS_SHARD) continue;
+            BatchOp& op = valid[k];
+            int fromShard, toShard;
+            shards().ofAccount(op.account, fromShard);
+            shards().ofAccount(op.toAccount, toShard);
+            try {
+                TransferRow t = shardTransfers().transfer(fromShard, op.account, toShard, op.toAccount, op.amount);
+                op.ok = op.hasBalance = applyTransferRow(op, t);
+            } catch (const exception& e) {
+                op.message = string("Ошибка БД: ") + e.what();
+            }
+        }
+        for (const BatchOp& op : valid) {
+            accountCache().invalidateAccount(op.account);
+            if (!op.toAccount.empty()) accountCache().invalidateAccount(op.toAccount);
+        }
+        for (size_t k = 0; k < valid.size(); ++k) {
+            ops[validIndex[k]] = valid[k];
+        }
+
+        JsonWriter w = jsonBody();
+        w.beginObject()
+            .field("success", committed)
+            .field("atomic", atomic)
+            .key("results").beginArray();
+        for (size_t i = 0; i < ops.size(); ++i) {
+            w.beginObject()
+                .field("index", i)
+                .field("success", ops[i].ok)
+                .field("message", ops[i].message);
+            if (ops[i].hasBalance) {
+                w.field("newBalance", ops[i].newBalance);
+            }
+            w.endObject();
+        }
+        w.endArray().endObject();
+
+    } catch (const exception& e) {
+        jsonInternalError("batch", e);
+    }
+}
+
+// ===================== ТАБЛИЦА ДЕЙСТВИЙ =====================
+
+void handleMetrics(Cgicc& cgi);
+
+// Приоритет при перегрузке (см. Admission): дешёвые чтения допускаются
+// дольше всех, тяжёлые и редкие действия отсекаются первыми
+enum Priority {
+    PRIO_LOW,
+    PRIO_NORMAL,
+    PRIO_HIGH,
+};
+
+struct ActionDef {
+    const char* name;
+    void (*handler)(Cgicc&);
+    bool writes;   // меняет данные: после успеха чтения клиента идут в основную БД
+    Priority priority;
+    int budgetMs;  // срок ответа по умолчанию, мс (deadline_<action>); 0 — без срока
+};
+
+// exportStatement без срока: выписка отдаётся потоком, и её длительность
+// определяется объёмом, а не состоянием БД
+const ActionDef ACTIONS[] = {
+    { "register",        handleRegister,        true,  PRIO_LOW,     3000 },
+    { "login",           handleLogin,           false, PRIO_HIGH,    2000 },
+    { "getAccounts",     handleGetAccounts,     false, PRIO_HIGH,    2000 },
+    { "createAccount",   handleCreateAccount,   true,  PRIO_NORMAL,  3000 },
+    { "deleteAccount",   handleDeleteAccount,   true,  PRIO_NORMAL,  3000 },
+    { "topup",           handleTopup,           true,  PRIO_NORMAL,  3000 },
+    { "withdraw",        handleWithdraw,        true,  PRIO_NORMAL,  3000 },
+    { "transfer",        handleTransfer,        true,  PRIO_NORMAL,  5000 },
+    { "getBalance",      handleGetBalance,      false, PRIO_HIGH,    2000 },
+    { "dashboard",       handleDashboard,       false, PRIO_HIGH,    2000 },
+    { "history",         handleHistory,         false, PRIO_HIGH,    3000 },
+    { "exportStatement", handleExportStatement, false, PRIO_LOW,     0 },
+    { "batch",           handleBatch,           true,  PRIO_LOW,     10000 },
+    { "metrics",         handleMetrics,         false, PRIO_HIGH,    0 },
+};
+
+const int ACTION_COUNT = sizeof(ACTIONS) / sizeof(ACTIONS[0]);
+
+// Срок ответа действия с учётом deadline_<action> из конфигурации
+int actionBudgetMs(int action) {
+    static const vector<int> budgets = [] {
+        vector<int> b;
+        for (int i = 0; i < ACTION_COUNT; ++i) {
+            b.push_back(max(0, config().getInt(string("deadline_") + ACTIONS[i].name, ACTIONS[i].budgetMs)));
+        }
+        return b;
+    }();
+    return budgets[action];
+}
+
+// ===================== КОНТРОЛЬ НАГРУЗКИ =====================
+
+// Ведро токенов: пополняется на rate токенов в секунду, копит не больше burst
+struct TokenBucket {
+    double tokens = 0;
+    Clock::time_point last;
+
+    // Взять токен; false — ведро пусто, waitSec — через сколько появится следующий
+    bool take(double rate, double burst, Clock::time_point now, double& waitSec) {
+        tokens = min(burst, tokens + rate * chrono::duration<double>(now - last).count());
+        last = now;
+        if (tokens >= 1) {
+            tokens -= 1;
+            return true;
+        }
+        waitSec = (1 - tokens) / rate;
+        return false;
+    }
+
+    // Простояло достаточно, чтобы снова наполниться — хранить незачем
+    bool full(double rate, double burst, Clock::time_point now) const {
+        return tokens + rate * chrono::duration<double>(now - last).count() >= burst;
+    }
+};
+
+enum AdmitResult {
+    ADMIT_OK,
+    ADMIT_USER_LIMIT,     // 429: пользователь превысил свой темп
+    ADMIT_ACTION_LIMIT,   // 429: превышен общий темп действия
+    ADMIT_OVERLOAD,       // 503: слишком много запросов в обработке
+    ADMIT_RESULT_COUNT
+};
+
+const char* const ADMIT_RESULT_NAMES[ADMIT_RESULT_COUNT] = {
+    "ok", "user_limit", "action_limit", "overload"
+};
+
+// Допуск запросов до обработчика. Когда БД тормозит, запросы копятся в очереди
+// пула и все разом упираются в таймауты; вместо этого лишние запросы сразу
+// получают отказ с Retry-After, а допущенные обслуживаются с прежней задержкой.
+//   - одновременно в обработке не больше admission_max_inflight запросов
+//     (0 — pool_max * число шардов * 2: пул плюс очередь такой же длины);
+//     действия PRIO_NORMAL допускаются до 3/4 предела, PRIO_LOW — до половины,
+//     так что при перегрузке первыми отсекаются register, batch, выписки;
+//   - темп пользователя: admission_user_rate запросов/с с запасом
+//     admission_user_burst; пользователь — адрес клиента (см. admissionKey);
+//   - темп действия в целом: admission_rate_<действие> запросов/с (0 — без предела).
+// Включается admission = 1 и работает в долгоживущих режимах (FastCGI, --serve);
+// счётчики у каждого процесса свои.
+class Admission {
+public:
+    atomic<uint64_t> rejected[ADMIT_RESULT_COUNT]{};
+
+    void start() {
+        const Config& cfg = config();
+        if (!cfg.getInt("admission", 0)) return;
+        maxInflight = cfg.getInt("admission_max_inflight", 0);
+        if (maxInflight <= 0) maxInflight = max(1, cfg.getInt("pool_max", 8)) * shards().count() * 2;
+        userRate = max(0, cfg.getInt("admission_user_rate", 10));
+        userBurst = max(1, cfg.getInt("admission_user_burst", 20));
+        maxUsers = static_cast<size_t>(max(1, cfg.getInt("admission_max_users", 100000)));
+        retryAfterOverload = max(1, cfg.getInt("admission_retry_after", 1));
+        for (int i = 0; i < ACTION_COUNT; ++i) {
+            actionRate[i] = max(0, cfg.getInt(string("admission_rate_") + ACTIONS[i].name, 0));
+            actionBuckets[i].tokens = actionRate[i];
+            actionBuckets[i].last = Clock::now();
+        }
+        on = true;
+    }
+
+    int inflight() const {
+        return current.load();
+    }
+
+    int inflightLimit() const {
+        return on ? maxInflight : 0;
+    }
+
+    // Решение по запросу действия action от пользователя userKey. При отказе
+    // retryAfter — через сколько секунд имеет смысл повторить. Допущенный
+    // запрос занимает место до вызова leave().
+    AdmitResult enter(int action, const string& userKey, int& retryAfter) {
+        if (!on) return ADMIT_OK;
+        Priority prio = ACTIONS[action].priority;
+        int cap = prio == PRIO_HIGH ? maxInflight : prio == PRIO_NORMAL ? maxInflight * 3 / 4 : maxInflight / 2;
+        // Место занимается сразу, при отказе возвращается: проверка и увеличение
+        // порознь пропускали сверх предела всех, кто проверил одновременно
+        if (current.fetch_add(1) >= max(1, cap)) {
+            --current;
+            return reject(ADMIT_OVERLOAD, retryAfterOverload, retryAfter);
+        }
+
+        auto now = Clock::now();
+        double wait = 0;
+        lock_guard<mutex> lock(m);
+        // Сначала темп пользователя: его отказ не должен тратить общий токен
+        // действия, а при отказе действия токен пользователя возвращается
+        TokenBucket* user = nullptr;
+        if (userRate > 0) {
+            user = &userBucket(userKey, now);
+            if (!user->take(userRate, userBurst, now, wait)) {
+                --current;
+                return reject(ADMIT_USER_LIMIT, wait, retryAfter);
+            }
+        }
+        if (actionRate[action] > 0 &&
+            !actionBuckets[action].take(actionRate[action], actionRate[action], now, wait)) {
+            if (user) user->tokens += 1;
+            --current;
+            return reject(ADMIT_ACTION_LIMIT, wait, retryAfter);
+        }
+        return ADMIT_OK;
+    }
+
+    void leave() {
+        if (on) --current;
+    }
+
+private:
+    AdmitResult reject(AdmitResult why, double waitSec, int& retryAfter) {
+        ++rejected[why];
+        retryAfter = max(1, static_cast<int>(ceil(waitSec)));
+        return why;
+    }
+
+    // Вызывается под мьютексом. Новый пользователь начинает с полным ведром;
+    // при переполнении таблицы выбрасываются наполнившиеся вёдра, а если
+    // не помогло — все (хуже от этого только тем, кто уже упёрся в предел).
+    TokenBucket& userBucket(const string& key, Clock::time_point now) {
+        auto it = users.find(key);
+        if (it != users.end()) return it->second;
+        if (users.size() >= maxUsers) {
+            for (auto u = users.begin(); u != users.end(); ) {
+                u = u->second.full(userRate, userBurst, now) ? users.erase(u) : next(u);
+            }
+            if (users.size() >= maxUsers) users.clear();
+        }
+        TokenBucket& b = users[key];
+        b.tokens = userBurst;
+        b.last = now;
+        return b;
+    }
+
+    bool on = false;
+    int maxInflight = 0;
+    int userRate = 0;
+    int userBurst = 1;
+    size_t maxUsers = 100000;
+    int retryAfterOverload = 1;
+    atomic<int> current{0};
+
+    mutex m;
+    int actionRate[ACTION_COUNT] = {};
+    TokenBucket actionBuckets[ACTION_COUNT];
+    unordered_map<string, TokenBucket> users;
+};
+
+Admission& admission() {
+    static Admission a;
+    return a;
+}
+
+// Кого считать пользователем для темпа. Аутентификации у запросов нет, а userId
+// и номер счёта присылает сам клиент: по ним можно и выбрать чужое ведро, и уйти
+// от своего, сменив параметр. Поэтому ключ — адрес клиента; когда появится
+// проверенная личность запроса, считать надо по ней.
+string admissionKey() {
+    return "ip:" + (currentRequest && currentRequest->input ? currentRequest->input->getenv("REMOTE_ADDR") : string());
+}
+
+// Отказ контроля нагрузки: 429 (темп) или 503 (перегрузка) с Retry-After
+void jsonThrottled(AdmitResult why, int retryAfter) {
+    if (why == ADMIT_OVERLOAD) {
+        jsonRetryLater(503, "overloaded", "Сервер перегружен, повторите запрос позже.", retryAfter);
+    } else {
+        jsonRetryLater(429, "rate_limited", "Слишком много запросов, повторите позже.", retryAfter);
+    }
+}
+
+// ===================== МЕТРИКИ =====================
+
+// Статистика по каждому действию. Последний элемент — запросы без
+// распознанного action (метка action="unknown").
+struct ActionStats {
+    LatencyHistogram latency;   // мкс на весь запрос, от разбора до готового ответа
+    atomic<uint64_t> requests{0};
+    atomic<uint64_t> dbRoundTrips{0};
+    atomic<uint64_t> errors[ERROR_KIND_COUNT]{};
+};
+
+class Metrics {
+public:
+    Metrics() : started(Clock::now()) {}
+
+    void record(const RequestContext& ctx, uint64_t micros) {
+        ActionStats& st = actions[ctx.action >= 0 ? ctx.action : ACTION_COUNT];
+        st.latency.record(micros);
+        st.requests.fetch_add(1, memory_order_relaxed);
+        st.dbRoundTrips.fetch_add(ctx.dbRoundTrips, memory_order_relaxed);
+        if (ctx.error != ERR_NONE) {
+            st.errors[ctx.error].fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    // Все метрики в текстовом формате Prometheus (0.0.4)
+    void expose(string& out);
+
+private:
+    Clock::time_point started;
+    ActionStats actions[ACTION_COUNT + 1];
+};
+
+Metrics& metrics() {
+    static Metrics m;
+    return m;
+}
+
+// Границы вёдер гистограмм при выдаче наружу, в секундах
+const double EXPOSED_BUCKETS[] = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+const double EXPOSED_QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+
+void metricHeader(string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+    out += "# TYPE "; out += name; out += ' '; out += type; out += '\n';
+}
+
+void metricLine(string& out, const char* name, const string& labels, double value) {
+    char buf[32];
+    out += name;
+    if (!labels.empty()) {
+        out += '{'; out += labels; out += '}';
+    }
+    out += ' ';
+    out.append(buf, to_chars(buf, buf + sizeof(buf), value).ptr);
+    out += '\n';
+}
+
+void metricHistogram(string& out, const char* name, const string& labels, const LatencyHistogram& h) {
+    string prefix = labels.empty() ? "" : labels + ",";
+    string bucket = string(name) + "_bucket";
+    char le[32];
+    for (double b : EXPOSED_BUCKETS) {
+        *to_chars(le, le + sizeof(le), b, chars_format::fixed).ptr = '\0';
+        metricLine(out, bucket.c_str(), prefix + "le=\"" + le + "\"",
+                   static_cast<double>(h.countAtMost(static_cast<uint64_t>(b * 1e6))));
+    }
+    metricLine(out, bucket.c_str(), prefix + "le=\"+Inf\"", static_cast<double>(h.count()));
+    metricLine(out, (string(name) + "_sum").c_str(), labels, h.sumMicros() / 1e6);
+    metricLine(out, (string(name) + "_count").c_str(), labels, static_cast<double>(h.count()));
+}
+
+void Metrics::expose(string& out) {
+    auto actionLabel = [](int i) {
+        return string("action=\"") + (i < ACTION_COUNT ? ACTIONS[i].name : "unknown") + "\"";
+    };
+
+    metricHeader(out, "bank_requests_total", "counter", "Обработанные запросы по действиям.");
+    for (int i = 0; i <= ACTION_COUNT; ++i) {
+        metricLine(out, "bank_requests_total", actionLabel(i), static_cast<double>(actions[i].requests.load()));
+    }
+
+    metricHeader(out, "bank_request_errors_total", "counter", "Неуспешные ответы по действиям и видам ошибок.");
+    for (int i = 0; i <= ACTION_COUNT; ++i) {
+        for (int k = ERR_NONE + 1; k < ERROR_KIND_COUNT; ++k) {
+            metricLine(out, "bank_request_errors_total",
+                       actionLabel(i) + ",kind=\"" + ERROR_KIND_NAMES[k] + "\"",
+                       static_cast<double>(actions[i].errors[k].load()));
+        }
+    }
+
+    metricHeader(out, "bank_db_round_trips_total", "counter", "Обмены с БД (запрос-ответ) по действиям.");
+    for (int i = 0; i <= ACTION_COUNT; ++i) {
+        metricLine(out, "bank_db_round_trips_total", actionLabel(i),
+                   static_cast<double>(actions[i].dbRoundTrips.load()));
+    }
+
+    metricHeader(out, "bank_request_duration_seconds", "histogram", "Время обработки запроса.");
+    for (int i = 0; i <= ACTION_COUNT; ++i) {
+        metricHistogram(out, "bank_request_duration_seconds", actionLabel(i), actions[i].latency);
+    }
+
+    metricHeader(out, "bank_request_duration_quantile_seconds", "gauge",
+                 "Квантили времени обработки с начала работы процесса (точность 1/16).");
+    for (int i = 0; i <= ACTION_COUNT; ++i) {
+        if (actions[i].latency.count() == 0) continue;
+        for (double q : EXPOSED_QUANTILES) {
+            char qs[16];
+            *to_chars(qs, qs + sizeof(qs), q, chars_format::fixed).ptr = '\0';
+            metricLine(out, "bank_request_duration_quantile_seconds",
+                       actionLabel(i) + ",quantile=\"" + qs + "\"",
+                       actions[i].latency.quantile(q) / 1e6);
+        }
+    }
+
+    // Пулы основных БД — по одному на шард
+    ShardMap& sm = shards();
+    auto shardLabel = [](int s) { return "shard=\"" + to_string(s) + "\""; };
+    vector<int> waiting(sm.count());
+    metricHeader(out, "bank_pool_connections", "gauge", "Соединения пула с БД.");
+    for (int s = 0; s < sm.count(); ++s) {
+        int total, idle;
+        sm.pool(s).snapshot(total, idle, waiting[s]);
+        metricLine(out, "bank_pool_connections", shardLabel(s) + ",state=\"idle\"", idle);
+        metricLine(out, "bank_pool_connections", shardLabel(s) + ",state=\"busy\"", total - idle);
+    }
+    metricHeader(out, "bank_pool_waiters", "gauge", "Запросы, ждущие свободного соединения.");
+    for (int s = 0; s < sm.count(); ++s) {
+        metricLine(out, "bank_pool_waiters", shardLabel(s), waiting[s]);
+    }
+    struct PoolCounter {
+        const char* name;
+        const char* help;
+        atomic<uint64_t> PgPool::*value;
+    };
+    const PoolCounter poolCounters[] = {
+        { "bank_pool_acquisitions_total", "Выдачи соединений из пула.", &PgPool::acquisitions },
+        { "bank_pool_acquire_waits_total", "Выдачи, которым пришлось ждать.", &PgPool::acquireWaits },
+        { "bank_pool_acquire_timeouts_total", "Отказы по истечении pool_acquire_timeout.", &PgPool::acquireTimeouts },
+        { "bank_pool_connects_total", "Новые подключения к БД.", &PgPool::connects },
+        { "bank_pool_connect_failures_total", "Неудачные подключения к БД.", &PgPool::connectFailures },
+    };
+    for (const PoolCounter& c : poolCounters) {
+        metricHeader(out, c.name, "counter", c.help);
+        for (int s = 0; s < sm.count(); ++s) {
+            metricLine(out, c.name, shardLabel(s), static_cast<double>((sm.pool(s).*c.value).load()));
+        }
+    }
+    metricHeader(out, "bank_pool_acquire_duration_seconds", "histogram", "Время получения соединения из пула.");
+    for (int s = 0; s < sm.count(); ++s) {
+        metricHistogram(out, "bank_pool_acquire_duration_seconds", shardLabel(s), sm.pool(s).acquireLatency);
+    }
+
+    if (sm.count() > 1) {
+        ShardTransfers& xt = shardTransfers();
+        metricHeader(out, "bank_cross_shard_transfers_total", "counter", "Переводы между шардами по исходу.");
+        metricLine(out, "bank_cross_shard_transfers_total", "result=\"committed\"",
+                   static_cast<double>(xt.committed.load()));
+        metricLine(out, "bank_cross_shard_transfers_total", "result=\"aborted\"",
+                   static_cast<double>(xt.aborted.load()));
+        metricHeader(out, "bank_xfer_recovered_total", "counter",
+                     "Транзакции переводов «в сомнении», завершённые восстановлением.");
+        metricLine(out, "bank_xfer_recovered_total", "action=\"commit\"",
+                   static_cast<double>(xt.recoveredCommits.load()));
+        metricLine(out, "bank_xfer_recovered_total", "action=\"rollback\"",
+                   static_cast<double>(xt.recoveredRollbacks.load()));
+        metricHeader(out, "bank_xfer_recovery_failures_total", "counter", "Неудачные попытки восстановления.");
+        metricLine(out, "bank_xfer_recovery_failures_total", "", static_cast<double>(xt.recoveryFailures.load()));
+    }
+
+    ReplicaSet& rs = replicas();
+    if (rs.configured()) {
+        metricHeader(out, "bank_replica_lag_seconds", "gauge", "Отставание реплики (-1 — недоступна).");
+        for (size_t i = 0; i < rs.all().size(); ++i) {
+            int64_t lag = rs.all()[i]->lagMs.load();
+            metricLine(out, "bank_replica_lag_seconds", "replica=\"" + to_string(i) + "\"",
+                       lag < 0 ? -1.0 : lag / 1000.0);
+        }
+        metricHeader(out, "bank_read_route_total", "counter", "Куда ушли чтения, допускающие реплику.");
+        metricLine(out, "bank_read_route_total", "target=\"replica\"", static_cast<double>(rs.replicaReads.load()));
+        metricLine(out, "bank_read_route_total", "target=\"primary_lag\"",
+                   static_cast<double>(rs.primaryReadsLag.load()));
+        metricLine(out, "bank_read_route_total", "target=\"primary_sticky\"",
+                   static_cast<double>(rs.primaryReadsSticky.load()));
+    }
+
+    AccountCache& cache = accountCache();
+    metricHeader(out, "bank_cache_hits_total", "counter", "Попадания в кэш балансов и списков счетов.");
+    metricLine(out, "bank_cache_hits_total", "", static_cast<double>(cache.hits.load()));
+    metricHeader(out, "bank_cache_misses_total", "counter", "Промахи кэша.");
+    metricLine(out, "bank_cache_misses_total", "", static_cast<double>(cache.misses.load()));
+    metricHeader(out, "bank_cache_invalidations_total", "counter", "Сброшенные записи кэша.");
+    metricLine(out, "bank_cache_invalidations_total", "", static_cast<double>(cache.invalidations.load()));
+
+    Admission& adm = admission();
+    metricHeader(out, "bank_admission_inflight", "gauge", "Запросы в обработке (контроль нагрузки).");
+    metricLine(out, "bank_admission_inflight", "", adm.inflight());
+    metricHeader(out, "bank_admission_inflight_limit", "gauge", "Предел запросов в обработке (0 — выключен).");
+    metricLine(out, "bank_admission_inflight_limit", "", adm.inflightLimit());
+    metricHeader(out, "bank_admission_rejected_total", "counter", "Отказы контроля нагрузки по причинам.");
+    for (int k = ADMIT_OK + 1; k < ADMIT_RESULT_COUNT; ++k) {
+        metricLine(out, "bank_admission_rejected_total", string("reason=\"") + ADMIT_RESULT_NAMES[k] + "\"",
+                   static_cast<double>(adm.rejected[k].load()));
+    }
+
+    metricHeader(out, "bank_timeouts_total", "counter", "Запросы, у которых истёк срок, по виду таймаута.");
+    for (int k = TIMEOUT_NONE + 1; k < TIMEOUT_KIND_COUNT; ++k) {
+        metricLine(out, "bank_timeouts_total", string("kind=\"") + TIMEOUT_KIND_NAMES[k] + "\"",
+                   static_cast<double>(timeoutsTotal[k].load()));
+    }
+    QueryCanceller& canceller = queryCanceller();
+    metricHeader(out, "bank_query_cancels_total", "counter", "Отправленные отмены запросов к БД (PQcancel).");
+    metricLine(out, "bank_query_cancels_total", "", static_cast<double>(canceller.sent.load()));
+    metricHeader(out, "bank_query_cancel_failures_total", "counter", "Отмены, которые не удалось отправить.");
+    metricLine(out, "bank_query_cancel_failures_total", "", static_cast<double>(canceller.failures.load()));
+
+    PasswordHasher& hasher = passwordHasher();
+    metricHeader(out, "bank_password_jobs_total", "counter", "Проверки и хэширования паролей (scrypt).");
+    metricLine(out, "bank_password_jobs_total", "", static_cast<double>(hasher.jobs.load()));
+    metricHeader(out, "bank_password_rejected_total", "counter", "Отказы: очередь хэширования паролей полна.");
+    metricLine(out, "bank_password_rejected_total", "", static_cast<double>(hasher.rejected.load()));
+    metricHeader(out, "bank_password_queue", "gauge", "Задания в очереди хэширования паролей.");
+    metricLine(out, "bank_password_queue", "", hasher.queued());
+
+    TopupCoalescer& coalescer = topupCoalescer();
+    SlotFolder& folder = slotFolder();
+    metricHeader(out, "bank_slot_fold_runs_total", "counter", "Проходы свёртки слотов баланса.");
+    metricLine(out, "bank_slot_fold_runs_total", "", static_cast<double>(folder.runs.load()));
+    metricHeader(out, "bank_slot_fold_accounts_total", "counter", "Счета, слоты которых были сведены.");
+    metricLine(out, "bank_slot_fold_accounts_total", "", static_cast<double>(folder.foldedAccounts.load()));
+    metricHeader(out, "bank_slot_fold_failures_total", "counter", "Неудачные проходы свёртки слотов.");
+    metricLine(out, "bank_slot_fold_failures_total", "", static_cast<double>(folder.failures.load()));
+
+    metricHeader(out, "bank_topup_batches_total", "counter", "UPDATE при склейке пополнений (topup_coalesce).");
+    metricLine(out, "bank_topup_batches_total", "", static_cast<double>(coalescer.batches.load()));
+    metricHeader(out, "bank_topup_coalesced_total", "counter", "Пополнения, выполненные в составе этих UPDATE.");
+    metricLine(out, "bank_topup_coalesced_total", "", static_cast<double>(coalescer.topups.load()));
+
+    metricHeader(out, "bank_uptime_seconds", "gauge", "Время работы процесса.");
+    metricLine(out, "bank_uptime_seconds", "", microsSince(started) / 1e6);
+}
+
+// Адреса, которым открыты метрики: metrics_allow — через пробел или запятую
+// (по умолчанию только локальные). В метриках задержки и состояние пулов —
+// посторонним их видеть незачем.
+bool metricsAllowed(const string& remoteAddr) {
+    static const vector<string> allowed = [] {
+        vector<string> list;
+        string v = config().get("metrics_allow", "127.0.0.1 ::1");
+        for (char& c : v) {
+            if (c == ',') c = ' ';
+        }
+        istringstream in(v);
+        for (string a; in >> a; ) list.push_back(a);
+        return list;
+    }();
+    return find(allowed.begin(), allowed.end(), remoteAddr) != allowed.end();
+}
+
+// METRICS
+// Метрики процесса в формате Prometheus. Имеют смысл в долгоживущих режимах
+// (FastCGI, --serve): в CGI каждый запрос — новый процесс с пустыми счётчиками.
+void handleMetrics(Cgicc&) {
+    if (!metricsAllowed(currentRequest && currentRequest->input ? currentRequest->input->getenv("REMOTE_ADDR") : string())) {
+        jsonError("Метрики доступны только с разрешённых адресов (metrics_allow).");
+        response().status = 403;
+        return;
+    }
+    Response& r = response();
+    r.contentType = "text/plain; version=0.0.4";
+    r.body.clear();
+    metrics().expose(r.body);
+}
+
+// ===================== ДИСПЕТЧЕР =====================
+
+// После успешной записи — запомнить у клиента её время (см. ReplicaSet)
+void noteClientWrite(Response& resp) {
+    ReplicaSet& rs = replicas();
+    if (!rs.configured()) return;
+    int64_t now = chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    resp.extraHeaders += "Set-Cookie: bank_lw=" + to_string(now) + "; Path=/; Max-Age=" +
+                         to_string((rs.stickyMillis() + 999) / 1000) + "; HttpOnly; SameSite=Lax\r\n";
+}
+
+void dispatchRequest(Cgicc& cgi) {
+    bool pAct;
+    string action = getParam(cgi, "action", pAct);
+    if (!pAct || action.empty()) {
+        jsonError("Не указан параметр action.");
+        return;
+    }
+
+    for (int i = 0; i < ACTION_COUNT; ++i) {
+        if (action == ACTIONS[i].name) {
+            currentRequest->action = i;
+            int retryAfter = 0;
+            AdmitResult admit = admission().enter(i, admissionKey(), retryAfter);
+            if (admit != ADMIT_OK) {
+                jsonThrottled(admit, retryAfter);
+                return;
+            }
+            // Место в обработке освобождается и при исключении из обработчика
+            struct AdmissionSlot {
+                ~AdmissionSlot() { admission().leave(); }
+            } slot;
+            int budget = actionBudgetMs(i);
+            if (budget > 0) currentRequest->deadline = Clock::now() + chrono::milliseconds(budget);
+            ACTIONS[i].handler(cgi);
+            if (ACTIONS[i].writes && currentRequest->error == ERR_NONE) {
+                noteClientWrite(response());
+            }
+            return;
+        }
+    }
+    jsonError("Неизвестное действие: " + action);
+}
+
+// Обработка одного запроса с перехватом всех исключений
+void serveRequest(Cgicc& cgi) {
+    try {
+        dispatchRequest(cgi);
+    } catch (const exception& e) {
+        if (currentRequest->timeout != TIMEOUT_NONE) {
+            jsonTimeout();
+            return;
+        }
+        jsonError(string("Внутренняя ошибка: ") + e.what());
+        markError(ERR_INTERNAL);
     } catch (...) {
         jsonError("Неизвестная внутренняя ошибка.");
+        markError(ERR_INTERNAL);
+    }
+}
+
+// Разобрать запрос из input и выполнить его, заполнив resp
+void handleRequest(CgiInput* input, Response& resp) {
+    auto start = Clock::now();
+    resp.reset();
+    RequestContext ctx;
+    ctx.response = &resp;
+    ctx.input = input;
+    RequestContext* prev = currentRequest;
+    currentRequest = &ctx;
+    try {
+        Cgicc cgi(input);
+        serveRequest(cgi);
+    } catch (const exception& e) {
+        jsonError(string("Некорректный запрос: ") + e.what());
+        markError(ERR_BAD_REQUEST);
+    }
+    currentRequest = prev;
+    metrics().record(ctx, microsSince(start));
+}
+
+// Заголовки ответа в формате CGI (Status вместо строки состояния HTTP)
+string cgiHeaders(const Response& resp) {
+    string h;
+    h.reserve(128 + resp.extraHeaders.size());
+    if (resp.status != 200) {
+        h += "Status: " + to_string(resp.status) + " " + statusText(resp.status) + "\r\n";
+    }
+    h += "Content-Type: " + resp.contentType + "; charset=utf-8\r\n";
+    // Длина потокового ответа заранее не известна — конец тела веб-сервер
+    // узнает по завершению вывода
+    if (!resp.streamed) h += "Content-Length: " + to_string(resp.body.size()) + "\r\n";
+    h += resp.extraHeaders;
+    h += "\r\n";
+    return h;
+}
+
+// Записать все части одним системным вызовом (с дозаписью при частичной записи).
+// Для неблокирующего сокета ждёт готовности через waitFd. false — ошибка записи
+// (клиент отключился или не читает дольше 30 секунд).
+bool writeAllv(int fd, iovec* iov, int count) {
+    int idx = 0;
+    while (idx < count) {
+        ssize_t n = writev(fd, iov + idx, count - idx);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && waitFd(fd, POLLOUT, 30000)) continue;
+            return false;
+        }
+        while (idx < count && static_cast<size_t>(n) >= iov[idx].iov_len) {
+            n -= iov[idx].iov_len;
+            ++idx;
+        }
+        if (idx < count) {
+            iov[idx].iov_base = static_cast<char*>(iov[idx].iov_base) + n;
+            iov[idx].iov_len -= n;
+        }
+    }
+    return true;
+}
+
+bool writeAll(int fd, const string& head, const string& body) {
+    iovec iov[2] = {
+        { const_cast<char*>(head.data()), head.size() },
+        { const_cast<char*>(body.data()), body.size() },
+    };
+    return writeAllv(fd, iov, 2);
+}
+
+// Потоковый ответ CGI: заголовки и части тела пишутся прямо в дескриптор
+class FdResponseSink : public ResponseSink {
+public:
+    explicit FdResponseSink(int fd) : fd(fd) {}
+
+    bool begin(const Response& resp) override {
+        return writeAll(fd, cgiHeaders(resp), string());
+    }
+
+    bool write(const char* data, size_t len) override {
+        iovec iov = { const_cast<char*>(data), len };
+        return writeAllv(fd, &iov, 1);
+    }
+
+    bool end() override {
+        return true;
+    }
+
+    void abort() override {
+        write(STREAM_ABORTED_MARKER, sizeof(STREAM_ABORTED_MARKER) - 1);
+    }
+
+private:
+    int fd;
+};
+
+// ===================== FastCGI =====================
+
+// Источник данных для Cgicc поверх FastCGI-запроса: переменные окружения
+// и тело POST берутся не из процесса, а из текущего FCGX_Request.
+class FcgiInput : public CgiInput {
+public:
+    explicit FcgiInput(FCGX_Request& req) : req(req) {}
+
+    size_t read(char* data, size_t length) override {
+        return FCGX_GetStr(data, static_cast<int>(length), req.in);
+    }
+
+    string getenv(const char* varName) override {
+        const char* v = FCGX_GetParam(varName, req.envp);
+        return v ? v : "";
+    }
+
+private:
+    FCGX_Request& req;
+};
+
+class FcgiResponseSink : public ResponseSink {
+public:
+    explicit FcgiResponseSink(FCGX_Request& req) : req(req) {}
+
+    bool begin(const Response& resp) override {
+        string head = cgiHeaders(resp);
+        return FCGX_PutStr(head.data(), static_cast<int>(head.size()), req.out) >= 0;
+    }
+
+    bool write(const char* data, size_t len) override {
+        return FCGX_PutStr(data, static_cast<int>(len), req.out) >= 0 && FCGX_FFlush(req.out) == 0;
+    }
+
+    bool end() override {
+        return true;
+    }
+
+    // Кроме метки — ненулевой код завершения запроса, его видит веб-сервер
+    void abort() override {
+        write(STREAM_ABORTED_MARKER, sizeof(STREAM_ABORTED_MARKER) - 1);
+        FCGX_SetExitStatus(1, req.out);
+    }
+
+private:
+    FCGX_Request& req;
+};
+
+// Классический CGI: один запрос на процесс
+int runCgi() {
+    Response resp;
+    FdResponseSink sink(STDOUT_FILENO);
+    resp.sink = &sink;
+    CgiInput input;
+    handleRequest(&input, resp);
+    if (!resp.streamed) {
+        writeAll(STDOUT_FILENO, cgiHeaders(resp), resp.body);
+    } else if (!resp.streamEnded) {
+        sink.abort();
+        return 1;
+    }
+    return 0;
+}
+
+// FastCGI: процесс живёт долго и принимает запросы в цикле
+int runFastCgi() {
+    FCGX_Init();
+    shards().warmUp();
+    replicas().start();
+    accountCache().start();
+    slotFolder().start();
+    shardTransfers().start();
+    admission().start();
+    queryCanceller().start();
+    passwordHasher().start();
+
+    FCGX_Request request;
+    FCGX_InitRequest(&request, 0, 0);
+
+    Response resp;
+    FcgiResponseSink sink(request);
+    resp.sink = &sink;
+    while (FCGX_Accept_r(&request) == 0) {
+        FcgiInput input(request);
+        handleRequest(&input, resp);
+
+        if (!resp.streamed) {
+            string head = cgiHeaders(resp);
+            FCGX_PutStr(head.data(), static_cast<int>(head.size()), request.out);
+            FCGX_PutStr(resp.body.data(), static_cast<int>(resp.body.size()), request.out);
+        } else if (!resp.streamEnded) {
+            sink.abort();
+        }
+        FCGX_Finish_r(&request);
+    }
+
+    return 0;
+}
+
+// ===================== HTTP-СЕРВЕР (epoll) =====================
+//
+// bank.cgi --serve [порт] — самостоятельный HTTP/1.1-сервер без веб-сервера перед ним.
+// http_threads потоков, у каждого свой цикл событий и свой слушающий сокет
+// (SO_REUSEPORT — ядро само распределяет подключения). Каждое подключение
+// обслуживается fiber'ом; пока fiber ждёт клиента или БД, поток занят другими.
+// Запрос разбирается тем же Cgicc, что и в CGI: action и параметры берутся
+// из строки запроса и тела POST (application/x-www-form-urlencoded).
+
+const size_t HTTP_MAX_HEADER = 64 * 1024;
+const size_t HTTP_MAX_BODY = 1024 * 1024;
+
+atomic<int> httpConnections{0};
+
+struct HttpRequest {
+    string method;
+    string target;
+    string version;
+    map<string, string> headers;   // имена в нижнем регистре
+    string body;
+    bool keepAlive = true;
+};
+
+// Источник данных для Cgicc поверх разобранного HTTP-запроса
+class HttpCgiInput : public CgiInput {
+public:
+    HttpCgiInput(const HttpRequest& req, const string& remoteAddr) : req(req), remoteAddr(remoteAddr) {}
+
+    size_t read(char* data, size_t length) override {
+        size_t n = min(length, req.body.size() - pos);
+        memcpy(data, req.body.data() + pos, n);
+        pos += n;
+        return n;
+    }
+
+    string getenv(const char* varName) override {
+        string name = varName;
+        if (name == "REQUEST_METHOD") return req.method;
+        if (name == "QUERY_STRING") {
+            size_t q = req.target.find('?');
+            // GET /metrics — привычный для Prometheus адрес
+            if (q == string::npos) return req.target == "/metrics" ? "action=metrics" : "";
+            return req.target.substr(q + 1);
+        }
+        if (name == "SCRIPT_NAME") return req.target.substr(0, req.target.find('?'));
+        if (name == "SERVER_PROTOCOL") return req.version;
+        if (name == "REMOTE_ADDR") return remoteAddr;
+        if (name == "CONTENT_LENGTH") return to_string(req.body.size());
+        if (name == "CONTENT_TYPE") return header("content-type");
+        if (name == "HTTP_COOKIE") return header("cookie");
+        if (name == "HTTP_USER_AGENT") return header("user-agent");
+        if (name == "HTTP_HOST") return header("host");
+        return "";
+    }
+
+private:
+    string header(const string& name) const {
+        auto it = req.headers.find(name);
+        return it == req.headers.end() ? "" : it->second;
+    }
+
+    const HttpRequest& req;
+    const string& remoteAddr;
+    size_t pos = 0;
+};
+
+// Дочитать в buf не меньше need байт. false — клиент закрыл соединение или молчит дольше timeoutMs.
+bool httpReadMore(int fd, string& buf, int timeoutMs) {
+    char chunk[16384];
+    while (true) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n > 0) {
+            buf.append(chunk, static_cast<size_t>(n));
+            return true;
+        }
+        if (n == 0) return false;
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+        if (!waitFd(fd, POLLIN, timeoutMs)) return false;
+    }
+}
+
+// Прочитать очередной запрос. buf хранит байты, пришедшие сверх предыдущего
+// запроса (конвейер HTTP/1.1). Возвращает 0 — запрос прочитан, -1 — закрыть
+// соединение молча, иначе HTTP-код ошибки, который нужно отправить перед закрытием.
+int readHttpRequest(int fd, string& buf, HttpRequest& req, int idleTimeoutMs) {
+    size_t headEnd;
+    while ((headEnd = buf.find("\r\n\r\n")) == string::npos) {
+        if (buf.size() > HTTP_MAX_HEADER) return 431;
+        if (!httpReadMore(fd, buf, idleTimeoutMs)) return -1;
+    }
+
+    req = HttpRequest();
+    istringstream head(buf.substr(0, headEnd));
+    string line;
+    getline(head, line);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    istringstream first(line);
+    if (!(first >> req.method >> req.target >> req.version) ||
+        req.version.compare(0, 5, "HTTP/") != 0) {
+        return 400;
+    }
+
+    while (getline(head, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t colon = line.find(':');
+        if (colon == string::npos) return 400;
+        string name = line.substr(0, colon);
+        transform(name.begin(), name.end(), name.begin(),
+                  [](unsigned char c) { return static_cast<char>(tolower(c)); });
+        size_t v = line.find_first_not_of(" \t", colon + 1);
+        req.headers[name] = v == string::npos ? "" : line.substr(v);
+    }
+
+    string connection = req.headers.count("connection") ? req.headers["connection"] : "";
+    transform(connection.begin(), connection.end(), connection.begin(),
+              [](unsigned char c) { return static_cast<char>(tolower(c)); });
+    req.keepAlive = req.version == "HTTP/1.1" ? connection != "close" : connection == "keep-alive";
+
+    if (req.headers.count("transfer-encoding")) return 411;
+
+    size_t length = 0;
+    auto cl = req.headers.find("content-length");
+    if (cl != req.headers.end()) {
+        const string& v = cl->second;
+        auto r = from_chars(v.data(), v.data() + v.size(), length);
+        if (r.ec != errc() || r.ptr != v.data() + v.size()) return 400;
+        if (length > HTTP_MAX_BODY) return 413;
+    }
+
+    size_t bodyStart = headEnd + 4;
+    while (buf.size() - bodyStart < length) {
+        if (!httpReadMore(fd, buf, idleTimeoutMs)) return -1;
+    }
+    req.body.assign(buf, bodyStart, length);
+    buf.erase(0, bodyStart + length);
+    return 0;
+}
+
+string httpHeaders(const Response& resp, bool keepAlive) {
+    string h;
+    h.reserve(160 + resp.extraHeaders.size());
+    h += "HTTP/1.1 " + to_string(resp.status) + " " + statusText(resp.status) + "\r\n";
+    h += "Content-Type: " + resp.contentType + "; charset=utf-8\r\n";
+    // Потоковый ответ: при keep-alive — chunked, иначе тело до закрытия соединения
+    if (!resp.streamed)  h += "Content-Length: " + to_string(resp.body.size()) + "\r\n";
+    else if (keepAlive)  h += "Transfer-Encoding: chunked\r\n";
+    h += keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    h += resp.extraHeaders;
+    h += "\r\n";
+    return h;
+}
+
+// Потоковый ответ по HTTP/1.1: части тела уходят кусками chunked-кодирования.
+// Клиенту HTTP/1.0 (keep-alive выключен) тело пишется как есть до закрытия соединения.
+class HttpResponseSink : public ResponseSink {
+public:
+    explicit HttpResponseSink(int fd) : fd(fd) {}
+
+    bool keepAlive = true;
+
+    bool begin(const Response& resp) override {
+        return writeAll(fd, httpHeaders(resp, keepAlive), string());
+    }
+
+    bool write(const char* data, size_t len) override {
+        if (!keepAlive) {
+            iovec iov = { const_cast<char*>(data), len };
+            return writeAllv(fd, &iov, 1);
+        }
+        char size[24];
+        int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+        iovec iov[3] = {
+            { size, static_cast<size_t>(n) },
+            { const_cast<char*>(data), len },
+            { const_cast<char*>("\r\n"), 2 },
+        };
+        return writeAllv(fd, iov, 3);
     }
 
+    bool end() override {
+        return !keepAlive || writeAll(fd, "0\r\n\r\n", string());
+    }
+
+private:
+    int fd;
+};
+
+// Обслужить одно подключение: запросы читаются и выполняются по очереди, пока
+// клиент держит keep-alive. Выполняется в fiber'е.
+void serveHttpConnection(int fd, const string& remoteAddr) {
+    int idleTimeoutMs = config().getInt("http_keepalive_timeout", 15) * 1000;
+    string buf;
+    HttpRequest req;
+    Response resp;
+    HttpResponseSink sink(fd);
+    resp.sink = &sink;
+
+    while (true) {
+        int rc = readHttpRequest(fd, buf, req, idleTimeoutMs);
+        if (rc < 0) break;
+        if (rc > 0) {
+            resp.reset();
+            resp.status = rc;
+            resp.body = "{\"success\":false,\"message\":\"Некорректный HTTP-запрос.\"}";
+            writeAll(fd, httpHeaders(resp, false), resp.body);
+            break;
+        }
+
+        HttpCgiInput input(req, remoteAddr);
+        sink.keepAlive = req.keepAlive && req.version != "HTTP/1.0";   // chunked — только с HTTP/1.1
+        handleRequest(&input, resp);
+        if (resp.streamed) {
+            // Оборванный поток можно показать клиенту только разрывом соединения
+            if (!resp.streamEnded || !sink.keepAlive) break;
+        } else {
+            writeAll(fd, httpHeaders(resp, req.keepAlive), resp.body);
+        }
+        if (!req.keepAlive) break;
+    }
+    close(fd);
+}
+
+int httpListen(int port) {
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw runtime_error(string("socket: ") + strerror(errno));
+    int on = 1, off = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+    sockaddr_in6 addr{};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(static_cast<uint16_t>(port));
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        string msg = strerror(errno);
+        close(fd);
+        throw runtime_error("Не удалось слушать порт " + to_string(port) + ": " + msg);
+    }
+    return fd;
+}
+
+// Принимать подключения и раздавать их новым fiber'ам того же цикла событий
+void acceptLoop(EventLoop& loop, int listenFd) {
+    int maxConnections = config().getInt("http_max_connections", 10000);
+    while (true) {
+        sockaddr_in6 peer{};
+        socklen_t len = sizeof(peer);
+        int fd = accept4(listenFd, reinterpret_cast<sockaddr*>(&peer), &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                waitFd(listenFd, POLLIN, -1);
+            } else if (errno == EMFILE || errno == ENFILE) {
+                sleepMs(10);
+            }
+            continue;
+        }
+        if (httpConnections.fetch_add(1) >= maxConnections) {
+            httpConnections.fetch_sub(1);
+            close(fd);
+            continue;
+        }
+
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        char host[INET6_ADDRSTRLEN] = "";
+        inet_ntop(AF_INET6, &peer.sin6_addr, host, sizeof(host));
+        string remote = host;
+        if (remote.compare(0, 7, "::ffff:") == 0) remote.erase(0, 7);
+
+        loop.spawn([fd, remote] {
+            try {
+                serveHttpConnection(fd, remote);
+            } catch (...) {
+                close(fd);
+            }
+            httpConnections.fetch_sub(1);
+        });
+    }
+}
+
+int runHttpServer(int port) {
+    signal(SIGPIPE, SIG_IGN);
+    shards().warmUp();
+    replicas().start();
+    accountCache().start();
+    slotFolder().start();
+    shardTransfers().start();
+    admission().start();
+    queryCanceller().start();
+    passwordHasher().start();
+
+    int threads = config().getInt("http_threads", 0);
+    if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+
+    vector<int> listeners;
+    for (int i = 0; i < threads; ++i) listeners.push_back(httpListen(port));
+    cerr << "bank: HTTP-сервер на порту " << port << ", потоков: " << threads << endl;
+
+    vector<thread> workers;
+    for (int i = 1; i < threads; ++i) {
+        int fd = listeners[i];
+        workers.emplace_back([fd] {
+            EventLoop loop;
+            loop.spawn([&loop, fd] { acceptLoop(loop, fd); });
+            loop.run();
+        });
+    }
+
+    EventLoop loop;
+    int fd = listeners[0];
+    loop.spawn([&loop, fd] { acceptLoop(loop, fd); });
+    loop.run();
     return 0;
 }
+
+// ===================== MAIN =====================
+
+// BANK_NO_MAIN — для сборок, подключающих bank.cpp целиком (bench_micro.cpp)
+#ifndef BANK_NO_MAIN
+
+int main(int argc, char** argv) {
+    if (argc > 1 && string(argv[1]) == "--serve") {
+        int port = argc > 2 ? atoi(argv[2]) : config().getInt("http_port", 8080);
+        try {
+            return runHttpServer(port);
+        } catch (const exception& e) {
+            cerr << "bank: " << e.what() << endl;
+            return 1;
+        }
+    }
+
+    if (FCGX_IsCGI()) {
+        return runCgi();
+    }
+    return runFastCgi();
+}
+
+#endif  // BANK_NO_MAIN
@@ -0,0 +1,534 @@
+// Сборка:
+//   g++ -O2 -std=c++17 bank_tool.cpp -o bank_tool -pthread -lcgicc -lpq -lfcgi -lcrypto
+//
+// Массовая загрузка и выгрузка для миграций и ночной сверки. Собирается из тех
+// же исходников, что bank.cgi: тот же bank.conf (conninfo, account_slots), те же
+// правила проверки данных, генерация номеров счетов и лимит счетов на пользователя.
+//
+//   ./bank_tool import-users ФАЙЛ.csv        full_name,email,password
+//   ./bank_tool import-accounts ФАЙЛ.csv     email,balance[,number]
+//   ./bank_tool export-balances [ФАЙЛ.csv]   number,email,balance (по умолчанию stdout)
+//
+// Первая строка CSV — заголовок, она пропускается. Строки загружаются через
+// COPY ... FROM STDIN (FORMAT binary) во временную таблицу, проверяются и
+// переносятся в users/accounts одним INSERT ... SELECT в одной транзакции.
+// Номер счёта, не указанный в файле, генерируется; при совпадении с уже
+// существующим номером — генерируется заново. Ненулевой начальный баланс
+// записывается в журнал операций как 'import'. Пароли сохраняются хэшем scrypt,
+// как при регистрации; хэши считаются на всех ядрах. По каждому этапу печатается
+// число строк и скорость.
+//
+// С несколькими шардами (shard_conninfo) export-balances выгружает все шарды
+// подряд (срез согласован в пределах шарда); загрузка поддерживается только
+// для одного узла — строки пришлось бы раскладывать по шардам.
+
+#define BANK_NO_MAIN
+#include "bank.cpp"
+
+// ===================== CSV =====================
+
+// Чтение CSV по RFC 4180: поля в кавычках могут содержать запятые, кавычки ("")
+// и переводы строк. line — номер строки файла, с которой началась запись.
+class CsvReader {
+public:
+    explicit CsvReader(istream& in) : in(in) {}
+
+    bool next(vector<string>& fields, uint64_t& line) {
+        fields.clear();
+        if (in.peek() == EOF) return false;
+        line = lineNo + 1;
+
+        string field;
+        bool quoted = false;
+        char c;
+        while (in.get(c)) {
+            if (quoted) {
+                if (c == '"') {
+                    if (in.peek() == '"') {
+                        in.get(c);
+                        field.push_back('"');
+                    } else {
+                        quoted = false;
+                    }
+                } else {
+                    if (c == '\n') ++lineNo;
+                    field.push_back(c);
+                }
+            } else if (c == '"' && field.empty()) {
+                quoted = true;
+            } else if (c == ',') {
+                fields.push_back(move(field));
+                field.clear();
+            } else if (c == '\n') {
+                ++lineNo;
+                break;
+            } else if (c != '\r') {
+                field.push_back(c);
+            }
+        }
+        fields.push_back(move(field));
+        return true;
+    }
+
+private:
+    istream& in;
+    uint64_t lineNo = 0;
+};
+
+// ===================== COPY BINARY =====================
+
+// Запись строк в COPY ... FROM STDIN (FORMAT binary). Строки копятся в буфере
+// и уходят PQputCopyData порциями по COPY_CHUNK байт.
+class CopyBinaryWriter {
+public:
+    static const size_t COPY_CHUNK = 1 << 20;
+
+    CopyBinaryWriter(PGconn* conn, const string& sql) : conn(conn) {
+        PGresult* res = PQexec(conn, sql.c_str());
+        bool ok = PQresultStatus(res) == PGRES_COPY_IN;
+        string msg = PQresultErrorMessage(res);
+        PQclear(res);
+        if (!ok) throw runtime_error("COPY не начался: " + msg);
+
+        static const char SIGNATURE[11] = { 'P', 'G', 'C', 'O', 'P', 'Y', '\n', '\377', '\r', '\n', '\0' };
+        buf.append(SIGNATURE, sizeof(SIGNATURE));
+        putInt32(0);   // флаги
+        putInt32(0);   // длина расширения заголовка
+    }
+
+    void beginRow(int fields) {
+        putInt16(static_cast<int16_t>(fields));
+        ++rows;
+    }
+
+    void text(const string& s) {
+        putInt32(static_cast<int32_t>(s.size()));
+        buf += s;
+    }
+
+    void int8(int64_t v) {
+        putInt32(8);
+        uint64_t be = htobe64(static_cast<uint64_t>(v));
+        buf.append(reinterpret_cast<const char*>(&be), 8);
+    }
+
+    void boolean(bool v) {
+        putInt32(1);
+        buf.push_back(v ? 1 : 0);
+    }
+
+    void null() {
+        putInt32(-1);
+    }
+
+    // Дописать строку в буфер целиком; отправка — только между строками
+    void endRow() {
+        if (buf.size() >= COPY_CHUNK) send();
+    }
+
+    // Завершить COPY; возвращает число загруженных строк
+    uint64_t finish() {
+        putInt16(-1);
+        send();
+        if (PQputCopyEnd(conn, nullptr) != 1) {
+            throw runtime_error(string("Ошибка завершения COPY: ") + PQerrorMessage(conn));
+        }
+        PGresult* res = PQgetResult(conn);
+        bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        string msg = PQresultErrorMessage(res);
+        PQclear(res);
+        while (PGresult* extra = PQgetResult(conn)) PQclear(extra);
+        if (!ok) throw runtime_error("Ошибка COPY: " + msg);
+        return rows;
+    }
+
+private:
+    void putInt16(int16_t v) {
+        uint16_t be = htons(static_cast<uint16_t>(v));
+        buf.append(reinterpret_cast<const char*>(&be), 2);
+    }
+
+    void putInt32(int32_t v) {
+        uint32_t be = htonl(static_cast<uint32_t>(v));
+        buf.append(reinterpret_cast<const char*>(&be), 4);
+    }
+
+    void send() {
+        if (buf.empty()) return;
+        if (PQputCopyData(conn, buf.data(), static_cast<int>(buf.size())) != 1) {
+            throw runtime_error(string("Ошибка передачи COPY: ") + PQerrorMessage(conn));
+        }
+        buf.clear();
+    }
+
+    PGconn* conn;
+    string buf;
+    uint64_t rows = 0;
+};
+
+// ===================== ВСПОМОГАТЕЛЬНОЕ =====================
+
+// Отдельное блокирующее соединение: инструмент однопоточный, пул ему не нужен
+class ToolConn {
+public:
+    explicit ToolConn(int shard = 0) {
+        conn = PQconnectdb(shards().conninfo(shard).c_str());
+        if (PQstatus(conn) != CONNECTION_OK) {
+            string msg = PQerrorMessage(conn);
+            PQfinish(conn);
+            throw runtime_error("Нет подключения к БД: " + msg);
+        }
+    }
+
+    ~ToolConn() {
+        PQfinish(conn);
+    }
+
+    ToolConn(const ToolConn&) = delete;
+    ToolConn& operator=(const ToolConn&) = delete;
+
+    // Выполнить команду; возвращает число затронутых строк (PQcmdTuples)
+    uint64_t exec(const string& sql) {
+        PGresult* res = PQexec(conn, sql.c_str());
+        ExecStatusType st = PQresultStatus(res);
+        if (st != PGRES_COMMAND_OK && st != PGRES_TUPLES_OK) {
+            string msg = PQresultErrorMessage(res);
+            PQclear(res);
+            throw runtime_error(msg);
+        }
+        uint64_t n = strtoull(PQcmdTuples(res), nullptr, 10);
+        PQclear(res);
+        return n;
+    }
+
+    // Запрос с текстовым результатом; освобождает вызывающий
+    PGresult* query(const string& sql) {
+        PGresult* res = PQexec(conn, sql.c_str());
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            string msg = PQresultErrorMessage(res);
+            PQclear(res);
+            throw runtime_error(msg);
+        }
+        return res;
+    }
+
+    PGconn* conn;
+};
+
+// Этап с замером: "загрузка: 1000000 строк за 4.20 с (238095 строк/с)"
+class Stage {
+public:
+    explicit Stage(const char* name) : name(name), start(Clock::now()) {}
+
+    void done(uint64_t rows) {
+        double secs = chrono::duration<double>(Clock::now() - start).count();
+        fprintf(stderr, "%-28s %10llu строк за %8.2f с (%.0f строк/с)\n", name,
+                static_cast<unsigned long long>(rows), secs, secs > 0 ? rows / secs : 0.0);
+    }
+
+private:
+    const char* name;
+    Clock::time_point start;
+};
+
+// Отклонённые при проверке строки: первые REJECT_PRINT печатаются, остальные считаются
+const uint64_t REJECT_PRINT = 20;
+
+struct Rejects {
+    uint64_t count = 0;
+
+    void add(uint64_t line, const string& why) {
+        if (++count <= REJECT_PRINT) {
+            fprintf(stderr, "строка %llu: %s\n", static_cast<unsigned long long>(line), why.c_str());
+        }
+    }
+
+    void report() const {
+        if (count > REJECT_PRINT) {
+            fprintf(stderr, "... и ещё %llu отклонённых строк\n",
+                    static_cast<unsigned long long>(count - REJECT_PRINT));
+        }
+    }
+};
+
+// Номер счёта из файла: 16 цифр с верной контрольной цифрой Луна
+bool isValidAccountNumber(const string& number) {
+    return number.size() == 16 && isAllDigits(number) &&
+           luhnCheckDigit(number.substr(0, 15)) == number[15];
+}
+
+// Во время массовой загрузки триггер accounts не шлёт NOTIFY на каждую строку:
+// после COMMIT кэшам bank.cgi уходит одно уведомление "*" — сбросить всё.
+void beginBulkLoad(ToolConn& db) {
+    db.exec("BEGIN");
+    db.exec("SET LOCAL bank.bulk_load = on");
+}
+
+void commitBulkLoad(ToolConn& db) {
+    db.exec("NOTIFY bank_changes, '*'");
+    db.exec("COMMIT");
+}
+
+// Загрузка пишет в один узел: при шардах пользователи и счета разошлись бы не по своим шардам
+void requireSingleShard() {
+    if (shards().count() > 1) {
+        throw runtime_error("загрузка в несколько шардов (shard_conninfo) не поддерживается");
+    }
+}
+
+// ===================== КОМАНДЫ =====================
+
+int importUsers(const string& path) {
+    ifstream in(path);
+    if (!in) throw runtime_error("Не удалось открыть " + path);
+
+    requireSingleShard();
+    ToolConn db;
+    beginBulkLoad(db);
+    db.exec("CREATE TEMP TABLE import_users ("
+            "    line BIGINT, full_name TEXT, email TEXT, password TEXT"
+            ") ON COMMIT DROP");
+
+    Stage load("хэширование паролей и загрузка (COPY binary)");
+    CsvReader csv(in);
+    vector<string> f;
+    uint64_t line = 0;
+    Rejects rejects;
+    CopyBinaryWriter copy(db.conn, "COPY import_users FROM STDIN (FORMAT binary)");
+
+    // Строки копятся пачкой по размеру очереди хэширования: пароли пачки
+    // хэшируются параллельно, затем пачка уходит в COPY
+    PasswordHasher& hasher = passwordHasher();
+    hasher.start(static_cast<int>(max(1u, thread::hardware_concurrency())));
+    struct UserRow {
+        uint64_t line;
+        string fullName, email, password;
+    };
+    vector<UserRow> pending;
+    auto flush = [&] {
+        vector<shared_ptr<PasswordHasher::Job>> jobs;
+        for (UserRow& r : pending) {
+            jobs.push_back(hasher.submit([&r] { r.password = scryptHash(r.password, scryptParams()); }));
+        }
+        for (auto& job : jobs) hasher.wait(job);
+        for (const UserRow& r : pending) {
+            copy.beginRow(4);
+            copy.int8(static_cast<int64_t>(r.line));
+            copy.text(r.fullName);
+            copy.text(r.email);
+            copy.text(r.password);
+            copy.endRow();
+        }
+        pending.clear();
+    };
+
+    csv.next(f, line);   // заголовок
+    while (csv.next(f, line)) {
+        if (f.size() == 1 && f[0].empty()) continue;   // пустая строка
+        // Те же правила, что у handleRegister
+        if (f.size() != 3 || f[0].empty() || f[1].empty() || f[2].size() < 6) {
+            rejects.add(line, "ожидается full_name,email,password (пароль не короче 6 символов)");
+            continue;
+        }
+        pending.push_back({ line, f[0], f[1], f[2] });
+        if (pending.size() >= static_cast<size_t>(hasher.capacity())) flush();
+    }
+    flush();
+    uint64_t loaded = copy.finish();
+    load.done(loaded);
+    rejects.report();
+
+    Stage insert("вставка пользователей");
+    // Повтор email в файле — берётся первая строка; уже существующие — пропускаются
+    uint64_t inserted = db.exec(
+        "INSERT INTO users(full_name, email, password) "
+        "SELECT DISTINCT ON (email) full_name, email, password FROM import_users "
+        "ORDER BY email, line "
+        "ON CONFLICT (email) DO NOTHING");
+    insert.done(inserted);
+
+    commitBulkLoad(db);
+    fprintf(stderr, "добавлено: %llu, пропущено (email уже есть или повторяется): %llu, отклонено: %llu\n",
+            static_cast<unsigned long long>(inserted),
+            static_cast<unsigned long long>(loaded - inserted),
+            static_cast<unsigned long long>(rejects.count));
+    return 0;
+}
+
+int importAccounts(const string& path) {
+    ifstream in(path);
+    if (!in) throw runtime_error("Не удалось открыть " + path);
+
+    requireSingleShard();
+    ToolConn db;
+    beginBulkLoad(db);
+    // status: ready — к вставке, done — вставлен, no_user, limit, taken — отклонён
+    db.exec("CREATE TEMP TABLE import_accounts ("
+            "    line BIGINT PRIMARY KEY, email TEXT, balance BIGINT, number TEXT,"
+            "    generated BOOLEAN, user_id INTEGER, status TEXT NOT NULL DEFAULT 'ready'"
+            ") ON COMMIT DROP");
+
+    Stage load("загрузка (COPY binary)");
+    CsvReader csv(in);
+    vector<string> f;
+    uint64_t line = 0;
+    Rejects rejects;
+    CopyBinaryWriter copy(db.conn,
+        "COPY import_accounts(line, email, balance, number, generated) FROM STDIN (FORMAT binary)");
+    csv.next(f, line);   // заголовок
+    while (csv.next(f, line)) {
+        if (f.size() == 1 && f[0].empty()) continue;
+        Money balance;
+        if (f.size() < 2 || f.size() > 3 || f[0].empty()) {
+            rejects.add(line, "ожидается email,balance[,number]");
+            continue;
+        }
+        if (!parseMoney(f[1], balance) || balance.minor < 0) {
+            rejects.add(line, "некорректный баланс: " + f[1]);
+            continue;
+        }
+        bool generated = f.size() < 3 || f[2].empty();
+        if (!generated && !isValidAccountNumber(f[2])) {
+            rejects.add(line, "некорректный номер счёта: " + f[2]);
+            continue;
+        }
+        copy.beginRow(5);
+        copy.int8(static_cast<int64_t>(line));
+        copy.text(f[0]);
+        copy.int8(balance.minor);
+        copy.text(generated ? generateAccountNumber(0) : f[2]);
+        copy.boolean(generated);
+        copy.endRow();
+    }
+    uint64_t loaded = copy.finish();
+    load.done(loaded);
+    rejects.report();
+
+    Stage check("проверка пользователей");
+    db.exec("UPDATE import_accounts i SET user_id = u.id FROM users u WHERE u.email = i.email");
+    db.exec("UPDATE import_accounts SET status = 'no_user' WHERE user_id IS NULL");
+    // Лимит счетов, как у createAccount: уже открытые плюс загружаемые по порядку строк
+    db.exec("WITH ranked AS ("
+            "    SELECT i.line,"
+            "           row_number() OVER (PARTITION BY i.user_id ORDER BY i.line)"
+            "           + (SELECT COUNT(*) FROM accounts a WHERE a.user_id = i.user_id) AS n"
+            "      FROM import_accounts i WHERE i.status = 'ready'"
+            ") "
+            "UPDATE import_accounts i SET status = 'limit' FROM ranked r "
+            " WHERE i.line = r.line AND r.n > " + to_string(MAX_ACCOUNTS_PER_USER));
+    check.done(loaded);
+
+    Stage insert("вставка счетов");
+    uint64_t inserted = 0;
+    for (int attempt = 0; attempt < ACCOUNT_NUMBER_ATTEMPTS; ++attempt) {
+        // Занятый номер (в базе или повтор в файле) не даёт ошибки — строка
+        // остаётся ready и на следующем круге получает новый номер. Из повторов
+        // в файле за круг пробуется только первый, чтобы номер однозначно
+        // указывал на строку.
+        inserted += db.exec(
+            "WITH src AS ("
+            "    SELECT DISTINCT ON (number) line, user_id, number, balance FROM import_accounts"
+            "     WHERE status = 'ready' ORDER BY number, line"
+            "), ins AS ("
+            "    INSERT INTO accounts(user_id, number, balance)"
+            "    SELECT user_id, number, balance / 100.0 FROM src ORDER BY line"
+            "    ON CONFLICT (number) DO NOTHING"
+            "    RETURNING id, number, balance"
+            "), led AS ("
+            "    INSERT INTO ledger(account_id, kind, amount, balance_after)"
+            "    SELECT id, 'import', balance, balance FROM ins WHERE balance <> 0"
+            ") "
+            "UPDATE import_accounts i SET status = 'done' "
+            "  FROM ins JOIN src USING (number) WHERE i.line = src.line");
+
+        PGresult* res = db.query("SELECT line FROM import_accounts WHERE status = 'ready' AND generated");
+        int retry = PQntuples(res);
+        string lines = "{", numbers = "{";
+        for (int i = 0; i < retry; ++i) {
+            if (i) { lines += ','; numbers += ','; }
+            lines += PQgetvalue(res, i, 0);
+            numbers += generateAccountNumber(0);
+        }
+        PQclear(res);
+        if (retry == 0) break;
+        db.exec("UPDATE import_accounts i SET number = v.number "
+                "  FROM unnest('" + lines + "}'::bigint[], '" + numbers + "}'::text[]) AS v(line, number) "
+                " WHERE i.line = v.line");
+    }
+    db.exec("UPDATE import_accounts SET status = 'taken' WHERE status = 'ready'");
+    insert.done(inserted);
+
+    PGresult* res = db.query("SELECT status, COUNT(*) FROM import_accounts GROUP BY status ORDER BY status");
+    commitBulkLoad(db);
+    for (int i = 0; i < PQntuples(res); ++i) {
+        fprintf(stderr, "%-8s %s\n", PQgetvalue(res, i, 0), PQgetvalue(res, i, 1));
+    }
+    PQclear(res);
+    fprintf(stderr, "(done — добавлено, no_user — нет пользователя с таким email, limit — больше %d "
+            "счетов, taken — номер занят); отклонено при разборе: %llu\n",
+            MAX_ACCOUNTS_PER_USER, static_cast<unsigned long long>(rejects.count));
+    return 0;
+}
+
+int exportBalances(const string& path) {
+    FILE* out = path.empty() ? stdout : fopen(path.c_str(), "w");
+    if (!out) throw runtime_error("Не удалось открыть " + path);
+
+    string balance = config().getInt("account_slots", 0)
+        ? "a.balance + COALESCE((SELECT SUM(s.balance) FROM account_slots s WHERE s.account_id = a.id), 0)"
+        : "a.balance";
+    Stage dump("выгрузка балансов (COPY TO)");
+    uint64_t rows = 0;
+    for (int shard = 0; shard < shards().count(); ++shard) {
+        ToolConn db(shard);
+        // Согласованный срез: все балансы шарда на один момент
+        db.exec("BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY");
+        // Заголовок — только у первого шарда
+        PGresult* res = PQexec(db.conn, (
+            "COPY (SELECT a.number, u.email, " + balance + " AS balance"
+            "        FROM accounts a JOIN users u ON u.id = a.user_id ORDER BY a.id) "
+            "TO STDOUT (FORMAT csv" + string(shard == 0 ? ", HEADER" : "") + ")").c_str());
+        bool ok = PQresultStatus(res) == PGRES_COPY_OUT;
+        string msg = PQresultErrorMessage(res);
+        PQclear(res);
+        if (!ok) throw runtime_error("COPY не начался: " + msg);
+
+        char* data = nullptr;
+        int len;
+        while ((len = PQgetCopyData(db.conn, &data, 0)) > 0) {
+            fwrite(data, 1, len, out);
+            PQfreemem(data);
+            ++rows;
+        }
+        if (len == -2) throw runtime_error(string("Ошибка COPY: ") + PQerrorMessage(db.conn));
+        res = PQgetResult(db.conn);
+        ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        msg = PQresultErrorMessage(res);
+        PQclear(res);
+        if (!ok) throw runtime_error("Ошибка COPY: " + msg);
+        db.exec("COMMIT");
+    }
+
+    if (out != stdout && fclose(out) != 0) throw runtime_error("Ошибка записи " + path);
+    dump.done(rows > 0 ? rows - 1 : 0);   // без строки заголовка
+    return 0;
+}
+
+// ===================== MAIN =====================
+
+int main(int argc, char** argv) {
+    string cmd = argc > 1 ? argv[1] : "";
+    try {
+        if (cmd == "import-users" && argc == 3)    return importUsers(argv[2]);
+        if (cmd == "import-accounts" && argc == 3) return importAccounts(argv[2]);
+        if (cmd == "export-balances" && argc <= 3) return exportBalances(argc == 3 ? argv[2] : "");
+    } catch (const exception& e) {
+        cerr << "bank_tool: " << e.what() << "\n";
+        return 1;
+    }
+    cerr << "Использование:\n"
+            "  bank_tool import-users ФАЙЛ.csv        full_name,email,password\n"
+            "  bank_tool import-accounts ФАЙЛ.csv     email,balance[,number]\n"
+            "  bank_tool export-balances [ФАЙЛ.csv]   number,email,balance\n";
+    return 2;
+}
@@ -0,0 +1,627 @@
+// Сборка:
+//   g++ -O2 -std=c++17 bench_load.cpp -o bench_load -pthread
+//
+// Нагрузочный тест bank.cgi по сценариям app.js. Каждый виртуальный пользователь
+// проходит регистрацию → вход → открытие счетов → пополнение, затем до конца
+// прогона выполняет смесь операций: пополнение, снятие, перевод (получатель
+// выбирается по закону Ципфа — несколько «горячих» счетов получают основную
+// часть переводов) и опрос getAccounts + getBalance по каждому счёту, как это
+// делает главная страница.
+//
+// Примеры:
+//   ./bench_load --url http://127.0.0.1:8080/ -c 64 -d 60             (bank.cgi --serve)
+//   ./bench_load --url http://localhost/cgi-bin/bank.cgi -c 32 -d 60  (CGI/FastCGI за веб-сервером)
+//   ./bench_load --cgi ./bank.cgi -c 8 -d 30                          (CGI напрямую: процесс на запрос)
+//
+// Отчёт (p50/p95/p99/max по каждому действию и пропускная способность) печатается
+// и записывается в файл --out. БД должна быть создана по schema.sql; тест создаёт
+// своих пользователей с адресами bench-<время>-<номер>@example.com.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <memory>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using namespace std;
+
+using Clock = chrono::steady_clock;
+
+// ===================== ПАРАМЕТРЫ =====================
+
+struct Options {
+    string url;                 // http://хост[:порт]/путь
+    string cgiPath;             // или путь к bank.cgi для запуска напрямую
+    int concurrency = 16;
+    int duration = 30;          // сек измеряемой фазы
+    int accountsPerUser = 2;
+    int hotAccounts = 10;       // счета отдельного «горячего» клиента
+    double skew = 1.0;          // показатель Ципфа для получателей переводов; 0 — равномерно
+    bool dashboard = false;     // опрашивать action=dashboard вместо getAccounts + getBalance
+    int thinkMs = 0;            // пауза между операциями пользователя
+    string mix = "topup=20,withdraw=10,transfer=30,poll=40";
+    string out = "bench_load_report.txt";
+};
+
+void usage() {
+    cerr << "Использование: bench_load (--url URL | --cgi ПУТЬ) [параметры]\n"
+            "  -c, --concurrency N   виртуальных пользователей (16)\n"
+            "  -d, --duration S      длительность измеряемой фазы, сек (30)\n"
+            "  --accounts N          счетов на пользователя, 1..3 (2)\n"
+            "  --hot N               «горячих» счетов-получателей (10)\n"
+            "  --skew S              показатель Ципфа для получателей, 0 — равномерно (1.0)\n"
+            "  --mix СПИСОК          веса операций (topup=20,withdraw=10,transfer=30,poll=40)\n"
+            "  --dashboard           опрос через action=dashboard\n"
+            "  --think MS            пауза между операциями (0)\n"
+            "  --out ФАЙЛ            файл отчёта (bench_load_report.txt)\n";
+}
+
+bool parseOptions(int argc, char** argv, Options& o) {
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        auto next = [&]() -> string {
+            if (i + 1 >= argc) throw invalid_argument("нет значения для " + a);
+            return argv[++i];
+        };
+        if      (a == "--url")                        o.url = next();
+        else if (a == "--cgi")                        o.cgiPath = next();
+        else if (a == "-c" || a == "--concurrency")   o.concurrency = stoi(next());
+        else if (a == "-d" || a == "--duration")      o.duration = stoi(next());
+        else if (a == "--accounts")                   o.accountsPerUser = stoi(next());
+        else if (a == "--hot")                        o.hotAccounts = stoi(next());
+        else if (a == "--skew")                       o.skew = stod(next());
+        else if (a == "--mix")                        o.mix = next();
+        else if (a == "--dashboard")                  o.dashboard = true;
+        else if (a == "--think")                      o.thinkMs = stoi(next());
+        else if (a == "--out")                        o.out = next();
+        else return false;
+    }
+    o.accountsPerUser = min(3, max(1, o.accountsPerUser));
+    o.hotAccounts = max(1, o.hotAccounts);
+    return (o.url.empty() != o.cgiPath.empty()) && o.concurrency > 0 && o.duration > 0;
+}
+
+// ===================== ТРАНСПОРТ =====================
+
+string urlEncode(const string& s) {
+    static const char* hex = "0123456789ABCDEF";
+    string r;
+    for (unsigned char c : s) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            r.push_back(static_cast<char>(c));
+        } else {
+            r.push_back('%');
+            r.push_back(hex[c >> 4]);
+            r.push_back(hex[c & 15]);
+        }
+    }
+    return r;
+}
+
+string formBody(const vector<pair<string, string>>& fields) {
+    string body;
+    for (const auto& f : fields) {
+        if (!body.empty()) body.push_back('&');
+        body += urlEncode(f.first) + "=" + urlEncode(f.second);
+    }
+    return body;
+}
+
+// Один запрос к bank.cgi: POST с телом application/x-www-form-urlencoded.
+// false — ответ не получен (обрыв соединения, процесс не запустился и т.п.).
+class Transport {
+public:
+    virtual ~Transport() {}
+    virtual bool post(const string& form, string& body) = 0;
+};
+
+// HTTP/1.1 с keep-alive: одно соединение на виртуального пользователя
+class HttpTransport : public Transport {
+public:
+    explicit HttpTransport(const string& url) {
+        string rest = url;
+        if (rest.compare(0, 7, "http://") != 0) throw invalid_argument("поддерживается только http://");
+        rest.erase(0, 7);
+        size_t slash = rest.find('/');
+        path = slash == string::npos ? "/" : rest.substr(slash);
+        string hostPort = rest.substr(0, slash);
+        size_t colon = hostPort.rfind(':');
+        host = hostPort.substr(0, colon);
+        port = colon == string::npos ? "80" : hostPort.substr(colon + 1);
+        hostHeader = hostPort;
+    }
+
+    ~HttpTransport() override {
+        disconnect();
+    }
+
+    bool post(const string& form, string& body) override {
+        if (fd < 0 && !connectServer()) return false;
+
+        string req = "POST " + path + " HTTP/1.1\r\n"
+                     "Host: " + hostHeader + "\r\n"
+                     "Content-Type: application/x-www-form-urlencoded\r\n"
+                     "Content-Length: " + to_string(form.size()) + "\r\n\r\n" + form;
+        if (!sendAll(req) || !readResponse(body)) {
+            disconnect();
+            return false;
+        }
+        return true;
+    }
+
+private:
+    bool connectServer() {
+        addrinfo hints{}, *res = nullptr;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) return false;
+        for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd < 0) return false;
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        buf.clear();
+        return true;
+    }
+
+    void disconnect() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+
+    bool sendAll(const string& data) {
+        size_t off = 0;
+        while (off < data.size()) {
+            ssize_t n = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            off += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    bool readMore() {
+        char chunk[16384];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) return false;
+        buf.append(chunk, static_cast<size_t>(n));
+        return true;
+    }
+
+    bool readResponse(string& body) {
+        size_t headEnd;
+        while ((headEnd = buf.find("\r\n\r\n")) == string::npos) {
+            if (!readMore()) return false;
+        }
+        string head = buf.substr(0, headEnd);
+        for (char& c : head) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+
+        size_t cl = head.find("\r\ncontent-length:");
+        if (cl == string::npos) return false;   // bank.cgi всегда отдаёт Content-Length
+        size_t length = strtoul(head.c_str() + cl + 17, nullptr, 10);
+        bool close = head.find("\r\nconnection: close") != string::npos;
+
+        size_t start = headEnd + 4;
+        while (buf.size() - start < length) {
+            if (!readMore()) return false;
+        }
+        body.assign(buf, start, length);
+        buf.erase(0, start + length);
+        if (close) disconnect();
+        return true;
+    }
+
+    string host, port, path, hostHeader;
+    int fd = -1;
+    string buf;
+};
+
+// Классический CGI: bank.cgi запускается заново на каждый запрос
+class CgiTransport : public Transport {
+public:
+    explicit CgiTransport(const string& path) : path(path) {}
+
+    bool post(const string& form, string& body) override {
+        int in[2], out[2];
+        if (pipe(in) < 0) return false;
+        if (pipe(out) < 0) {
+            close(in[0]); close(in[1]);
+            return false;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+            return false;
+        }
+        if (pid == 0) {
+            dup2(in[0], STDIN_FILENO);
+            dup2(out[1], STDOUT_FILENO);
+            close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+            setenv("GATEWAY_INTERFACE", "CGI/1.1", 1);
+            setenv("REQUEST_METHOD", "POST", 1);
+            setenv("CONTENT_TYPE", "application/x-www-form-urlencoded", 1);
+            setenv("CONTENT_LENGTH", to_string(form.size()).c_str(), 1);
+            setenv("QUERY_STRING", "", 1);
+            execl(path.c_str(), path.c_str(), static_cast<char*>(nullptr));
+            _exit(127);
+        }
+
+        close(in[0]);
+        close(out[1]);
+        size_t off = 0;
+        while (off < form.size()) {
+            ssize_t n = write(in[1], form.data() + off, form.size() - off);
+            if (n <= 0) break;
+            off += static_cast<size_t>(n);
+        }
+        close(in[1]);
+
+        string output;
+        char chunk[16384];
+        ssize_t n;
+        while ((n = read(out[0], chunk, sizeof(chunk))) > 0) output.append(chunk, static_cast<size_t>(n));
+        close(out[0]);
+
+        int status = 0;
+        waitpid(pid, &status, 0);
+        size_t headEnd = output.find("\r\n\r\n");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || headEnd == string::npos) return false;
+        body = output.substr(headEnd + 4);
+        return true;
+    }
+
+private:
+    string path;
+};
+
+// ===================== РАЗБОР ОТВЕТОВ =====================
+
+// bank.cgi пишет компактный JSON без пробелов, поэтому достаточно поиска по ключу
+
+bool jsonSuccess(const string& body) {
+    return body.find("\"success\":true") != string::npos;
+}
+
+long long jsonInt(const string& body, const string& key) {
+    size_t p = body.find("\"" + key + "\":");
+    if (p == string::npos) return -1;
+    return strtoll(body.c_str() + p + key.size() + 3, nullptr, 10);
+}
+
+string jsonString(const string& body, const string& key, size_t from = 0) {
+    size_t p = body.find("\"" + key + "\":\"", from);
+    if (p == string::npos) return "";
+    p += key.size() + 4;
+    return body.substr(p, body.find('"', p) - p);
+}
+
+vector<string> jsonAccountNumbers(const string& body) {
+    vector<string> nums;
+    size_t p = 0;
+    while ((p = body.find("\"number\":\"", p)) != string::npos) {
+        p += 10;
+        nums.push_back(body.substr(p, body.find('"', p) - p));
+    }
+    return nums;
+}
+
+// ===================== СТАТИСТИКА =====================
+
+struct ActionSamples {
+    vector<uint32_t> micros;
+    uint64_t rejected = 0;     // success:false
+    uint64_t failed = 0;       // ответ не получен
+};
+
+using Samples = map<string, ActionSamples>;
+
+// Распределение Ципфа на [0, n): вероятность ранга k пропорциональна 1/(k+1)^s
+class ZipfSampler {
+public:
+    ZipfSampler(size_t n, double s) : cdf(n) {
+        double sum = 0;
+        for (size_t k = 0; k < n; ++k) {
+            sum += 1.0 / pow(static_cast<double>(k + 1), s);
+            cdf[k] = sum;
+        }
+        for (double& c : cdf) c /= sum;
+    }
+
+    size_t operator()(mt19937_64& rng) const {
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        return min(cdf.size() - 1, static_cast<size_t>(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()));
+    }
+
+private:
+    vector<double> cdf;
+};
+
+// ===================== ВИРТУАЛЬНЫЙ ПОЛЬЗОВАТЕЛЬ =====================
+
+class VirtualUser {
+public:
+    VirtualUser(const Options& opt, int index, const string& runId)
+        : rng(random_device{}() ^ static_cast<uint64_t>(index)), opt(opt), index(index), runId(runId) {
+        if (opt.cgiPath.empty()) transport.reset(new HttpTransport(opt.url));
+        else transport.reset(new CgiTransport(opt.cgiPath));
+    }
+
+    // Запрос с замером; body — тело ответа. true — success:true
+    bool call(const string& action, vector<pair<string, string>> fields, string& body) {
+        fields.insert(fields.begin(), { "action", action });
+        string form = formBody(fields);
+        auto start = Clock::now();
+        bool ok = transport->post(form, body);
+        uint32_t us = static_cast<uint32_t>(
+            chrono::duration_cast<chrono::microseconds>(Clock::now() - start).count());
+
+        ActionSamples& s = samples[action];
+        if (!ok) {
+            ++s.failed;
+            body.clear();
+            return false;
+        }
+        s.micros.push_back(us);
+        if (!jsonSuccess(body)) {
+            ++s.rejected;
+            return false;
+        }
+        return true;
+    }
+
+    // Регистрация, вход, открытие счетов и стартовое пополнение (как новый клиент в app.js).
+    // Пустой initialTopup — без пополнения.
+    bool setUp(int accounts, const string& initialTopup) {
+        string body;
+        string email = "bench-" + runId + "-" + to_string(index) + "@example.com";
+        string password = "bench-password";
+        call("register", { { "fullName", "Bench User " + to_string(index) },
+                           { "email", email }, { "password", password } }, body);
+        if (!call("login", { { "login", email }, { "password", password } }, body)) return false;
+        userId = to_string(jsonInt(body, "userId"));
+
+        for (int i = 0; i < accounts; ++i) {
+            if (call("createAccount", { { "userId", userId } }, body)) {
+                own.push_back(jsonString(body, "accountNumber"));
+            }
+        }
+        for (const string& acc : own) {
+            if (initialTopup.empty()) break;
+            call("topup", { { "accountNumber", acc }, { "amount", initialTopup } }, body);
+        }
+        return !own.empty();
+    }
+
+    // Одна операция смеси
+    void step(const string& op, const vector<string>& targets, const ZipfSampler& zipf) {
+        string body;
+        const string& acc = own[rng() % own.size()];
+
+        if (op == "topup") {
+            call("topup", { { "accountNumber", acc }, { "amount", "100.00" } }, body);
+        } else if (op == "withdraw") {
+            call("withdraw", { { "accountNumber", acc }, { "amount", "1.00" } }, body);
+        } else if (op == "transfer") {
+            const string& to = targets[zipf(rng)];
+            if (to == acc) return;
+            call("transfer", { { "fromAccount", acc }, { "toAccount", to }, { "amount", "1.00" } }, body);
+        } else if (opt.dashboard) {
+            call("dashboard", { { "userId", userId } }, body);
+        } else {
+            // Главная страница до появления dashboard: список счетов и баланс каждого
+            if (call("getAccounts", { { "userId", userId } }, body)) {
+                for (const string& num : jsonAccountNumbers(body)) {
+                    call("getBalance", { { "accountNumber", num } }, body);
+                }
+            }
+        }
+    }
+
+    const vector<string>& accounts() const { return own; }
+
+    Samples samples;
+    mt19937_64 rng;
+
+private:
+    const Options& opt;
+    int index;
+    string runId;
+    unique_ptr<Transport> transport;
+    string userId;
+    vector<string> own;
+};
+
+// ===================== ОТЧЁТ =====================
+
+double percentileMs(const vector<uint32_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t idx = static_cast<size_t>(ceil(p * sorted.size()));
+    return sorted[idx == 0 ? 0 : idx - 1] / 1000.0;
+}
+
+string report(const Options& opt, const Samples& setup, const Samples& run, double seconds) {
+    ostringstream r;
+    r.setf(ios::fixed);
+    r.precision(2);
+    r << "bench_load: " << (opt.url.empty() ? "cgi " + opt.cgiPath : opt.url)
+      << ", пользователей " << opt.concurrency << ", " << seconds << " с"
+      << ", счетов на пользователя " << opt.accountsPerUser
+      << ", горячих счетов " << opt.hotAccounts << ", skew " << opt.skew
+      << ", смесь " << opt.mix << (opt.dashboard ? ", опрос dashboard" : ", опрос getAccounts+getBalance")
+      << "\n";
+
+    auto table = [&](const char* title, const Samples& samples, double secs) {
+        r << "\n" << title << "\n";
+        char line[256];
+        snprintf(line, sizeof(line), "%-14s %9s %8s %8s %9s %9s %9s %9s %10s\n",
+                 "action", "count", "rejected", "failed", "p50 ms", "p95 ms", "p99 ms", "max ms", "req/s");
+        r << line;
+        uint64_t total = 0;
+        for (const auto& kv : samples) {
+            vector<uint32_t> sorted = kv.second.micros;
+            sort(sorted.begin(), sorted.end());
+            total += sorted.size();
+            snprintf(line, sizeof(line), "%-14s %9zu %8llu %8llu %9.2f %9.2f %9.2f %9.2f %10.1f\n",
+                     kv.first.c_str(), sorted.size(),
+                     static_cast<unsigned long long>(kv.second.rejected),
+                     static_cast<unsigned long long>(kv.second.failed),
+                     percentileMs(sorted, 0.50), percentileMs(sorted, 0.95), percentileMs(sorted, 0.99),
+                     sorted.empty() ? 0.0 : sorted.back() / 1000.0,
+                     secs > 0 ? sorted.size() / secs : 0.0);
+            r << line;
+        }
+        if (secs > 0) r << "всего: " << total << " запросов, " << total / secs << " req/s\n";
+    };
+
+    table("Подготовка (register, login, createAccount, topup):", setup, 0);
+    table("Измеряемая фаза:", run, seconds);
+    return r.str();
+}
+
+void merge(Samples& into, const Samples& from) {
+    for (const auto& kv : from) {
+        ActionSamples& s = into[kv.first];
+        s.micros.insert(s.micros.end(), kv.second.micros.begin(), kv.second.micros.end());
+        s.rejected += kv.second.rejected;
+        s.failed += kv.second.failed;
+    }
+}
+
+// ===================== MAIN =====================
+
+int main(int argc, char** argv) {
+    Options opt;
+    try {
+        if (!parseOptions(argc, argv, opt)) {
+            usage();
+            return 2;
+        }
+    } catch (const exception& e) {
+        cerr << "bench_load: " << e.what() << "\n";
+        usage();
+        return 2;
+    }
+
+    // Веса операций
+    vector<pair<string, int>> mix;
+    {
+        stringstream ss(opt.mix);
+        string item;
+        while (getline(ss, item, ',')) {
+            size_t eq = item.find('=');
+            if (eq == string::npos) continue;
+            mix.push_back({ item.substr(0, eq), atoi(item.c_str() + eq + 1) });
+        }
+    }
+    int mixTotal = 0;
+    for (const auto& m : mix) mixTotal += max(0, m.second);
+    if (mixTotal == 0) {
+        cerr << "bench_load: пустая смесь операций\n";
+        return 2;
+    }
+
+    string runId = to_string(time(nullptr)) + "-" + to_string(getpid());
+
+    // «Горячий» клиент: его счета — самые частые получатели переводов
+    vector<string> targets;
+    {
+        int hotUsers = (opt.hotAccounts + 2) / 3;
+        for (int h = 0; h < hotUsers; ++h) {
+            VirtualUser hot(opt, -1 - h, runId);
+            hot.setUp(min(3, opt.hotAccounts - 3 * h), "");
+            targets.insert(targets.end(), hot.accounts().begin(), hot.accounts().end());
+        }
+    }
+
+    // Подготовка пользователей параллельно
+    vector<unique_ptr<VirtualUser>> users;
+    for (int i = 0; i < opt.concurrency; ++i) {
+        users.emplace_back(new VirtualUser(opt, i, runId));
+    }
+    {
+        vector<thread> ts;
+        vector<char> ready(users.size());
+        for (size_t i = 0; i < users.size(); ++i) {
+            ts.emplace_back([&, i] { ready[i] = users[i]->setUp(opt.accountsPerUser, "100000.00"); });
+        }
+        for (auto& t : ts) t.join();
+        for (size_t i = 0; i < users.size(); ++i) {
+            if (ready[i]) targets.insert(targets.end(), users[i]->accounts().begin(), users[i]->accounts().end());
+        }
+        users.erase(remove_if(users.begin(), users.end(),
+                              [](const unique_ptr<VirtualUser>& u) { return u->accounts().empty(); }),
+                    users.end());
+    }
+    if (users.empty() || targets.size() < 2) {
+        cerr << "bench_load: не удалось подготовить пользователей (сервер и БД доступны?)\n";
+        return 1;
+    }
+
+    Samples setup;
+    for (auto& u : users) {
+        merge(setup, u->samples);
+        u->samples.clear();
+    }
+
+    // Измеряемая фаза
+    ZipfSampler zipf(targets.size(), opt.skew);
+    auto start = Clock::now();
+    auto deadline = start + chrono::seconds(opt.duration);
+    {
+        vector<thread> ts;
+        for (auto& up : users) {
+            VirtualUser* u = up.get();
+            ts.emplace_back([&, u] {
+                while (Clock::now() < deadline) {
+                    int pick = static_cast<int>(u->rng() % mixTotal);
+                    for (const auto& m : mix) {
+                        pick -= max(0, m.second);
+                        if (pick < 0) {
+                            u->step(m.first, targets, zipf);
+                            break;
+                        }
+                    }
+                    if (opt.thinkMs > 0) this_thread::sleep_for(chrono::milliseconds(opt.thinkMs));
+                }
+            });
+        }
+        for (auto& t : ts) t.join();
+    }
+    double seconds = chrono::duration<double>(Clock::now() - start).count();
+
+    Samples run;
+    for (auto& u : users) merge(run, u->samples);
+
+    string text = report(opt, setup, run, seconds);
+    cout << text;
+    ofstream out(opt.out);
+    out << text;
+    if (!out) {
+        cerr << "bench_load: не удалось записать " << opt.out << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,310 @@
+// Сборка:
+//   g++ -O2 -std=c++17 bench_micro.cpp -o bench_micro -pthread -lcgicc -lpq -lfcgi -lcrypto
+//
+// Микробенчмарки горячих путей bank.cgi, не требующих БД: разбор чисел и сумм,
+// проверки параметров, генерация номера счёта, разбор запроса Cgicc + getParam,
+// формирование JSON-ответов, хэширование паролей (scrypt с параметрами из
+// bank.conf) и полный проход handleRequest для запросов, отклоняемых ещё
+// до обращения к БД (поток некорректных запросов).
+//
+//   ./bench_micro [--filter ПОДСТРОКА] [--min-time СЕК] [--csv ФАЙЛ]
+//
+// Для каждого замера печатается ns/op; --csv пишет те же числа в файл, чтобы
+// сравнивать прогоны между собой.
+
+#define BANK_NO_MAIN
+#include "bank.cpp"
+
+// ===================== ИЗМЕРЕНИЕ =====================
+
+// Не даём компилятору выбросить вычисление, результат которого не используется
+template <typename T>
+inline void keep(T&& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct BenchResult {
+    string name;
+    double nsPerOp;
+    uint64_t iterations;
+};
+
+struct BenchOptions {
+    string filter;
+    double minTime = 0.3;
+    string csv;
+};
+
+vector<BenchResult> benchResults;
+BenchOptions benchOptions;
+
+// Прогнать fn партиями, удваивая размер партии, пока замер не займёт minTime
+template <typename Fn>
+void bench(const string& name, Fn fn) {
+    if (!benchOptions.filter.empty() && name.find(benchOptions.filter) == string::npos) return;
+
+    for (int i = 0; i < 100; ++i) fn();   // прогрев
+
+    uint64_t batch = 1;
+    while (true) {
+        auto start = Clock::now();
+        for (uint64_t i = 0; i < batch; ++i) fn();
+        double secs = chrono::duration<double>(Clock::now() - start).count();
+        if (secs >= benchOptions.minTime || batch >= (1ULL << 40)) {
+            BenchResult r{ name, secs * 1e9 / batch, batch };
+            printf("%-44s %12.1f ns/op %14llu\n", name.c_str(), r.nsPerOp,
+                   static_cast<unsigned long long>(batch));
+            benchResults.push_back(r);
+            return;
+        }
+        batch *= secs < benchOptions.minTime / 16 ? 8 : 2;
+    }
+}
+
+// ===================== ОКРУЖЕНИЕ ЗАПРОСА =====================
+
+HttpRequest makeRequest(const string& method, const string& query, const string& body) {
+    HttpRequest req;
+    req.method = method;
+    req.target = "/cgi-bin/bank.cgi" + (query.empty() ? "" : "?" + query);
+    req.version = "HTTP/1.1";
+    req.body = body;
+    if (!body.empty()) req.headers["content-type"] = "application/x-www-form-urlencoded";
+    return req;
+}
+
+// Обработчики пишут ответ через currentRequest — подставляем свой
+struct BenchRequestScope {
+    Response resp;
+    RequestContext ctx;
+
+    BenchRequestScope() {
+        ctx.response = &resp;
+        currentRequest = &ctx;
+    }
+
+    ~BenchRequestScope() {
+        currentRequest = nullptr;
+    }
+};
+
+// Прежний разбор целого через stoi — для сравнения
+bool parseIntStoi(const string& s, int& out) {
+    try {
+        size_t idx;
+        int v = stoi(s, &idx);
+        if (idx != s.size()) return false;
+        out = v;
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+// ===================== ЗАМЕРЫ =====================
+
+void benchParsing() {
+    const string validInt = "12345";
+    const string badInt = "abc12";
+    const string hugeInt = "99999999999999999999";
+    int v = 0;
+    bench("parseIntSafe/valid",      [&] { keep(parseIntSafe(validInt, v)); });
+    bench("parseIntSafe/invalid",    [&] { keep(parseIntSafe(badInt, v)); });
+    bench("parseIntSafe/overflow",   [&] { keep(parseIntSafe(hugeInt, v)); });
+    bench("stoi(baseline)/valid",    [&] { keep(parseIntStoi(validInt, v)); });
+    bench("stoi(baseline)/invalid",  [&] { keep(parseIntStoi(badInt, v)); });
+    bench("stoi(baseline)/overflow", [&] { keep(parseIntStoi(hugeInt, v)); });
+
+    const string validMoney = "1234.56";
+    const string commaMoney = "1234,5";
+    const string badMoney = "12.3.4";
+    const string textMoney = "сто рублей";
+    Money m;
+    bench("parseMoney/valid",         [&] { keep(parseMoney(validMoney, m)); });
+    bench("parseMoney/comma",         [&] { keep(parseMoney(commaMoney, m)); });
+    bench("parseMoney/invalid",       [&] { keep(parseMoney(badMoney, m)); });
+    bench("parseMoney/text",          [&] { keep(parseMoney(textMoney, m)); });
+
+    char buf[32];
+    Money amount(-123456789);
+    bench("formatMoney",              [&] { keep(formatMoney(buf, amount)); });
+
+    const string digits = "4000123412341234";
+    const string email = "user@example.com";
+    bench("isAllDigits/digits",       [&] { keep(isAllDigits(digits)); });
+    bench("isAllDigits/email",        [&] { keep(isAllDigits(email)); });
+
+    bench("generateAccountNumber",    [&] { keep(generateAccountNumber(0)); });
+}
+
+void benchCgi() {
+    HttpRequest get = makeRequest("GET", "action=getBalance&accountNumber=4000123412341234", "");
+    HttpRequest post = makeRequest("POST", "",
+        "action=transfer&fromAccount=4000123412341234&toAccount=4000432143214321&amount=150.25");
+    string remote = "127.0.0.1";
+
+    bench("Cgicc/parse GET", [&] {
+        HttpCgiInput input(get, remote);
+        Cgicc cgi(&input);
+        keep(cgi);
+    });
+    bench("Cgicc/parse POST + 4x getParam", [&] {
+        HttpCgiInput input(post, remote);
+        Cgicc cgi(&input);
+        bool p1, p2, p3, p4;
+        keep(getParam(cgi, "action", p1));
+        keep(getParam(cgi, "fromAccount", p2));
+        keep(getParam(cgi, "toAccount", p3));
+        keep(getParam(cgi, "amount", p4));
+    });
+}
+
+void benchJson() {
+    BenchRequestScope scope;
+    bench("json/error", [&] {
+        jsonError("Недостаточно средств.");
+        keep(scope.resp.body);
+    });
+    bench("json/transfer ok", [&] {
+        jsonBody().beginObject()
+            .field("success", true)
+            .field("message", "Перевод выполнен.")
+            .field("newBalance", Money(1234567))
+            .endObject();
+        keep(scope.resp.body);
+    });
+    bench("json/error with escaping", [&] {
+        jsonError("Ошибка: \"строка\"\n\tс управляющими символами \\ и кавычками");
+        keep(scope.resp.body);
+    });
+
+    vector<Account> accounts = {
+        { "4000123412341234", Money(100000) },
+        { "4000432143214321", Money(2550) },
+        { "4000111122223333", Money(0) },
+    };
+    bench("json/dashboard (3 accounts)", [&] {
+        JsonWriter w = jsonBody();
+        w.beginObject()
+            .field("success", true)
+            .key("user").beginObject()
+                .field("id", 42)
+                .field("fullName", "Иван Иванов")
+                .field("email", "ivan@example.com")
+            .endObject()
+            .key("accounts").beginArray();
+        for (const Account& a : accounts) {
+            w.beginObject().field("number", a.number).field("balance", a.balance).endObject();
+        }
+        w.endArray().field("accountCount", accounts.size()).field("accountLimit", 3).endObject();
+        keep(scope.resp.body);
+    });
+}
+
+// Хэширование паролей: один поток и пул потоков хэширования (как в --serve,
+// но на все ядра). Один хэш — десятки мс, поэтому без прогрева bench().
+// Хэшей в секунду на ядро — сколько входов в секунду выдержит каждое ядро,
+// отданное password_hash_threads.
+void benchPasswords() {
+    const ScryptParams& sp = scryptParams();
+    char name[96];
+    snprintf(name, sizeof(name), "scrypt ln=%d r=%d p=%d", sp.log2n, sp.r, sp.p);
+    string base = name;
+    const string password = "correct horse battery";
+
+    string single = "password/" + base + " (1 поток)";
+    if (benchOptions.filter.empty() || single.find(benchOptions.filter) != string::npos) {
+        uint64_t n = 0;
+        auto start = Clock::now();
+        double secs = 0;
+        do {
+            keep(scryptHash(password, sp));
+            ++n;
+            secs = chrono::duration<double>(Clock::now() - start).count();
+        } while (secs < benchOptions.minTime);
+        BenchResult r{ single, secs * 1e9 / n, n };
+        printf("%-44s %12.1f ns/op %14llu   %.1f хэшей/с на ядро\n", single.c_str(), r.nsPerOp,
+               static_cast<unsigned long long>(n), n / secs);
+        benchResults.push_back(r);
+    }
+
+    int threads = static_cast<int>(max(1u, thread::hardware_concurrency()));
+    string pooled = "password/" + base + " (пул, потоков: " + to_string(threads) + ")";
+    if (benchOptions.filter.empty() || pooled.find(benchOptions.filter) != string::npos) {
+        PasswordHasher& hasher = passwordHasher();
+        hasher.start(threads);
+        uint64_t n = 0;
+        auto start = Clock::now();
+        double secs = 0;
+        do {
+            vector<shared_ptr<PasswordHasher::Job>> jobs;
+            for (int i = 0; i < threads * 2; ++i) {
+                jobs.push_back(hasher.submit([&] { keep(scryptHash(password, sp)); }));
+            }
+            for (auto& job : jobs) hasher.wait(job);
+            n += jobs.size();
+            secs = chrono::duration<double>(Clock::now() - start).count();
+        } while (secs < benchOptions.minTime);
+        BenchResult r{ pooled, secs * 1e9 / n, n };
+        printf("%-44s %12.1f ns/op %14llu   %.1f хэшей/с на ядро\n", pooled.c_str(), r.nsPerOp,
+               static_cast<unsigned long long>(n), n / secs / threads);
+        benchResults.push_back(r);
+    }
+}
+
+// Полный путь запроса, который отклоняется до БД: разбор, диспетчер, проверка, JSON
+void benchRejectedRequests() {
+    string remote = "127.0.0.1";
+    Response resp;
+    vector<pair<string, HttpRequest>> cases = {
+        { "request/no action",         makeRequest("GET", "", "") },
+        { "request/unknown action",    makeRequest("GET", "action=hack", "") },
+        { "request/getAccounts bad id", makeRequest("GET", "action=getAccounts&userId=1%27%20OR%201=1", "") },
+        { "request/topup bad amount",  makeRequest("POST", "",
+              "action=topup&accountNumber=4000123412341234&amount=abc") },
+        { "request/transfer same acc", makeRequest("POST", "",
+              "action=transfer&fromAccount=4000123412341234&toAccount=4000123412341234&amount=1") },
+    };
+    for (auto& c : cases) {
+        HttpRequest& req = c.second;
+        bench(c.first, [&] {
+            HttpCgiInput input(req, remote);
+            handleRequest(&input, resp);
+            keep(resp.body);
+        });
+    }
+}
+
+// ===================== MAIN =====================
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--filter" && i + 1 < argc)        benchOptions.filter = argv[++i];
+        else if (a == "--min-time" && i + 1 < argc) benchOptions.minTime = atof(argv[++i]);
+        else if (a == "--csv" && i + 1 < argc)      benchOptions.csv = argv[++i];
+        else {
+            cerr << "Использование: bench_micro [--filter ПОДСТРОКА] [--min-time СЕК] [--csv ФАЙЛ]\n";
+            return 2;
+        }
+    }
+
+    benchParsing();
+    benchCgi();
+    benchJson();
+    benchRejectedRequests();
+    benchPasswords();
+
+    if (!benchOptions.csv.empty()) {
+        ofstream out(benchOptions.csv);
+        out << "name,ns_per_op,iterations\n";
+        for (const BenchResult& r : benchResults) {
+            out << '"' << r.name << "\"," << r.nsPerOp << ',' << r.iterations << '\n';
+        }
+        if (!out) {
+            cerr << "bench_micro: не удалось записать " << benchOptions.csv << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
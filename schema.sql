@@ -0,0 +1,457 @@
+-- Схема БД bankdb для bank.cgi.
+-- Скрипт идемпотентный: его можно применять и к пустой базе, и к уже работающей.
+--   psql -d bankdb -f schema.sql
+
+CREATE TABLE IF NOT EXISTS users (
+    id        SERIAL PRIMARY KEY,
+    full_name TEXT NOT NULL,
+    email     TEXT NOT NULL UNIQUE,
+    password  TEXT NOT NULL   -- хэш scrypt ($scrypt$...); открытый текст старых строк заменяется при входе
+);
+
+CREATE TABLE IF NOT EXISTS accounts (
+    id      SERIAL PRIMARY KEY,
+    user_id INTEGER NOT NULL REFERENCES users(id),
+    number  VARCHAR(16) NOT NULL UNIQUE,
+    balance NUMERIC(18, 2) NOT NULL DEFAULT 0
+);
+
+CREATE INDEX IF NOT EXISTS accounts_user_id_idx ON accounts(user_id);
+
+-- Создание счёта (запрос create_account в bank.cpp): проверка пользователя,
+-- лимита счетов и вставка. Строка пользователя блокируется, а счета считаются
+-- уже после блокировки, отдельным запросом со свежим снимком: в одном запросе
+-- с FOR UPDATE подсчёт видел бы снимок до ожидания блокировки, и одновременные
+-- создания счетов одного пользователя превысили бы лимит. Занятый номер —
+-- inserted = false, bank.cgi повторяет с другим номером.
+CREATE OR REPLACE FUNCTION create_account(p_user_id INTEGER, p_number TEXT, p_limit BIGINT,
+    OUT user_found BOOLEAN, OUT account_count BIGINT, OUT inserted BOOLEAN) AS $$
+BEGIN
+    PERFORM 1 FROM users WHERE id = p_user_id FOR UPDATE;
+    user_found := FOUND;
+    SELECT count(*) INTO account_count FROM accounts WHERE user_id = p_user_id;
+    inserted := false;
+    IF user_found AND account_count < p_limit THEN
+        INSERT INTO accounts(user_id, number, balance) VALUES (p_user_id, p_number, 0)
+        ON CONFLICT (number) DO NOTHING;
+        inserted := FOUND;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Балансы с фиксированной точностью (копейки). Старые базы хранили
+-- double precision — переводим один раз, с округлением до копеек.
+DO $$
+BEGIN
+    IF (SELECT data_type FROM information_schema.columns
+        WHERE table_name = 'accounts' AND column_name = 'balance') <> 'numeric' THEN
+        ALTER TABLE accounts
+            ALTER COLUMN balance TYPE NUMERIC(18, 2) USING round(balance::numeric, 2);
+    END IF;
+END
+$$;
+
+-- Уведомления об изменениях счетов для кэша bank.cgi (канал bank_changes,
+-- полезная нагрузка "номер:user_id"): открытие и закрытие счёта, смена
+-- владельца или номера. Изменения баланса не уведомляют: транзакция с NOTIFY
+-- при фиксации берёт общую на кластер блокировку очереди уведомлений, и все
+-- пополнения, снятия и переводы выстраивались бы в одну очередь. Балансы
+-- в кэше держатся недолго (cache_ttl), свои записи bank.cgi сбрасывает сам.
+-- Массовая загрузка (bank_tool) выставляет bank.bulk_load = on и вместо
+-- уведомления на строку шлёт одно "*".
+CREATE OR REPLACE FUNCTION accounts_notify_change() RETURNS trigger AS $$
+BEGIN
+    IF current_setting('bank.bulk_load', true) = 'on' THEN
+        RETURN NULL;
+    END IF;
+    IF TG_OP = 'UPDATE' AND NEW.number = OLD.number AND NEW.user_id IS NOT DISTINCT FROM OLD.user_id THEN
+        RETURN NULL;
+    END IF;
+    IF TG_OP = 'DELETE' THEN
+        PERFORM pg_notify('bank_changes', OLD.number || ':' || OLD.user_id);
+    ELSE
+        PERFORM pg_notify('bank_changes', NEW.number || ':' || NEW.user_id);
+    END IF;
+    RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+DROP TRIGGER IF EXISTS accounts_notify_change ON accounts;
+CREATE TRIGGER accounts_notify_change
+    AFTER INSERT OR UPDATE OF number, user_id OR DELETE ON accounts
+    FOR EACH ROW EXECUTE FUNCTION accounts_notify_change();
+
+-- ===================== ЖУРНАЛ ОПЕРАЦИЙ =====================
+-- Каждое движение денег (пополнение, снятие, обе стороны перевода) — строка
+-- в ledger, в той же транзакции, что и изменение баланса. Записи только
+-- добавляются: изменение и удаление запрещены триггером. account_id без
+-- внешнего ключа — история переживает закрытие счёта (id не переиспользуются).
+-- История читается постранично по ключу (account_id, id): страница — это
+-- «записи счёта с id меньше курсора», индекс отдаёт её за O(размер страницы)
+-- на любой глубине, в отличие от OFFSET.
+
+CREATE TABLE IF NOT EXISTS ledger (
+    id            BIGSERIAL PRIMARY KEY,
+    account_id    INTEGER NOT NULL,
+    kind          VARCHAR(16) NOT NULL,   -- topup, withdraw, transfer_out, transfer_in, import
+    amount        NUMERIC(18, 2) NOT NULL,   -- со знаком: списания отрицательные
+    balance_after NUMERIC(18, 2) NOT NULL,
+    counterparty  VARCHAR(16),               -- номер второго счёта для переводов
+    created_at    TIMESTAMPTZ NOT NULL DEFAULT now()
+);
+
+CREATE INDEX IF NOT EXISTS ledger_account_id_idx ON ledger(account_id, id);
+
+-- Выписка за период (exportStatement) выбирает записи счёта по времени
+CREATE INDEX IF NOT EXISTS ledger_account_created_idx ON ledger(account_id, created_at);
+
+CREATE OR REPLACE FUNCTION ledger_append_only() RETURNS trigger AS $$
+BEGIN
+    RAISE EXCEPTION 'Журнал операций только пополняется (%)', TG_OP;
+END;
+$$ LANGUAGE plpgsql;
+
+DROP TRIGGER IF EXISTS ledger_append_only ON ledger;
+CREATE TRIGGER ledger_append_only
+    BEFORE UPDATE OR DELETE ON ledger
+    FOR EACH ROW EXECUTE FUNCTION ledger_append_only();
+
+DROP TRIGGER IF EXISTS ledger_no_truncate ON ledger;
+CREATE TRIGGER ledger_no_truncate
+    BEFORE TRUNCATE ON ledger
+    FOR EACH STATEMENT EXECUTE FUNCTION ledger_append_only();
+
+-- ===================== СЛОТЫ БАЛАНСА =====================
+-- Для «горячих» счетов (много одновременных зачислений) баланс можно разбить
+-- на N строк-слотов: зачисление идёт в случайный слот, и параллельные операции
+-- не ждут одну блокировку строки accounts. Баланс такого счёта —
+-- accounts.balance плюс сумма его слотов. У обычного счёта slots = 0 и строк
+-- в account_slots нет. Используется bank.cgi при account_slots = 1 в bank.conf.
+--   SELECT enable_account_slots('4000...', 8);   -- разбить счёт на 8 слотов
+--   SELECT disable_account_slots('4000...');     -- собрать обратно
+--   SELECT fold_all_account_slots();             -- свести слоты (bank.cgi делает это сам)
+
+ALTER TABLE accounts ADD COLUMN IF NOT EXISTS slots SMALLINT NOT NULL DEFAULT 0;
+
+CREATE TABLE IF NOT EXISTS account_slots (
+    account_id INTEGER NOT NULL REFERENCES accounts(id) ON DELETE CASCADE,
+    slot       SMALLINT NOT NULL,
+    balance    NUMERIC(18, 2) NOT NULL DEFAULT 0,
+    PRIMARY KEY (account_id, slot)
+);
+
+-- Полный баланс счёта (основная строка + слоты)
+CREATE OR REPLACE FUNCTION account_total(p_account_id INTEGER) RETURNS NUMERIC AS $$
+    SELECT a.balance + COALESCE((SELECT SUM(s.balance) FROM account_slots s
+                                  WHERE s.account_id = a.id), 0)
+      FROM accounts a WHERE a.id = p_account_id;
+$$ LANGUAGE sql STABLE;
+
+-- Перенести деньги из слотов в основную строку. p_wait = false — пропускать
+-- слоты, занятые другими транзакциями (периодическая свёртка не должна
+-- тормозить зачисления); p_wait = true — дождаться и свести все.
+CREATE OR REPLACE FUNCTION fold_account_slots(p_account_id INTEGER, p_wait BOOLEAN)
+RETURNS NUMERIC AS $$
+DECLARE
+    moved NUMERIC := 0;
+    s RECORD;
+BEGIN
+    -- Основная строка блокируется раньше слотов — в том же порядке, что
+    -- и в консолидированном пути account_debit
+    IF p_wait THEN
+        PERFORM 1 FROM accounts WHERE id = p_account_id FOR UPDATE;
+        FOR s IN SELECT slot, balance FROM account_slots
+                  WHERE account_id = p_account_id ORDER BY slot FOR UPDATE LOOP
+            moved := moved + s.balance;
+        END LOOP;
+        UPDATE account_slots SET balance = 0
+         WHERE account_id = p_account_id AND balance <> 0;
+    ELSE
+        PERFORM 1 FROM accounts WHERE id = p_account_id FOR UPDATE SKIP LOCKED;
+        IF NOT FOUND THEN
+            RETURN 0;
+        END IF;
+        FOR s IN SELECT slot, balance FROM account_slots
+                  WHERE account_id = p_account_id AND balance <> 0
+                  FOR UPDATE SKIP LOCKED LOOP
+            moved := moved + s.balance;
+            UPDATE account_slots SET balance = 0
+             WHERE account_id = p_account_id AND slot = s.slot;
+        END LOOP;
+    END IF;
+    IF moved <> 0 THEN
+        UPDATE accounts SET balance = balance + moved WHERE id = p_account_id;
+    END IF;
+    RETURN moved;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Периодическая свёртка всех счетов со слотами; возвращает число затронутых счетов
+CREATE OR REPLACE FUNCTION fold_all_account_slots() RETURNS INTEGER AS $$
+DECLARE
+    n INTEGER := 0;
+    acc RECORD;
+BEGIN
+    FOR acc IN SELECT id FROM accounts WHERE slots > 0 LOOP
+        IF fold_account_slots(acc.id, false) <> 0 THEN
+            n := n + 1;
+        END IF;
+    END LOOP;
+    RETURN n;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION enable_account_slots(p_number TEXT, p_slots INTEGER) RETURNS VOID AS $$
+DECLARE
+    acc_id INTEGER;
+BEGIN
+    IF p_slots < 1 OR p_slots > 256 THEN
+        RAISE EXCEPTION 'Число слотов должно быть от 1 до 256';
+    END IF;
+    SELECT id INTO acc_id FROM accounts WHERE number = p_number FOR UPDATE;
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'Счёт % не найден', p_number;
+    END IF;
+    PERFORM fold_account_slots(acc_id, true);
+    DELETE FROM account_slots WHERE account_id = acc_id;
+    INSERT INTO account_slots(account_id, slot)
+        SELECT acc_id, g FROM generate_series(0, p_slots - 1) g;
+    UPDATE accounts SET slots = p_slots WHERE id = acc_id;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION disable_account_slots(p_number TEXT) RETURNS VOID AS $$
+DECLARE
+    acc_id INTEGER;
+BEGIN
+    SELECT id INTO acc_id FROM accounts WHERE number = p_number FOR UPDATE;
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'Счёт % не найден', p_number;
+    END IF;
+    PERFORM fold_account_slots(acc_id, true);
+    DELETE FROM account_slots WHERE account_id = acc_id;
+    UPDATE accounts SET slots = 0 WHERE id = acc_id;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Зачисление по id: у обычного счёта — в основную строку, у счёта со слотами —
+-- в случайный слот (строка accounts при этом не блокируется). Возвращает баланс.
+-- Слот выбирается один раз заранее: random() в условии UPDATE вычислялся бы
+-- заново для каждой строки, и сумма попала бы в ноль или в несколько слотов.
+CREATE OR REPLACE FUNCTION account_credit(p_account_id INTEGER, p_slots INTEGER, p_amount NUMERIC)
+RETURNS NUMERIC AS $$
+DECLARE
+    result NUMERIC;
+    s_slot INTEGER;
+BEGIN
+    IF p_slots = 0 THEN
+        UPDATE accounts SET balance = balance + p_amount
+         WHERE id = p_account_id RETURNING balance INTO result;
+        RETURN result;
+    END IF;
+    s_slot := floor(random() * p_slots)::int;
+    UPDATE account_slots SET balance = balance + p_amount
+     WHERE account_id = p_account_id AND slot = s_slot;
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'У счёта % нет слота %', p_account_id, s_slot;
+    END IF;
+    RETURN account_total(p_account_id);
+END;
+$$ LANGUAGE plpgsql;
+
+-- Списание по id. У счёта со слотами сначала ищется свободный слот с достаточной
+-- суммой, затем основная строка; если ни там, ни там не хватает — слоты
+-- сводятся в основную строку под блокировкой и списание идёт из неё.
+-- Возвращает новый баланс или NULL, если средств недостаточно.
+CREATE OR REPLACE FUNCTION account_debit(p_account_id INTEGER, p_slots INTEGER, p_amount NUMERIC)
+RETURNS NUMERIC AS $$
+DECLARE
+    result NUMERIC;
+    s_slot SMALLINT;
+BEGIN
+    IF p_slots > 0 THEN
+        SELECT slot INTO s_slot FROM account_slots
+         WHERE account_id = p_account_id AND balance >= p_amount
+         ORDER BY random() LIMIT 1
+         FOR UPDATE SKIP LOCKED;
+        IF FOUND THEN
+            UPDATE account_slots SET balance = balance - p_amount
+             WHERE account_id = p_account_id AND slot = s_slot;
+            RETURN account_total(p_account_id);
+        END IF;
+    END IF;
+
+    UPDATE accounts SET balance = balance - p_amount
+     WHERE id = p_account_id AND balance >= p_amount RETURNING balance INTO result;
+    IF p_slots = 0 OR result IS NOT NULL THEN
+        RETURN CASE WHEN p_slots = 0 THEN result ELSE account_total(p_account_id) END;
+    END IF;
+
+    -- Консолидированный путь: в отдельных строках не хватает, но в сумме может хватить
+    PERFORM fold_account_slots(p_account_id, true);
+    UPDATE accounts SET balance = balance - p_amount
+     WHERE id = p_account_id AND balance >= p_amount RETURNING balance INTO result;
+    RETURN result;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Точки входа для bank.cgi (запросы *_slots). Формат результата и записи
+-- в журнал те же, что у однострочных запросов balance_add / withdraw / transfer.
+-- p_parts — суммы пополнений в копейках (несколько — при склейке пополнений).
+CREATE OR REPLACE FUNCTION slots_credit(p_number TEXT, p_parts BIGINT[]) RETURNS NUMERIC AS $$
+DECLARE
+    acc RECORD;
+    part BIGINT;
+    result NUMERIC;
+BEGIN
+    SELECT id, slots INTO acc FROM accounts WHERE number = p_number;
+    IF NOT FOUND THEN
+        RETURN NULL;
+    END IF;
+    FOREACH part IN ARRAY p_parts LOOP
+        result := account_credit(acc.id, acc.slots, part / 100.0);
+        INSERT INTO ledger(account_id, kind, amount, balance_after)
+            VALUES (acc.id, 'topup', part / 100.0, result);
+    END LOOP;
+    RETURN result;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION slots_withdraw(p_number TEXT, p_amount NUMERIC,
+                                          OUT acc_found BOOLEAN, OUT new_balance NUMERIC) AS $$
+DECLARE
+    acc RECORD;
+BEGIN
+    SELECT id, slots INTO acc FROM accounts WHERE number = p_number;
+    acc_found := FOUND;
+    IF acc_found THEN
+        new_balance := account_debit(acc.id, acc.slots, p_amount);
+        IF new_balance IS NOT NULL THEN
+            INSERT INTO ledger(account_id, kind, amount, balance_after)
+                VALUES (acc.id, 'withdraw', -p_amount, new_balance);
+        END IF;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Перевод. Между обычными счетами строки блокируются в порядке номеров, как
+-- в запросе transfer; если хотя бы один счёт со слотами, списание и зачисление
+-- идут через account_debit / account_credit (возможная взаимоблокировка
+-- встречных переводов снимается повтором на стороне bank.cgi).
+CREATE OR REPLACE FUNCTION slots_transfer(p_from TEXT, p_to TEXT, p_amount NUMERIC,
+                                          OUT from_found BOOLEAN, OUT to_found BOOLEAN,
+                                          OUT new_balance NUMERIC) AS $$
+DECLARE
+    f RECORD;
+    t RECORD;
+    to_balance NUMERIC;
+BEGIN
+    SELECT id, slots INTO f FROM accounts WHERE number = p_from;
+    from_found := FOUND;
+    SELECT id, slots INTO t FROM accounts WHERE number = p_to;
+    to_found := FOUND;
+    IF NOT from_found OR NOT to_found THEN
+        RETURN;
+    END IF;
+    IF f.slots = 0 AND t.slots = 0 THEN
+        PERFORM 1 FROM accounts WHERE id IN (f.id, t.id) ORDER BY number FOR UPDATE;
+    END IF;
+    new_balance := account_debit(f.id, f.slots, p_amount);
+    IF new_balance IS NOT NULL THEN
+        to_balance := account_credit(t.id, t.slots, p_amount);
+        INSERT INTO ledger(account_id, kind, amount, balance_after, counterparty)
+            VALUES (f.id, 'transfer_out', -p_amount, new_balance, p_to),
+                   (t.id, 'transfer_in', p_amount, to_balance, p_from);
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Слоты меняют только баланс — кэш bank.cgi о них не уведомляется (см. accounts_notify_change)
+DROP TRIGGER IF EXISTS account_slots_notify_change ON account_slots;
+DROP FUNCTION IF EXISTS account_slots_notify_change();
+
+-- Стороны перевода между шардами со слотами (запросы transfer_*_slots).
+-- Результат как у slots_withdraw; у зачисления new_balance есть всегда.
+CREATE OR REPLACE FUNCTION slots_transfer_debit(p_number TEXT, p_amount NUMERIC, p_counterparty TEXT,
+                                                OUT acc_found BOOLEAN, OUT new_balance NUMERIC) AS $$
+DECLARE
+    acc RECORD;
+BEGIN
+    SELECT id, slots INTO acc FROM accounts WHERE number = p_number;
+    acc_found := FOUND;
+    IF acc_found THEN
+        new_balance := account_debit(acc.id, acc.slots, p_amount);
+        IF new_balance IS NOT NULL THEN
+            INSERT INTO ledger(account_id, kind, amount, balance_after, counterparty)
+                VALUES (acc.id, 'transfer_out', -p_amount, new_balance, p_counterparty);
+        END IF;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE OR REPLACE FUNCTION slots_transfer_credit(p_number TEXT, p_amount NUMERIC, p_counterparty TEXT,
+                                                 OUT acc_found BOOLEAN, OUT new_balance NUMERIC) AS $$
+DECLARE
+    acc RECORD;
+BEGIN
+    SELECT id, slots INTO acc FROM accounts WHERE number = p_number;
+    acc_found := FOUND;
+    IF acc_found THEN
+        new_balance := account_credit(acc.id, acc.slots, p_amount);
+        INSERT INTO ledger(account_id, kind, amount, balance_after, counterparty)
+            VALUES (acc.id, 'transfer_in', p_amount, new_balance, p_counterparty);
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- ===================== ШАРДЫ =====================
+-- При нескольких узлах (shard_conninfo в bank.conf) каждый узел хранит свою
+-- часть пользователей со всеми их счетами и журналом. schema.sql применяется
+-- к каждому узлу, затем узел настраивается на свой номер (с нуля):
+--   SELECT configure_shard(0, 4);   -- первый узел из четырёх, и т.д.
+-- После этого id пользователей узла выдаются с шагом N и дают (id - 1) % N =
+-- номер шарда — по id bank.cgi находит шард без справочника. Настраивать
+-- нужно до регистрации пользователей через bank.cgi.
+--
+-- Переводы между шардами — двухфазная фиксация (PREPARE TRANSACTION), на
+-- узлах нужен max_prepared_transactions > 0 (с запасом — не меньше pool_max,
+-- умноженного на число процессов bank.cgi).
+
+CREATE OR REPLACE FUNCTION configure_shard(p_shard INTEGER, p_count INTEGER) RETURNS VOID AS $$
+DECLARE
+    seq TEXT := pg_get_serial_sequence('users', 'id');
+    next_id BIGINT;
+BEGIN
+    IF p_count < 1 OR p_count > 100 OR p_shard < 0 OR p_shard >= p_count THEN
+        RAISE EXCEPTION 'Некорректный номер шарда % из %', p_shard, p_count;
+    END IF;
+    -- Следующий id: больше уже выданных и с остатком (id - 1) % N = p_shard
+    SELECT GREATEST(COALESCE(MAX(id), 0), COALESCE(pg_sequence_last_value(seq::regclass), 0)) + 1
+      INTO next_id FROM users;
+    next_id := next_id + ((p_shard - (next_id - 1) % p_count) + p_count) % p_count;
+    EXECUTE format('ALTER SEQUENCE %s INCREMENT BY %s', seq, p_count);
+    PERFORM setval(seq, next_id, false);
+END;
+$$ LANGUAGE plpgsql;
+
+-- Решения по переводам между шардами (на шарде отправителя). Строка с
+-- committed = true записывается координатором — это точка фиксации перевода;
+-- committed = false — восстановлением для перевода, решения по которому не было.
+CREATE TABLE IF NOT EXISTS xfer_outcomes (
+    gid        TEXT PRIMARY KEY,
+    committed  BOOLEAN NOT NULL,
+    decided_at TIMESTAMPTZ NOT NULL DEFAULT now()
+);
+
+-- Исход перевода для восстановления: нет решения — записать «откатить».
+-- Если координатор как раз записывает решение, INSERT дождётся его фиксации.
+CREATE OR REPLACE FUNCTION xfer_outcome(p_gid TEXT) RETURNS BOOLEAN AS $$
+DECLARE
+    result BOOLEAN;
+BEGIN
+    INSERT INTO xfer_outcomes(gid, committed) VALUES (p_gid, false)
+        ON CONFLICT (gid) DO NOTHING;
+    SELECT committed INTO result FROM xfer_outcomes WHERE gid = p_gid;
+    RETURN result;
+END;
+$$ LANGUAGE plpgsql;
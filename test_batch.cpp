@@ -0,0 +1,110 @@
+// Сборка:
+//   g++ -O2 -std=c++17 test_batch.cpp -o test_batch -pthread -lcgicc -lpq -lfcgi -lcrypto
+//
+// Проверка пакетных операций (action=batch) на живой БД: та же конфигурация,
+// что у bank.cgi (bank.conf, BANK_CONNINFO), схема — schema.sql. Тест заводит
+// своего пользователя с адресом test-batch-<время>@example.com.
+//
+//   ./test_batch
+//
+// Код выхода 0 — все проверки прошли, 1 — нет (что именно, печатается).
+
+#define BANK_NO_MAIN
+#include "bank.cpp"
+
+// ===================== ОКРУЖЕНИЕ ЗАПРОСА =====================
+
+int failures = 0;
+
+void check(bool ok, const string& what) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", what.c_str());
+    if (!ok) ++failures;
+}
+
+// Выполнить запрос, как его выполнил бы bank.cgi, и вернуть тело ответа
+string call(const string& body) {
+    HttpRequest req;
+    req.method = "POST";
+    req.target = "/cgi-bin/bank.cgi";
+    req.version = "HTTP/1.1";
+    req.body = body;
+    req.headers["content-type"] = "application/x-www-form-urlencoded";
+    string remote = "127.0.0.1";
+    HttpCgiInput input(req, remote);
+    Response resp;
+    handleRequest(&input, resp);
+    return resp.body;
+}
+
+// Значение поля верхнего уровня ответа (число или строка без экранирования)
+string field(const string& json, const string& key) {
+    size_t p = json.find("\"" + key + "\":");
+    if (p == string::npos) return "";
+    p += key.size() + 3;
+    if (json[p] == '"') return json.substr(p + 1, json.find('"', p + 1) - p - 1);
+    return json.substr(p, json.find_first_of(",}", p) - p);
+}
+
+size_t countOf(const string& s, const string& needle) {
+    size_t n = 0;
+    for (size_t p = s.find(needle); p != string::npos; p = s.find(needle, p + 1)) ++n;
+    return n;
+}
+
+// ===================== ПРОВЕРКИ =====================
+
+// Без atomic операции независимы: неудачная операция в первом окне конвейера
+// не должна мешать операциям следующих окон
+void testIndependentItems(const string& account) {
+    const int ops = 20;   // при batch_window = 8 — три окна
+    string list = "[{\"type\":\"withdraw\",\"accountNumber\":\"" + account + "\",\"amount\":1000000}";
+    for (int i = 1; i < ops; ++i) {
+        list += ",{\"type\":\"topup\",\"accountNumber\":\"" + account + "\",\"amount\":1}";
+    }
+    list += "]";
+
+    string resp = call("action=batch&operations=" + list);
+    check(field(resp, "success") == "true", "пакет без atomic выполнен");
+    check(countOf(resp, "\"success\":false") == 1, "не прошла только первая операция (снятие сверх баланса)");
+    check(countOf(resp, "\"success\":true") == 1 + (ops - 1), "пополнения во всех окнах выполнены");
+
+    string balance = call("action=getBalance&accountNumber=" + account);
+    check(field(balance, "balance") == "19.00", "баланс после пакета: 19.00 (получено " + field(balance, "balance") + ")");
+}
+
+// С atomic неудача одной операции отменяет весь пакет
+void testAtomicRollback(const string& account) {
+    string list = "[{\"type\":\"topup\",\"accountNumber\":\"" + account + "\",\"amount\":5},"
+                  "{\"type\":\"withdraw\",\"accountNumber\":\"" + account + "\",\"amount\":1000000}]";
+    string resp = call("action=batch&atomic=1&operations=" + list);
+    check(field(resp, "success") == "false", "атомарный пакет с неудачной операцией не зафиксирован");
+
+    string balance = call("action=getBalance&accountNumber=" + account);
+    check(field(balance, "balance") == "19.00", "баланс после отката не изменился");
+}
+
+// ===================== MAIN =====================
+
+int main() {
+    setenv("BANK_BATCH_WINDOW", "8", 1);
+
+    string email = "test-batch-" + to_string(time(nullptr)) + "@example.com";
+    string reg = call("action=register&fullName=Test&email=" + email + "&password=secret123");
+    string userId = field(reg, "userId");
+    if (userId.empty()) {
+        fprintf(stderr, "test_batch: не удалось зарегистрировать пользователя: %s\n", reg.c_str());
+        return 1;
+    }
+    string created = call("action=createAccount&userId=" + userId);
+    string account = field(created, "accountNumber");
+    if (account.empty()) {
+        fprintf(stderr, "test_batch: не удалось открыть счёт: %s\n", created.c_str());
+        return 1;
+    }
+
+    testIndependentItems(account);
+    testAtomicRollback(account);
+
+    printf("%s\n", failures == 0 ? "все проверки прошли" : "есть ошибки");
+    return failures == 0 ? 0 : 1;
+}
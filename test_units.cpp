@@ -0,0 +1,204 @@
+// Сборка:
+//   g++ -O2 -std=c++17 test_units.cpp -o test_units -pthread -lcgicc -lpq -lfcgi -lcrypto
+//
+// Проверки чистой логики bank.cgi, которой не нужна БД: суммы (parseMoney /
+// formatMoney), экранирование JsonWriter, номера счетов (Луна), вёдра
+// LatencyHistogram и выбор шарда ShardMap. Шардов для проверки три,
+// их строки подключения не используются (BANK_SHARD_CONNINFO задаётся здесь же).
+//
+//   ./test_units
+//
+// Код выхода 0 — все проверки прошли, 1 — нет (что именно, печатается).
+
+#define BANK_NO_MAIN
+#include "bank.cpp"
+
+// ===================== ПРОВЕРКИ =====================
+
+int failures = 0;
+
+void check(bool ok, const string& what) {
+    if (!ok) {
+        printf("FAIL %s\n", what.c_str());
+        ++failures;
+    }
+}
+
+// Сумма из строки; "ошибка" — строка не разобралась
+string parsed(const string& s) {
+    Money m;
+    return parseMoney(s, m) ? formatMoney(m) : "ошибка";
+}
+
+void testMoney() {
+    const pair<const char*, const char*> cases[] = {
+        { "0", "0.00" },
+        { "123", "123.00" },
+        { "123.4", "123.40" },
+        { "123.45", "123.45" },
+        { "123,45", "123.45" },       // запятая как разделитель
+        { "0,5", "0.50" },
+        { ".5", "0.50" },
+        { "7.", "7.00" },
+        { "+7", "7.00" },
+        { "-0.05", "-0.05" },
+        { "-123,4", "-123.40" },
+        { "9999999999999999.99", "9999999999999999.99" },   // предел numeric(18,2)
+        { "", "ошибка" },
+        { "-", "ошибка" },
+        { ".", "ошибка" },
+        { "1.234", "ошибка" },        // больше двух знаков после разделителя
+        { "10000000000000000", "ошибка" },   // 17 знаков — переполнение numeric(18,2)
+        { "1e3", "ошибка" },
+        { " 1", "ошибка" },
+        { "1 ", "ошибка" },
+        { "1.2.3", "ошибка" },
+        { "--1", "ошибка" },
+        { "1,2,3", "ошибка" },
+    };
+    for (const auto& c : cases) {
+        string got = parsed(c.first);
+        check(got == c.second, string("parseMoney(\"") + c.first + "\") = " + got + ", ожидалось " + c.second);
+    }
+
+    // Вывод и обратный разбор дают ту же сумму, включая крайние значения int64
+    const int64_t values[] = { 0, 1, -1, 99, -99, 100, -100, 12345, -12345,
+                               INT64_MAX, INT64_MIN + 1 };
+    for (int64_t v : values) {
+        Money back;
+        string s = formatMoney(Money(v));
+        // Больше 16 знаков до точки не разбирается — так и должно быть
+        bool fits = s.find('.') - (v < 0 ? 1 : 0) <= 16;
+        bool ok = parseMoney(s, back) ? fits && back.minor == v : !fits;
+        check(ok, "formatMoney/parseMoney: " + to_string(v) + " -> " + s);
+    }
+    check(formatMoney(Money(INT64_MIN)) == "-92233720368547758.08", "formatMoney(INT64_MIN)");
+    check(formatMoney(Money(-5)) == "-0.05", "formatMoney(-5)");
+}
+
+string json(void (*fill)(JsonWriter&)) {
+    string out;
+    JsonWriter w(out);
+    fill(w);
+    return out;
+}
+
+void testJson() {
+    string s = json([](JsonWriter& w) {
+        w.beginObject().field("a", string("x\"y\\z")).field("b", string("\n\r\t")).endObject();
+    });
+    check(s == "{\"a\":\"x\\\"y\\\\z\",\"b\":\"\\n\\r\\t\"}", "JsonWriter: кавычка, обратная черта, \\n\\r\\t: " + s);
+
+    // Прочие управляющие символы — \u00XX; 0x7f и UTF-8 идут как есть
+    s = json([](JsonWriter& w) {
+        w.value(string("\x01\x1f\x7f") + string(1, '\0') + "ё");
+    });
+    check(s == "\"\\u0001\\u001f\x7f\\u0000ё\"", "JsonWriter: управляющие символы: " + s);
+
+    // Запятые расставляются по уровням вложенности
+    s = json([](JsonWriter& w) {
+        w.beginObject()
+            .key("list").beginArray().value(1).value(-2).beginObject().endObject().endArray()
+            .key("empty").beginArray().endArray()
+            .field("sum", Money(-150))
+            .key("none").null()
+            .field("ok", true)
+            .endObject();
+    });
+    check(s == "{\"list\":[1,-2,{}],\"empty\":[],\"sum\":-1.50,\"none\":null,\"ok\":true}",
+          "JsonWriter: вложенность: " + s);
+}
+
+void testAccountNumbers() {
+    check(luhnCheckDigit("7992739871") == '3', "luhnCheckDigit(7992739871) = 3");
+    check(luhnCheckDigit("0") == '0', "luhnCheckDigit(0) = 0");
+
+    for (int shard : { 0, 7, 42, 99 }) {
+        for (int i = 0; i < 100; ++i) {
+            string n = generateAccountNumber(shard);
+            char want[3];
+            snprintf(want, sizeof(want), "%02d", shard);
+            bool ok = n.size() == 16 && n.compare(0, 4, "4000") == 0 && n.compare(4, 2, want) == 0 &&
+                      n.find_first_not_of("0123456789") == string::npos &&
+                      luhnCheckDigit(n.substr(0, 15)) == n[15];
+            check(ok, "generateAccountNumber(" + to_string(shard) + ") = " + n);
+        }
+    }
+}
+
+void testHistogram() {
+    typedef LatencyHistogram H;
+    // Каждое значение попадает в ведро, границы которого его содержат, а вёдра
+    // идут подряд без разрывов
+    vector<uint64_t> values;
+    for (uint64_t v = 0; v < 64; ++v) values.push_back(v);
+    for (int b = 4; b < H::MAX_BITS; ++b) {
+        uint64_t p = 1ULL << b;
+        values.insert(values.end(), { p - 1, p, p + 1, p + p / 2 });
+    }
+    for (uint64_t v : values) {
+        int i = H::index(v);
+        uint64_t lower = i == 0 ? 0 : H::upperBound(i - 1);
+        check(i >= 0 && i < H::BUCKETS && lower <= v && v < H::upperBound(i),
+              "LatencyHistogram: " + to_string(v) + " -> ведро " + to_string(i));
+    }
+    check(H::index(15) == 15 && H::index(16) == 16 && H::upperBound(15) == 16, "LatencyHistogram: граница точных вёдер");
+    check(H::index((1ULL << H::MAX_BITS) - 1) == H::BUCKETS - 1, "LatencyHistogram: последнее ведро");
+    check(H::index(1ULL << H::MAX_BITS) == H::BUCKETS - 1 && H::index(UINT64_MAX) == H::BUCKETS - 1,
+          "LatencyHistogram: значения сверх предела — в последнее ведро");
+
+    // Относительная погрешность ведра — не больше 1/16
+    for (int i = H::SUB_COUNT; i < H::BUCKETS; ++i) {
+        uint64_t lower = H::upperBound(i - 1), upper = H::upperBound(i);
+        check((upper - lower) * H::SUB_COUNT <= lower, "LatencyHistogram: ширина ведра " + to_string(i));
+    }
+
+    H h;
+    for (uint64_t v = 1; v <= 1000; ++v) h.record(v);
+    check(h.count() == 1000 && h.sumMicros() == 500500, "LatencyHistogram: count/sum");
+    uint64_t p50 = h.quantile(0.5), p99 = h.quantile(0.99);
+    check(p50 >= 500 && p50 <= 500 + 500 / 16, "LatencyHistogram: p50 = " + to_string(p50));
+    check(p99 >= 990 && p99 <= 990 + 990 / 16, "LatencyHistogram: p99 = " + to_string(p99));
+    check(h.countAtMost(15) == 15 && h.countAtMost(0) == 0, "LatencyHistogram: countAtMost");
+    check(H().quantile(0.5) == 0, "LatencyHistogram: пустая");
+}
+
+void testShards() {
+    ShardMap& m = shards();
+    check(m.count() == 3, "ShardMap: три шарда");
+
+    check(m.ofUser(1) == 0 && m.ofUser(2) == 1 && m.ofUser(3) == 2 && m.ofUser(4) == 0,
+          "ShardMap: id пользователя выдаются шардам по кругу");
+    check(m.ofUser(0) == 0 && m.ofUser(-5) == 0, "ShardMap: несуществующий id");
+
+    int a = m.ofEmail("user@example.com");
+    check(a >= 0 && a < 3 && a == m.ofEmail("user@example.com"), "ShardMap: ofEmail устойчив");
+    bool spread[3] = {};
+    for (int i = 0; i < 100; ++i) spread[m.ofEmail("u" + to_string(i) + "@example.com")] = true;
+    check(spread[0] && spread[1] && spread[2], "ShardMap: адреса расходятся по всем шардам");
+
+    int shard = -1;
+    for (int s = 0; s < 3; ++s) {
+        check(m.ofAccount(generateAccountNumber(s), shard) && shard == s,
+              "ShardMap: счёт открывается на шарде " + to_string(s));
+    }
+    check(!m.ofAccount("4000030000000000", shard), "ShardMap: номер шарда за пределами");
+    check(!m.ofAccount("40000x0000000000", shard), "ShardMap: не цифра в номере шарда");
+    check(!m.ofAccount("40000", shard), "ShardMap: короткий номер");
+}
+
+// ===================== MAIN =====================
+
+int main() {
+    // До первого обращения к shards(): три шарда, к БД тест не подключается
+    setenv("BANK_SHARD_CONNINFO", "dbname=a|dbname=b|dbname=c", 1);
+
+    testMoney();
+    testJson();
+    testAccountNumbers();
+    testHistogram();
+    testShards();
+
+    printf("%s\n", failures == 0 ? "все проверки прошли" : "есть ошибки");
+    return failures == 0 ? 0 : 1;
+}